@@ -22,11 +22,12 @@
  *                  transfers. The maxPayloadSize was found to be 944 bytes(0x3B0). The data[] *
  *                  array is used to exchange data between the system and the camera.          *
  *               -> After the negotiation is complete, we can select the alternate setting     *
- *                  for interface 1(video streaming is controlled by interface 1). For the     *
- *                  maxPayloadSize of 944 bytes, the alternate setting value is 6. The         *
- *                  details regarding the alternate setting for maxPayloadSize and all the     *
- *                  configuration and device descriptors were obtained by probing the camera   *
- *                  with a Windows application called UVC viewer.                              *
+ *                  for the video streaming interface. The alternate settings and the          *
+ *                  wMaxPacketSize of their isochronous endpoints are read from the            *
+ *                  configuration descriptor (including the additional transactions per        *
+ *                  microframe of high-bandwidth endpoints), and the smallest one that can     *
+ *                  carry the negotiated maxPayloadSize is selected (alternate setting 6 for   *
+ *                  944 bytes on the Logitech C200).                                           *
  *               -> Once the interface alternate setting is successful, you are now ready to   *
  *                  ask the camera to transfer image data. But, before the camera can send the *
  *                  data, a pipe needs to be set up to the endpoint that supports isochronous  *
@@ -73,7 +74,9 @@
 #include <timers.h>
 #include <time.h>
 #include <tickLib.h>
+#include <vxAtomicLib.h>
 
+#include "UVC_Jpeg.h"
 #include "USB_Header.h"
 #include "drv/timer/timerDev.h"
 #include "usb/usbHubInitialization.h"
@@ -86,29 +89,33 @@
  *                                                          *
  ***********************************************************/
 
-UCHAR data[26] = {0};               /* Data buffer to be used in control transfers */
-UCHAR *isotrans_buffer;             /* Buffer where the image data will be stored */
-UCHAR image_buffer[(HRES*VRES*2)];  /* Buffer where the image data will be copied for further processing */
-UINT32 offset;                      /* To help in copying the data in the proper location as there are multiple transfers for sending a single image data */
-UINT16 frameCount;                  /* To maintain the count of total frames processed */
-UINT8 mem_h;                        /* Used to maintain and check the value of FID bit in the stream header */
-UINT8 end_of_image; 
-UINT8 aborted;
-UINT8 first;
+pUVC_DEVICE uvc_devices[MAX_CAMERAS];          /* Contexts of the attached cameras, indexed by UVC_DEVICE.uIndex */
+SEM_ID device_table_mutex = NULL;               /* Protects uvc_devices[] */
+SEM_ID bandwidth_mutex = NULL;                  /* Serialises the bandwidth manager; taken before any stream_mutex */
 
+REATTACH_ENTRY reattach_cache[REATTACH_CACHE_SIZE];    /* Configurations committed with cameras seen before */
+SEM_ID reattach_cache_mutex = NULL;             /* Protects reattach_cache[] */
+UINT32 reattach_cache_clock = 0;                /* Incremented at every use of an entry */
 
-char bigBuffer[(VRES*HRES*3)];     /* Buffer to store the data after YUV to RGB conversion is performed */
-char new_header[22]={'P','6','\n','#','t','e','s','t','\n','1','6','0',' ','1','2','0','\n','2','5','5','\n','\0'};
-char ppm_dumpname[]="/tgtsvr/test00000000.ppm";
+/* Cameras that deviate from the UVC specification. Keep the entries sorted by VID/PID; spec compliant cameras need no
+ * entry. The entry with idVendor 0 ends the table. */
+
+const UVC_QUIRK uvc_quirks[] =
+{
+    { 0x0000, 0x0000, QUIRK_NONE, 0, 0, 0 },
+};
 
-long double last_ticks = 0, last_jiffies = 0;
-long double current_ticks = 0, current_jiffies = 0;
 long double jiffies_per_tick, jiffies_per_second, microseconds_per_tick, microseconds_per_jiffy;
 
-SEM_ID synch_sem;                               /* Descriptor for a binary semaphore */
+STREAM_EVENT_CALLBACK streamEventCallback = NULL; /* Application notification for STREAM_EVENT_* events */
 
 pUSBHST_DEVICE_DRIVER pDriverData;              /* Structure to store details about the driver */
 
+CONTROL_CONTEXT controlPool[CONTROL_POOL_SIZE]; /* Preallocated contexts used by every control transfer */
+pCONTROL_CONTEXT pControlFreeList = NULL;       /* Contexts that are currently not in use */
+SEM_ID controlPoolCount = NULL;                 /* Counting semaphore - number of free contexts */
+SEM_ID controlPoolMutex = NULL;                 /* Protects pControlFreeList */
+
 
 /*********************************************************
  * Function:     VOID shutDown(void)                     *
@@ -131,25 +138,31 @@ VOID shutDown(void)
 }
 
 
-/***************************************************************
- * Function:     VOID fill_global(void)                        *
- * Description:  Initializes all the global variables required *
- *               in the initial stage                          *
- **************************************************************/
+/*******************************************************************
+ * Function:     VOID fill_defaults(pUVC_DEVICE pDevice)           *
+ * Description:  Initializes the probe data and the frame counters *
+ *               of a newly attached camera.                       *
+ ******************************************************************/
 
-VOID fill_global(void)
+VOID fill_defaults(pUVC_DEVICE pDevice)
 {
-    data[0] = dwFrameInterval;              /* We want to keep the frame interval constant to achieve a 30 fps frame rate*/
-    data[1] = 0x00;                         /* The dwFrameInterval field is actually 2 bytes long. These are the 8 MSBs, and are reserved */
-    data[2] = UNCOMPRESSED_FRAMES;    
-    data[3] = RESOLUTION;
-    data[4] = FPS_15_DATA_4;                /* These 3 bytes determine the value of dwFrameInnterval */
-    data[5] = FPS_15_DATA_5;                /* The values are in multiples of 100 ns */
-    data[6] = FPS_15_DATA_6;                /* The current value is equal to 33.33ms which gives the rate of 30 fps */
+    memset(&pDevice->probe, 0, sizeof(UVC_PROBE));
+    
+    pDevice->probe.bmHint = PROBE_HINT_FRAME_INTERVAL;   /* We want to keep the frame interval constant */
+    pDevice->probe.bFormatIndex = 0;                 /* Chosen from the capability table by Uvc_Select_Default_Mode() */
+    pDevice->probe.bFrameIndex = 0;
+    pDevice->probe.dwFrameInterval = DEFAULT_FRAME_INTERVAL;
+    pDevice->probe_length = PROBE_LENGTH_UVC10;      /* Until the video control interface header tells otherwise */
+    pDevice->frame_width = HRES;
+    pDevice->frame_height = VRES;
         
-    first = 1;                              /* Used for synchronization of memcpy() and processImage() */
-    frameCount = FRAME_COUNT;               /* Will create FRAME_COUNT number of ppm images and then stop execution */
-    aborted = 0;                            /* To stop the execution of code if FRAME_COUNT images have been created */
+    pDevice->first = 1;                              /* Used for synchronization of memcpy() and processImage() */
+    pDevice->frameCount = FRAME_COUNT;               /* Will create FRAME_COUNT number of ppm images and then stop execution */
+    pDevice->aborted = 0;                            /* To stop the execution of code if FRAME_COUNT images have been created */
+    pDevice->adaptive_mode = ADAPTIVE_MODE_DEFAULT;
+    pDevice->schedule_mode = ISO_SCHEDULE_DEFAULT;
+    pDevice->batch_mode = BATCH_MODE_DEFAULT;
+    pDevice->streaming_interface = INTERFACE;
 }
 
 /**************************************************************************
@@ -171,19 +184,19 @@ VOID initialize_timer(void)
 }
 
 /**************************************************************************
- * Function:     VOID start_timer(void)                                   *
+ * Function:     VOID start_timer(pUVC_DEVICE pDevice)                    *
  * Description:  Gets the current value of ticks and jiffies and stores   *
- *               them.                                                    *
+ *               them in the camera's context.                            *
  *************************************************************************/
 
-VOID start_timer(void)
+VOID start_timer(pUVC_DEVICE pDevice)
 {
-    last_jiffies = sysTimestampLock();
-    last_ticks   = tickGet();
+    pDevice->last_jiffies = sysTimestampLock();
+    pDevice->last_ticks   = tickGet();
 }
 
 /**************************************************************************
- * Function:    VOID stop_timer(void)                                     *
+ * Function:    VOID stop_timer(pUVC_DEVICE pDevice)                      *
  * Description: Gets the current values of ticks and jiffies and stores   *
  *              them.                                                     *
  *                                                                        *
@@ -192,20 +205,21 @@ VOID start_timer(void)
  *              function and from those, calculates the elapsed time in ms*
  *************************************************************************/
 
-VOID stop_timer(void)
+VOID stop_timer(pUVC_DEVICE pDevice)
 {
     long double tick_difference = 0, jiffy_difference = 0, micro_difference = 0;
+    long double current_ticks = 0, current_jiffies = 0;
     
     current_jiffies = sysTimestampLock();
     current_ticks = tickGet();
     
-    tick_difference  = ((current_ticks - last_ticks)*microseconds_per_tick);
-    jiffy_difference = ((current_jiffies - last_jiffies)*microseconds_per_jiffy);
+    tick_difference  = ((current_ticks - pDevice->last_ticks)*microseconds_per_tick);
+    jiffy_difference = ((current_jiffies - pDevice->last_jiffies)*microseconds_per_jiffy);
     micro_difference = tick_difference + jiffy_difference;
     
     #ifdef DEBUG
     
-    logMsg("%s: Time in milliseconds between two frames = %d\n",__FUNCTION__, (int)(micro_difference/1000),3,4,5,6);
+    logMsg("%s: Camera %d - time in milliseconds between two frames = %d\n",__FUNCTION__, pDevice->uIndex, (int)(micro_difference/1000),4,5,6);
     
     #endif
 }
@@ -214,19 +228,19 @@ VOID stop_timer(void)
  * Function:     USBHST_STATUS Add_device_Callback(UINT32 hDevice, UINT8 uInterfaceNumber, UINT8 uSpeed, void **pDriverData)    *
  * Description:  The function is called when a device with matching device driver details is attached (basically any UVC camera)*
  *                                                                                                                              *
- *               It configures the device, negotiates bandwidth using control transfers, sets the alternate settings for the    *
- *               video streaming interface, creates a  pipe for isochronous transfers between the camera and the host and calls *
- *               the ISOCHRONOUS_TRANSFER() function which sends URBs for getting the data from the camera using isochronous    *
- *               transfers.                                                                                                     *
+ *               It runs in the attach context of the host stack, which enumerates no other device until it returns. So it     *
+ *               only allocates a context for the camera (returned to the host stack in pDriverData) and asks the camera's     *
+ *               service task to bring it up (SERVICE_ATTACH, see Attach_Step()). The service task configures the device,      *
+ *               negotiates the stream and starts it, one step at a time, while the host stack goes on with other devices. The *
+ *               application can use Uvc_Wait_Ready() or the stream event callback to learn when the bring-up has finished.     *
+ *                                                                                                                              *
+ *               A failure only affects this camera; the driver stays registered for the others.                               *
  *******************************************************************************************************************************/ 
 
 USBHST_STATUS Add_Device_Callback(UINT32 hDevice, UINT8 uInterfaceNumber, UINT8 uSpeed, void **pDriverData)
 {
-    UINT32 size = 0;
-    UINT8 i = 0;
-    UINT8 numConfig = 0;
-    UCHAR curr_config = 0;
-    INT8 temp_status = 0;
+    SERVICE_MSG msg;
+    pUVC_DEVICE pDevice = NULL;
     
     #ifdef DEBUG
     
@@ -234,214 +248,275 @@ USBHST_STATUS Add_Device_Callback(UINT32 hDevice, UINT8 uInterfaceNumber, UINT8
 
     #endif
     
+    pDevice = Device_Create(hDevice, uSpeed);
     
-    /* Before the device's interface or any of it's alternate settings are activated, the device needs to be in the
-     * configured state. usbHstSetConfiguration() will change the state of the device from default (or addressed)
-     * to configured */
-    
-    temp_status = usbHstGetConfiguration(hDevice, &curr_config);
-    
-    #ifdef DEBUG
-    
-    logMsg("%s: Get config temp_status = %d, calue = %d\n",__FUNCTION__,temp_status, curr_config,4,5,6);
-    
-    #endif
-    
-    if(temp_status != OK)
+    if(pDevice == NULL)
     {
-        shutDown();
-        
-        return ERROR;
+        return USBHST_INSUFFICIENT_MEMORY;
     }
     
-    temp_status = usbHstSetConfiguration(hDevice, curr_config);
-    
-    #ifdef DEBUG
-    
-    logMsg("%s: Get config temp_status = %d, calue = %d\n",__FUNCTION__,temp_status, curr_config,4,5,6);
-    
-    #endif
-    
-    if(temp_status != OK)
-    {
-        shutDown();
-        
-        return ERROR;
-    }
+    pDevice->attach_state   = ATTACH_STATE_CONFIGURE;
+    pDevice->attach_retries = 0;
     
-    /* The host probes the device for configuration data for configuring the device to send 160x126 uncompressed frame
-     * data. */
+    msg.uCommand = SERVICE_ATTACH;
+    msg.uParam   = 0;
     
-    if(USBHST_SUCCESS != Control_Transfer(hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_PROBE_CONTROL, USB_SETUP_PACKET_INDEX))
+    if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) != OK)
     {
-        #ifdef DEBUG
-        
-        logMsg("%s: Control Transfer 1 failed.\n",__FUNCTION__,2,3,4,5,6);
-        
-        #endif
-        
-        shutDown();
-        
-        OSS_FREE(pDriverData);
+        Device_Destroy(pDevice);
         
         return USBHST_FAILURE;
     }
-    else
-    {
-        #ifdef DEBUG
-        
-        logMsg("%s: Control Transfer 1 Succeeded.\n",__FUNCTION__,2,3,4,5,6);
-        
-        #endif
-    }
     
-/*  memset(data, 0, sizeof(data));    Clear the array so as to store new information after control transfer 2 */
+    *pDriverData = pDevice;
     
-    /* The device sends the configuration data to the host when the following control transfer URB is submitted
-     * Based on this configuration data, the host can then send a third control transfer with a VS_COMMIT flag
-     * to actually configure the device. */
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Attach_Run_Step(pUVC_DEVICE pDevice)                          *
+ * Description:  Runs the bring-up step pDevice->attach_state stands for. Every step may be  *
+ *               run again after it has failed. The control transfers of a step are          *
+ *               cancelled after CONTROL_TIMEOUT ticks, so a camera that does not answer     *
+ *               cannot hold up its service task for good.                                   *
+ ********************************************************************************************/
+
+USBHST_STATUS Attach_Run_Step(pUVC_DEVICE pDevice)
+{
+    UCHAR curr_config = 0;
+    INT8 temp_status = 0;
     
-    if(USBHST_SUCCESS != Control_Transfer(hDevice, USB_DIRECTION_IN, USB_GET_CURRENT, UVC_VS_PROBE_CONTROL, USB_SETUP_PACKET_INDEX))
+    switch(pDevice->attach_state)
     {
-        #ifdef DEBUG
+        case ATTACH_STATE_CONFIGURE:
             
-        logMsg("%s: Control Transfer 2 failed.\n",__FUNCTION__,2,3,4,5,6);
+            /* Before the device's interface or any of it's alternate settings are activated, the device needs to be in
+             * the configured state. usbHstSetConfiguration() will change the state of the device from default (or
+             * addressed) to configured */
             
-        #endif
-        
-        shutDown();
-        
-        OSS_FREE(pDriverData);
-    
-        return USBHST_FAILURE;
-    }
-    else
-    {
-        #ifdef DEBUG
+            temp_status = usbHstGetConfiguration(pDevice->hDevice, &curr_config);
+            
+            #ifdef DEBUG
             
-        logMsg("%s: Control Transfer 2 Succeeded.\n",__FUNCTION__,2,3,4,5,6);
+            logMsg("%s: Get config temp_status = %d, calue = %d\n",__FUNCTION__,temp_status, curr_config,4,5,6);
             
-        #endif
-    }
-    
-    /* This is where the host actually configures the device to send 160x120 uncompressed frames */
-    
-    if(USBHST_SUCCESS != Control_Transfer(hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_COMMIT_CONTROL, USB_SETUP_PACKET_INDEX))
-    {
-        #ifdef DEBUG
+            #endif
             
-        logMsg("%s: Control Transfer 3 failed.\n",__FUNCTION__,2,3,4,5,6);
+            if(temp_status != OK)
+            {
+                return USBHST_FAILURE;
+            }
             
-        #endif
-        
-        shutDown();
-        
-        OSS_FREE(pDriverData);
-    
-        return USBHST_FAILURE;
-    }
-    else
-    {
-        #ifdef DEBUG
+            temp_status = usbHstSetConfiguration(pDevice->hDevice, curr_config);
             
-        logMsg("%s: Control Transfer 3 Succeeded.\n",__FUNCTION__,2,3,4,5,6);
+            #ifdef DEBUG
             
-        #endif
+            logMsg("%s: Set config temp_status = %d, calue = %d\n",__FUNCTION__,temp_status, curr_config,4,5,6);
+            
+            #endif
+            
+            return (temp_status == OK) ? USBHST_SUCCESS : USBHST_FAILURE;
+            
+        case ATTACH_STATE_DESCRIPTORS:
+            
+            /* The alternate settings of the video streaming interface and the packet size of their isochronous
+             * endpoints are taken from the configuration descriptor instead of being hard-coded for one camera. The
+             * descriptor also tells whether the camera streams over bulk instead. */
+            
+            if(USBHST_SUCCESS != Read_Configuration_Descriptor(pDevice))
+            {
+                return USBHST_FAILURE;
+            }
+            
+            Read_Device_Identity(pDevice);      /* Only the reattach cache needs it; without it the camera is simply not found there */
+            
+            if(Parse_Streaming_Alt_Settings(pDevice) == 0)
+            {
+                #ifdef DEBUG
+                
+                logMsg("%s: No isochronous or bulk streaming endpoint found.\n",__FUNCTION__,2,3,4,5,6);
+                
+                #endif
+                
+                return USBHST_FAILURE;
+            }
+            
+            /* The formats, frame sizes and frame intervals the camera describes are kept, so the application can
+             * query them and the requested mode can be checked against them before it is probed. */
+            
+            Parse_Streaming_Formats(pDevice);
+            Uvc_Apply_Quirks(pDevice);
+            Uvc_Select_Default_Mode(pDevice);
+            
+            return USBHST_SUCCESS;
+            
+        case ATTACH_STATE_NEGOTIATE:
+            
+            /* A camera that has been attached before with the same configuration descriptor gets its last committed
+             * configuration back with a single commit. Otherwise, or if the camera rejects that commit, the host
+             * probes the device for configuration data and commits it. The negotiated values are left in
+             * pDevice->probe. */
+            
+            if(USBHST_SUCCESS != Negotiate_From_Cache(pDevice))
+            {
+                if(USBHST_SUCCESS != Negotiate_Stream(pDevice))
+                {
+                    return USBHST_FAILURE;
+                }
+                
+                Reattach_Cache_Store(pDevice);
+            }
+            
+            /* A camera that sends still images while it streams (method 2 or 3) gets the largest still of the
+             * committed format. Stills are optional, so a camera that rejects the still probe streams anyway. */
+            
+            Still_Negotiate(pDevice, 0);
+            
+            return USBHST_SUCCESS;
+            
+        case ATTACH_STATE_START:
+            
+            /* The camera returned the payload size it needs per (micro)frame in dwMaxPayloadTransferSize. The
+             * bandwidth manager decides which alternate setting the camera gets, considering the other cameras on
+             * the same host controller, and starts the stream (see Bandwidth_Attach()). A camera that gets no
+             * bandwidth stays attached and is started as soon as another camera leaves. */
+            
+            pDevice->degrade_level = 0;
+            
+            return Bandwidth_Attach(pDevice);
+            
+        default:
+            
+            return USBHST_FAILURE;
     }
+}
 
-    /* Since the device is in configured state, the video streaming interface and its alternate setting can be selected */
-    
-    temp_status = usbHstSetInterface(hDevice, INTERFACE,ALTERNATE_INTERFACE);
-    
-    #ifdef DEBUG
-    
-    logMsg("%s: Set interface status = %d\n",__FUNCTION__,temp_status,3,4,5,6);
+/*********************************************************************************************
+ * Function:     VOID Attach_Step(pUVC_DEVICE pDevice)                                       *
+ * Description:  Handles SERVICE_ATTACH in the service task of a new camera: runs one step   *
+ *               of the bring-up with Attach_Run_Step() and queues SERVICE_ATTACH again for  *
+ *               the next one, so that a SERVICE_EXIT from Device_Destroy() is handled       *
+ *               between two steps. A step that fails is tried again after                   *
+ *               ATTACH_RETRY_DELAY ticks, up to ATTACH_STEP_RETRIES times in all; then the  *
+ *               bring-up fails. The camera stays attached either way, until the host stack  *
+ *               removes it.                                                                 *
+ ********************************************************************************************/
 
-    #endif
+VOID Attach_Step(pUVC_DEVICE pDevice)
+{
+    SERVICE_MSG msg;
     
-    if(temp_status != OK)
+    if(Attach_Run_Step(pDevice) == USBHST_SUCCESS)
     {
-        shutDown();
-        
-        return ERROR;
+        pDevice->attach_state++;
+        pDevice->attach_retries = 0;
     }
-    
-    /* Before requesting the image data from the camera, a pipe needs to be established with the isochronous tranfer
-     * endpoint. You need to specify the max number of bytes that will be recieved  per transfer and the max number 
-     * of transfers that are going to take place via that pipe. */
-    
-    pUSB_TRANSFER_SETUP_INFO pSetupInfo;
-    
-    pSetupInfo = (USB_TRANSFER_SETUP_INFO *)OSS_CALLOC(sizeof(USB_TRANSFER_SETUP_INFO));
-    
-    if(pSetupInfo == NULL)
+    else
     {
+        pDevice->attach_retries++;
+        
         #ifdef DEBUG
         
-        logMsg("%s: OSS_CALLOC for pSetupInfo failed.\n",__FUNCTION__,2,3,4,5,6 );
+        logMsg("%s: Step %d of camera %d failed (attempt %d).\n",__FUNCTION__,pDevice->attach_state,pDevice->uIndex,pDevice->attach_retries,5,6);
         
         #endif
         
-        shutDown();
+        if(pDevice->attach_retries >= ATTACH_STEP_RETRIES)
+        {
+            Attach_Finish(pDevice, ATTACH_STATE_FAILED);
+            
+            return;
+        }
+        
+        if(pDevice->attach_state == ATTACH_STATE_START)
+        {
+            Bandwidth_Detach(pDevice);          /* Whatever part of the stream was set up is released before the next attempt */
+            
+            semTake(pDevice->stream_mutex, WAIT_FOREVER);
+            Stream_Stop(pDevice);
+            semGive(pDevice->stream_mutex);
+        }
         
-        return ERROR;
+        taskDelay(ATTACH_RETRY_DELAY);
     }
+    
+    if(pDevice->attach_state == ATTACH_STATE_READY)
+    {
+        Attach_Finish(pDevice, ATTACH_STATE_READY);
         
-    pSetupInfo->uMaxNumReqests   = NO_OF_TRANSFERS;
-    pSetupInfo->uMaxTransferSize = NUMBER_OF_ISOCHRONOUS_PACKETS*ISOCHRONOUS_BUFFER_SIZE;  
-    pSetupInfo->uFlags           = 0;
-        
-    temp_status = usbHstPipePrepare(hDevice, ISOCHRONOUS_TRANSFER_ENDPOINT_INTERFACE_1, pSetupInfo);
+        return;
+    }
     
-    if(temp_status != USBHST_SUCCESS)
+    msg.uCommand = SERVICE_ATTACH;
+    msg.uParam   = 0;
+    
+    if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) != OK)
+    {
+        Attach_Finish(pDevice, ATTACH_STATE_FAILED);
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Attach_Finish(pUVC_DEVICE pDevice, UINT8 uState)                       *
+ * Description:  Ends the bring-up in ATTACH_STATE_READY or ATTACH_STATE_FAILED, tells the   *
+ *               application with the stream event callback and wakes up Uvc_Wait_Ready().   *
+ *               A camera that failed has whatever part of the stream was set up released.   *
+ ********************************************************************************************/
+
+VOID Attach_Finish(pUVC_DEVICE pDevice, UINT8 uState)
+{
+    if(uState == ATTACH_STATE_FAILED)
     {
         #ifdef DEBUG
         
-        logMsg("%s: Pipe prepare failed. Status = %d\n",__FUNCTION__,temp_status,3,4,5,6);
+        logMsg("%s: Bring-up of camera %d failed.\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
         
         #endif
         
-        shutDown();
+        Bandwidth_Detach(pDevice);
         
-        return ERROR;
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+        Stream_Stop(pDevice);
+        semGive(pDevice->stream_mutex);
     }
-    else
+    
+    pDevice->attach_state = uState;
+    
+    if(streamEventCallback != NULL)
     {
-        #ifdef DEBUG
-        
-        logMsg("%s: Pipe prepared successfully. Status = %d",__FUNCTION__,temp_status,3,4,5,6);
-        
-        #endif
+        streamEventCallback(pDevice->hDevice, (uState == ATTACH_STATE_READY) ? STREAM_EVENT_READY : STREAM_EVENT_FAILED);
     }
     
-    for(i = 0; i < NO_OF_TRANSFERS; i++)
+    semGive(pDevice->ready_sem);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Uvc_Wait_Ready(pUVC_DEVICE pDevice, int timeout)                     *
+ * Description:  Waits (at most timeout ticks) until the bring-up of the camera has          *
+ *               finished. Returns OK if the camera is ready, ERROR if its bring-up failed   *
+ *               or is still running.                                                        *
+ ********************************************************************************************/
+
+STATUS Uvc_Wait_Ready(pUVC_DEVICE pDevice, int timeout)
+{
+    if((pDevice->attach_state < ATTACH_STATE_READY) && (semTake(pDevice->ready_sem, timeout) == OK))
     {
-        if(USBHST_SUCCESS != Isochronous_Transfer(hDevice, ISOCHRONOUS_TRANSFER_ENDPOINT_INTERFACE_1, USBHST_START_ISOCHRONOUS_TRANSFER_ASAP | USB_FLAG_SHORT_OK, USBHST_SUCCESS))
-        {
-            #ifdef DEBUG
-        
-            logMsg("%s: Isochronous Transfer failed.\n",__FUNCTION__,2,3,4,5,6);
-        
-            #endif
-        
-            shutDown();
-            
-            OSS_FREE(pDriverData);
-        
-            return USBHST_FAILURE;
-        }
+        semGive(pDevice->ready_sem);            /* For the next task that waits */
     }
-    return USBHST_SUCCESS;
+    
+    return (pDevice->attach_state == ATTACH_STATE_READY) ? OK : ERROR;
 }
 
 /**************************************************************************************
  * Function:      VOID Remove_Device_Callback(UINT32 hDevice, void *pDriverData)      *
  * Description:   This function is called when the device with matching device driver *
- *                details is removed.                                                 *
+ *                details is removed. pDriverData is the camera's context; only this  *
+ *                camera is torn down.                                                *
  *************************************************************************************/
 
 VOID Remove_Device_Callback(UINT32 hDevice, void *pDriverData)
 {   
+    pUVC_DEVICE pDevice = (pUVC_DEVICE)pDriverData;
     
     #ifdef DEBUG
     
@@ -449,7 +524,10 @@ VOID Remove_Device_Callback(UINT32 hDevice, void *pDriverData)
 
     #endif
 
-    shutDown();
+    if(pDevice != NULL)
+    {
+        Device_Destroy(pDevice);                /* The host stack fails the URBs in flight; wait for them and free the stream */
+    }
     
     return;
 }
@@ -457,91 +535,514 @@ VOID Remove_Device_Callback(UINT32 hDevice, void *pDriverData)
 /**************************************************************************************
  * Function:      VOID Suspend_Device_Callback(UINT32 hDevice, void *pDriverData)     *
  * Description:   This function is called when the device with matching device driver *
- *                details is suspended.                                               *
+ *                details is suspended. The stream is parked with Stream_Suspend();   *
+ *                its buffers and negotiated parameters are kept for the resume.      *
+ *                stream_mutex may be held across control transfers, so the host     *
+ *                stack is not kept waiting for it: the service task parks the stream *
+ *                (SERVICE_SUSPEND), and requests that need the bus are refused from  *
+ *                now on.                                                             *
  *************************************************************************************/
 
 VOID Suspend_Device_Callback(UINT32 hDevice, void *pDriverData)
 {   
+    pUVC_DEVICE pDevice = (pUVC_DEVICE)pDriverData;
+    SERVICE_MSG msg;
+    
     #ifdef DEBUG
     
     logMsg("%s: In suspend device callback function\n",__FUNCTION__,2,3,4,5,6);
     
     #endif
     
+    if(pDevice != NULL)
+    {
+        pDevice->suspend_requested = 1;
+        
+        msg.uCommand = SERVICE_SUSPEND;
+        msg.uParam   = 0;
+        
+        /* Not urgent: the resume is queued behind it and must not overtake it */
+        
+        if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) != OK)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: Could not queue the suspend of camera %d\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+            
+            #endif
+        }
+    }
+    
     return;
 }
 
 /**************************************************************************************
  * Function:      VOID Resume_Device_Callback(UINT32 hDevice, void *pDriverData)      *
  * Description:   This function is called when the device with matching device driver *
- *                details is resumed.                                                 *
+ *                details is resumed. Restarting the stream needs control transfers,  *
+ *                so it is handed to the camera's service task (SERVICE_RESUME),      *
+ *                which runs it after the SERVICE_SUSPEND queued before it.           *
  *************************************************************************************/
 
 VOID Resume_Device_Callback(UINT32 hDevice, void *pDriverData)
 {   
+    pUVC_DEVICE pDevice = (pUVC_DEVICE)pDriverData;
+    SERVICE_MSG msg;
+    
     #ifdef DEBUG
     
     logMsg("%s: In resume device callback function\n",__FUNCTION__,2,3,4,5,6);
 
     #endif
     
+    if((pDevice != NULL) && (pDevice->suspend_requested == 1))
+    {
+        pDevice->suspend_requested = 0;
+        
+        msg.uCommand = SERVICE_RESUME;
+        msg.uParam   = 0;
+        
+        if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) != OK)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: Could not queue the resume of camera %d\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+            
+            #endif
+        }
+    }
+    
     return;
 }
 
-/*********************************************************
- * Function:     VOID camInit(void)                      *
- * Description:  Initializes the timer, fills the driver *
- *               data structure and registers the driver *
- *               with the OS.                            *
- ********************************************************/
+/**************************************************************************************
+ * Function:      pUVC_DEVICE Device_Create(UINT32 hDevice, UINT8 uSpeed)             *
+ * Description:   Allocates the context of a newly attached camera, takes a free slot *
+ *                in uvc_devices[], creates its semaphores and spawns its service     *
+ *                and batch tasks. Returns NULL if MAX_CAMERAS cameras are already    *
+ *                attached or if a resource cannot be created.                        *
+ *************************************************************************************/
 
-VOID camInit(void)
+pUVC_DEVICE Device_Create(UINT32 hDevice, UINT8 uSpeed)
 {
-    USBHST_STATUS status;
-    
-    fill_global();                              /* Fill the data array */
-    initialize_timer();
-    start_timer();                              /* Only for the first frame */
+    UINT8 i = 0;
+    pUVC_DEVICE pDevice = NULL;
+    char task_name[TASK_NAME_LENGTH];
     
-    synch_sem = semBCreate(SEM_Q_FIFO, SEM_FULL);
+    pDevice = (pUVC_DEVICE)OSS_CALLOC(sizeof(UVC_DEVICE));
     
-    isotrans_buffer = (UCHAR *)malloc(ISOCHRONOUS_TRANSFER_LENGTH);
-    if(isotrans_buffer == NULL)
+    if(pDevice == NULL)
     {
         #ifdef DEBUG
         
-        logMsg("%s: malloc for isotrans_buffer failed.\n",__FUNCTION__,2,3,4,5,6);
+        logMsg("%s: OSS_CALLOC for the device context failed.\n",__FUNCTION__,2,3,4,5,6);
         
         #endif
         
-        return;
+        return NULL;
     }
     
-    memset(isotrans_buffer, 0, ISOCHRONOUS_TRANSFER_LENGTH);
-        
-    if((pDriverData = OSS_CALLOC(sizeof(USBHST_DEVICE_DRIVER))) == NULL)
+    pDevice->hDevice = hDevice;
+    pDevice->uSpeed  = uSpeed;
+    pDevice->bus_index = USB_BUS_INDEX(hDevice);
+    pDevice->priority  = BANDWIDTH_PRIORITY_DEFAULT;
+    
+    fill_defaults(pDevice);
+    start_timer(pDevice);                       /* Only for the first frame */
+    
+    for(i = 0; i < NO_OF_TRANSFERS; i++)
     {
-        #ifdef DEBUG    
-        
-        logMsg("%s: Calloc for pDriveData failed\n",__FUNCTION__,2,3,4,5,6);
-        
-        #endif
-
-        return;
+        pDevice->isoTransfers[i].pDevice = pDevice;
     }
-    else
+    
+    semTake(device_table_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < MAX_CAMERAS; i++)
     {
-        #ifdef DEBUG
+        if(uvc_devices[i] == NULL)
+        {
+            uvc_devices[i] = pDevice;
+            pDevice->uIndex = i;
+            break;
+        }
+    }
     
-        logMsg("%s: Calloc for pDriverData succeeded\n",__FUNCTION__,2,3,4,5,6);
+    semGive(device_table_mutex);
     
+    if(i == MAX_CAMERAS)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: %d cameras are already attached.\n",__FUNCTION__,MAX_CAMERAS,3,4,5,6);
+        
         #endif
+        
+        OSS_FREE(pDevice);
+        
+        return NULL;
     }
     
-    pDriverData->bFlagVendorSpecific             = NO;
-    pDriverData->uVendorIDorClass                = USB_CLASS_MISC;
-    pDriverData->uProductIDorSubClass            = USB_SUBCLASS_COMMON;
-    pDriverData->uBCDUSBorProtocol               = USB_PROTOCOL_IAD;
+    pDevice->synch_sem        = semBCreate(SEM_Q_FIFO, SEM_FULL);
+    pDevice->first_frame_sem  = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->drain_sem        = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->exit_sem         = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->stream_mutex     = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    pDevice->batch_sem        = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->batch_exit_sem   = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->control_mutex    = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    pDevice->control_sem      = semCCreate(SEM_Q_FIFO, 0);
+    pDevice->control_exit_sem = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->ready_sem        = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    pDevice->still_mutex      = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    pDevice->sink_mutex       = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    pDevice->service_queue    = msgQCreate(SERVICE_QUEUE_LENGTH, sizeof(SERVICE_MSG), MSG_Q_FIFO);
+    
+    snprintf(task_name, sizeof(task_name), "tUvcSvc%d", pDevice->uIndex);
+    
+    if((pDevice->synch_sem == NULL) || (pDevice->first_frame_sem == NULL) || (pDevice->drain_sem == NULL) || (pDevice->exit_sem == NULL) || (pDevice->stream_mutex == NULL) || (pDevice->batch_sem == NULL) || (pDevice->batch_exit_sem == NULL) || (pDevice->control_mutex == NULL) || (pDevice->control_sem == NULL) || (pDevice->control_exit_sem == NULL) || (pDevice->ready_sem == NULL) || (pDevice->still_mutex == NULL) || (pDevice->sink_mutex == NULL) || (pDevice->service_queue == NULL) ||
+       (taskSpawn(task_name, SERVICE_TASK_PRIORITY, 0, SERVICE_TASK_STACK_SIZE, (FUNCPTR)Stream_Service_Task, pDevice, 0, 0, 0, 0, 0, 0, 0, 0, 0) == ERROR))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Creating the resources of camera %d failed.\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+        
+        #endif
+        
+        if(pDevice->service_queue != NULL)
+        {
+            msgQDelete(pDevice->service_queue);
+            pDevice->service_queue = NULL;      /* Tells Device_Destroy() that there is no service task */
+        }
+        
+        Device_Destroy(pDevice);
+        
+        return NULL;
+    }
+    
+    snprintf(task_name, sizeof(task_name), "tUvcBat%d", pDevice->uIndex);
+    
+    if(taskSpawn(task_name, BATCH_TASK_PRIORITY, 0, BATCH_TASK_STACK_SIZE, (FUNCPTR)Stream_Batch_Task, pDevice, 0, 0, 0, 0, 0, 0, 0, 0, 0) == ERROR)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Spawning the batch task of camera %d failed.\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+        
+        #endif
+        
+        Device_Destroy(pDevice);
+        
+        return NULL;
+    }
+    
+    pDevice->batch_task_started = 1;
+    
+    snprintf(task_name, sizeof(task_name), "tUvcCtl%d", pDevice->uIndex);
+    
+    if(taskSpawn(task_name, CONTROL_TASK_PRIORITY, 0, CONTROL_TASK_STACK_SIZE, (FUNCPTR)Control_Task, pDevice, 0, 0, 0, 0, 0, 0, 0, 0, 0) == ERROR)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Spawning the control task of camera %d failed.\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+        
+        #endif
+        
+        Device_Destroy(pDevice);
+        
+        return NULL;
+    }
+    
+    pDevice->control_task_started = 1;
+    
+    return pDevice;
+}
+
+/**************************************************************************************
+ * Function:      VOID Device_Destroy(pUVC_DEVICE pDevice)                            *
+ * Description:   Stops the camera's stream, stops its service task and releases     *
+ *                everything Device_Create() and the attach sequence allocated.       *
+ *************************************************************************************/
+
+VOID Device_Destroy(pUVC_DEVICE pDevice)
+{
+    SERVICE_MSG msg;
+    
+    /* Control requests still queued are cancelled; the one the control task is running completes (or fails, if the
+     * camera is already gone) first. Control_Transfer_Buffer() gives up after CONTROL_TIMEOUT ticks, so the wait is
+     * bounded, and the control semaphores are deleted only once the task has really exited. */
+    
+    if(pDevice->control_task_started == 1)
+    {
+        pDevice->control_exit = 1;
+        semGive(pDevice->control_sem);
+        semTake(pDevice->control_exit_sem, WAIT_FOREVER);
+    }
+    
+    if(pDevice->control_mutex != NULL)
+    {
+        Control_Queue_Flush(pDevice);
+        semDelete(pDevice->control_mutex);
+    }
+    
+    if(pDevice->control_sem != NULL)
+    {
+        semDelete(pDevice->control_sem);
+    }
+    
+    if(pDevice->control_exit_sem != NULL)
+    {
+        semDelete(pDevice->control_exit_sem);
+    }
+    
+    /* The service task is stopped first so that it cannot restart the stream after it has been stopped here. The
+     * exit request is urgent, so it is handled right after the request that is currently running: a bring-up step,
+     * or a downshift, recovery or resume that may hold stream_mutex. Each transfer of those fails once the camera is
+     * gone or times out after CONTROL_TIMEOUT ticks, so the task is waited for without a timeout; the queue, the
+     * semaphores and the context must not go away while it still uses them. */
+    
+    if(pDevice->service_queue != NULL)
+    {
+        msg.uCommand = SERVICE_EXIT;
+        msg.uParam   = 0;
+        
+        if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), WAIT_FOREVER, MSG_PRI_URGENT) == OK)
+        {
+            semTake(pDevice->exit_sem, WAIT_FOREVER);
+        }
+        
+        msgQDelete(pDevice->service_queue);
+    }
+    
+    Bandwidth_Detach(pDevice);                  /* Gives the camera's share of the bus to the others */
+    
+    /* An application task may still be in Stream_Set_Mode(), Still_Capture() or a rebalance, restarting the stream;
+     * the stop waits for it like every other stop path, taking the locks in the same order. */
+    
+    if(pDevice->stream_mutex != NULL)
+    {
+        semTake(bandwidth_mutex, WAIT_FOREVER);
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    }
+    
+    Stream_Stop(pDevice);
+    
+    Stream_Free_Frame_Buffers(pDevice);
+    
+    if(pDevice->stream_mutex != NULL)
+    {
+        semGive(pDevice->stream_mutex);
+        semGive(bandwidth_mutex);
+    }
+    
+    /* A still being read from the still endpoint fails once the stream is stopped or the camera is gone */
+    
+    if(pDevice->still_mutex != NULL)
+    {
+        semTake(pDevice->still_mutex, WAIT_FOREVER);
+    }
+    
+    if(pDevice->still_buffer != NULL)
+    {
+        OSS_FREE(pDevice->still_buffer);
+    }
+    
+    if(pDevice->still_mutex != NULL)
+    {
+        semDelete(pDevice->still_mutex);
+    }
+    
+    if(pDevice->sink_mutex != NULL)
+    {
+        semDelete(pDevice->sink_mutex);
+    }
+    
+    /* The batch task is stopped last, since it retires the URBs Stream_Stop() waits for. It never blocks while it
+     * drains the ring, so it is waited for without a timeout before batch_sem goes away. */
+    
+    if(pDevice->batch_task_started == 1)
+    {
+        pDevice->batch_exit = 1;
+        semGive(pDevice->batch_sem);
+        semTake(pDevice->batch_exit_sem, WAIT_FOREVER);
+    }
+    
+    if(pDevice->batch_sem != NULL)
+    {
+        semDelete(pDevice->batch_sem);
+    }
+    
+    if(pDevice->batch_exit_sem != NULL)
+    {
+        semDelete(pDevice->batch_exit_sem);
+    }
+    
+    if(pDevice->synch_sem != NULL)
+    {
+        semDelete(pDevice->synch_sem);
+    }
+    
+    if(pDevice->first_frame_sem != NULL)
+    {
+        semDelete(pDevice->first_frame_sem);
+    }
+    
+    if(pDevice->drain_sem != NULL)
+    {
+        semDelete(pDevice->drain_sem);
+    }
+    
+    if(pDevice->exit_sem != NULL)
+    {
+        semDelete(pDevice->exit_sem);
+    }
+    
+    if(pDevice->ready_sem != NULL)
+    {
+        semDelete(pDevice->ready_sem);
+    }
+    
+    if(pDevice->stream_mutex != NULL)
+    {
+        semDelete(pDevice->stream_mutex);
+    }
+    
+    if(pDevice->config_descriptor != NULL)
+    {
+        OSS_FREE(pDevice->config_descriptor);
+    }
+    
+    semTake(device_table_mutex, WAIT_FOREVER);
+    
+    if(uvc_devices[pDevice->uIndex] == pDevice)
+    {
+        uvc_devices[pDevice->uIndex] = NULL;
+    }
+    
+    semGive(device_table_mutex);
+    
+    OSS_FREE(pDevice);
+}
+
+/**************************************************************************************
+ * Function:      pUVC_DEVICE Uvc_Get_Device(UINT8 uIndex)                            *
+ * Description:   Returns the context of the camera in slot uIndex (0 to MAX_CAMERAS-1)*
+ *                or NULL if no camera uses that slot.                                *
+ *************************************************************************************/
+
+pUVC_DEVICE Uvc_Get_Device(UINT8 uIndex)
+{
+    if(uIndex >= MAX_CAMERAS)
+    {
+        return NULL;
+    }
+    
+    return uvc_devices[uIndex];
+}
+
+/**************************************************************************************
+ * Function:      pUVC_DEVICE Uvc_Find_Device(UINT32 hDevice)                         *
+ * Description:   Returns the context of the camera with the given host stack handle  *
+ *                (as passed to the stream event callback) or NULL.                   *
+ *************************************************************************************/
+
+pUVC_DEVICE Uvc_Find_Device(UINT32 hDevice)
+{
+    UINT8 i = 0;
+    pUVC_DEVICE pDevice = NULL;
+    
+    semTake(device_table_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < MAX_CAMERAS; i++)
+    {
+        if((uvc_devices[i] != NULL) && (uvc_devices[i]->hDevice == hDevice))
+        {
+            pDevice = uvc_devices[i];
+            break;
+        }
+    }
+    
+    semGive(device_table_mutex);
+    
+    return pDevice;
+}
+
+/*********************************************************
+ * Function:     VOID camInit(void)                      *
+ * Description:  Initializes the timer, the control pool *
+ *               and the device table, fills the driver  *
+ *               data structure and registers the driver *
+ *               with the OS.                            *
+ ********************************************************/
+
+VOID camInit(void)
+{
+    USBHST_STATUS status;
+    
+    initialize_timer();
+    
+    if(Control_Pool_Init() != OK)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Control_Pool_Init failed.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        return;
+    }
+    
+    if(device_table_mutex == NULL)
+    {
+        device_table_mutex = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+        
+        if(device_table_mutex == NULL)
+        {
+            return;
+        }
+    }
+    
+    if(bandwidth_mutex == NULL)
+    {
+        bandwidth_mutex = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+        
+        if(bandwidth_mutex == NULL)
+        {
+            return;
+        }
+    }
+    
+    if(reattach_cache_mutex == NULL)
+    {
+        reattach_cache_mutex = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+        
+        if(reattach_cache_mutex == NULL)
+        {
+            return;
+        }
+    }
+        
+    if((pDriverData = OSS_CALLOC(sizeof(USBHST_DEVICE_DRIVER))) == NULL)
+    {
+        #ifdef DEBUG    
+        
+        logMsg("%s: Calloc for pDriveData failed\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+
+        return;
+    }
+    else
+    {
+        #ifdef DEBUG
+    
+        logMsg("%s: Calloc for pDriverData succeeded\n",__FUNCTION__,2,3,4,5,6);
+    
+        #endif
+    }
+    
+    pDriverData->bFlagVendorSpecific             = NO;
+    pDriverData->uVendorIDorClass                = USB_CLASS_MISC;
+    pDriverData->uProductIDorSubClass            = USB_SUBCLASS_COMMON;
+    pDriverData->uBCDUSBorProtocol               = USB_PROTOCOL_IAD;
     pDriverData->addDevice                       = Add_Device_Callback;
     pDriverData->removeDevice                    = Remove_Device_Callback;
     pDriverData->suspendDevice                   = Suspend_Device_Callback;
@@ -571,361 +1072,4878 @@ VOID camInit(void)
     }
 }
 
-/**********************************************************************************
- * Function:     USBHST_STATUS Control_Completion_Callback(pUSBHST_URB pUrb)      *
- * Description:  Checks if the pointer pUrb is not a NULL pointer which indicates *
- *               an error.                                                        *
- *********************************************************************************/
+/**************************************************************************************
+ * Function:     USBHST_STATUS Read_Configuration_Descriptor(pUVC_DEVICE pDevice)     *
+ * Description:  Reads the 9 byte header of the configuration descriptor to learn     *
+ *               wTotalLength and then reads the complete descriptor (with all the    *
+ *               interface, endpoint and class specific descriptors) into             *
+ *               the config_descriptor of the camera's context.                       *
+ *************************************************************************************/
 
-USBHST_STATUS Control_Completion_Callback(pUSBHST_URB pUrb)
+USBHST_STATUS Read_Configuration_Descriptor(pUVC_DEVICE pDevice)
 {
-    #ifdef DEBUG
+    UCHAR header[CONFIG_DESCRIPTOR_HEADER_LENGTH];
+    UINT32 size = CONFIG_DESCRIPTOR_HEADER_LENGTH;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
     
-    logMsg("%s: In the control completion callback function.\n",__FUNCTION__,2,3,4,5,6);
-
-    #endif
+    nStatus = usbHstGetDescriptor(pDevice->hDevice, USBHST_CONFIG_DESC, 0, 0, &size, header);
     
-    if(pUrb == NULL)
+    if((nStatus != USBHST_SUCCESS) || (size < CONFIG_DESCRIPTOR_HEADER_LENGTH))
     {
         #ifdef DEBUG
         
-        logMsg("%s: pUrb = NULL \n",__FUNCTION__,2,3,4,5,6);
-            
+        logMsg("%s: Reading the configuration descriptor header failed. Status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+        
         #endif
         
-        shutDown();
-            
         return USBHST_FAILURE;
     }
+    
+    if(pDevice->config_descriptor != NULL)
+    {
+        OSS_FREE(pDevice->config_descriptor);
+    }
+    
+    pDevice->config_descriptor_length = GET_LE16(&header[2]);                    /* wTotalLength */
+    pDevice->config_descriptor = (UCHAR *)OSS_CALLOC(pDevice->config_descriptor_length);
+    
+    if(pDevice->config_descriptor == NULL)
+    {
+        #ifdef DEBUG
         
-    OS_RELEASE_EVENT((OS_EVENT_ID)pUrb->pContext);
+        logMsg("%s: OSS_CALLOC for config_descriptor failed.\n",__FUNCTION__,2,3,4,5,6);
         
-    return USBHST_SUCCESS;
-}
-
-/*********************************************************************************************************************************
- * Function:    USBHST_STATUS Control_Transfer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex) *
- * Description: Creates and fills up a setup packet based on the arguments passed with the call. This setup packet determines the*
- *              type of request that the host is sending the device.                                                             *
- *                                                                                                                               *
- *              Creates a URB for control transfer and submits it.                                                               *
- ********************************************************************************************************************************/
-
-USBHST_STATUS Control_Transfer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex)
-{   
-    #ifdef DEBUG
+        #endif
+        
+        return USBHST_INSUFFICIENT_MEMORY;
+    }
     
-    UCHAR i = 0;
+    size = pDevice->config_descriptor_length;
     
-    for(i = 0; i < 26; i++)
+    nStatus = usbHstGetDescriptor(pDevice->hDevice, USBHST_CONFIG_DESC, 0, 0, &size, pDevice->config_descriptor);
+    
+    if(nStatus != USBHST_SUCCESS)
     {
-        logMsg("%s: data = %x \n",__FUNCTION__,data[i],3,4,5,6);
+        OSS_FREE(pDevice->config_descriptor);
+        pDevice->config_descriptor = NULL;
+        
+        return nStatus;
     }
     
-    #endif
-    
-    pUSBHST_URB pUrb;
+    pDevice->config_descriptor_length = size;
     
-    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    #ifdef DEBUG
     
-    OS_EVENT_ID EventId;
+    logMsg("%s: Configuration descriptor is %d bytes long\n",__FUNCTION__,size,3,4,5,6);
     
-    pUrb = (USBHST_URB *)OSS_CALLOC(sizeof(USBHST_URB));
+    #endif
     
-    if(NULL == pUrb)
-    {
+    return USBHST_SUCCESS;
+}
+
+/**************************************************************************************
+ * Function:     USBHST_STATUS Read_Device_Identity(pUVC_DEVICE pDevice)              *
+ * Description:  Reads idVendor, idProduct and the serial number string from the      *
+ *               device descriptor and hashes the configuration descriptor (which     *
+ *               must have been read already). Together they identify the camera in   *
+ *               the reattach cache. The serial number is kept as ASCII; a camera     *
+ *               without one has an empty serial.                                     *
+ *************************************************************************************/
+
+USBHST_STATUS Read_Device_Identity(pUVC_DEVICE pDevice)
+{
+    UCHAR descriptor[STRING_DESCRIPTOR_MAX_LENGTH];
+    UINT32 size = DEVICE_DESCRIPTOR_LENGTH;
+    UINT32 i = 0;
+    UINT32 hash = FNV_OFFSET_BASIS;
+    UINT8 iSerialNumber = 0;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    for(i = 0; i < pDevice->config_descriptor_length; i++)
+    {
+        hash = (hash ^ pDevice->config_descriptor[i]) * FNV_PRIME;
+    }
+    
+    pDevice->descriptor_hash = hash;
+    
+    nStatus = usbHstGetDescriptor(pDevice->hDevice, USBHST_DEVICE_DESC, 0, 0, &size, descriptor);
+    
+    if((nStatus != USBHST_SUCCESS) || (size < DEVICE_DESCRIPTOR_LENGTH))
+    {
+        return USBHST_FAILURE;
+    }
+    
+    pDevice->idVendor  = GET_LE16(&descriptor[8]);
+    pDevice->idProduct = GET_LE16(&descriptor[10]);
+    iSerialNumber      = descriptor[16];
+    
+    if(iSerialNumber == 0)
+    {
+        return USBHST_SUCCESS;
+    }
+    
+    size = sizeof(descriptor);
+    
+    nStatus = usbHstGetDescriptor(pDevice->hDevice, USBHST_STRING_DESC, iSerialNumber, LANGUAGE_ID_ENGLISH_US, &size, descriptor);
+    
+    if((nStatus != USBHST_SUCCESS) || (size < 2))
+    {
+        return USBHST_FAILURE;
+    }
+    
+    /* The string is UTF-16LE after the 2 byte header; serial numbers are plain ASCII, so the low bytes are kept */
+    
+    for(i = 0; ((2 + (2 * i) + 1) < size) && (i < (SERIAL_NUMBER_LENGTH - 1)); i++)
+    {
+        pDevice->serial[i] = (char)descriptor[2 + (2 * i)];
+    }
+    
+    pDevice->serial[i] = '\0';
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Camera %04x:%04x, serial %s\n",__FUNCTION__,pDevice->idVendor,pDevice->idProduct,pDevice->serial,5,6);
+    
+    #endif
+    
+    return USBHST_SUCCESS;
+}
+
+/**************************************************************************************
+ * Function:     UINT8 Parse_Streaming_Alt_Settings(pUVC_DEVICE pDevice)              *
+ * Description:  Walks the configuration descriptor and takes bcdUVC from the video   *
+ *               control interface header, which sets the length of the probe/commit  *
+ *               structure, and the IDs of the camera terminal and processing unit    *
+ *               for the control requests. Then it records every alternate            *
+ *               setting of the video streaming interface that has an isochronous     *
+ *               endpoint, together with the endpoint's wMaxPacketSize and number of  *
+ *               transactions per microframe. A camera that streams over bulk has a   *
+ *               bulk IN endpoint on alternate setting 0 instead; it is recorded the  *
+ *               same way. Returns the number of alternate settings found.            *
+ *************************************************************************************/
+
+UINT8 Parse_Streaming_Alt_Settings(pUVC_DEVICE pDevice)
+{
+    const UCHAR *pDescriptor = pDevice->config_descriptor;
+    UINT32 uLength = pDevice->config_descriptor_length;
+    UINT32 pos = 0;
+    UINT8 in_streaming_interface = 0;
+    UINT8 in_control_interface = 0;
+    UINT8 current_alt = 0;
+    
+    pDevice->num_alt_settings = 0;
+    pDevice->video_endpoint   = 0;
+    pDevice->still_method     = STILL_METHOD_NONE;
+    
+    if(pDescriptor == NULL)
+    {
+        return 0;
+    }
+    
+    while((pos + 2) <= uLength)
+    {
+        UINT8 bLength = pDescriptor[pos];
+        UINT8 bDescriptorType = pDescriptor[pos + 1];
+        
+        if((bLength < 2) || ((pos + bLength) > uLength))
+        {
+            break;                              /* Malformed descriptor; stop with what has been found so far */
+        }
+        
+        if((bDescriptorType == DESCRIPTOR_TYPE_INTERFACE) && (bLength >= 9))
+        {
+            in_streaming_interface = ((pDescriptor[pos + 5] == UVC_CLASS_VIDEO) && (pDescriptor[pos + 6] == UVC_SUBCLASS_VIDEOSTREAMING));
+            in_control_interface   = ((pDescriptor[pos + 5] == UVC_CLASS_VIDEO) && (pDescriptor[pos + 6] == UVC_SUBCLASS_VIDEOCONTROL));
+            
+            if(in_streaming_interface)
+            {
+                pDevice->streaming_interface = pDescriptor[pos + 2];
+                current_alt = pDescriptor[pos + 3];
+            }
+            
+            if(in_control_interface)
+            {
+                pDevice->control_interface = pDescriptor[pos + 2];
+            }
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_CS_INTERFACE) && (bLength >= 6) && in_control_interface && (pDescriptor[pos + 2] == UVC_VC_INPUT_TERMINAL) && (GET_LE16(&pDescriptor[pos + 4]) == UVC_ITT_CAMERA))
+        {
+            pDevice->camera_terminal_id = pDescriptor[pos + 3];
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_CS_INTERFACE) && (bLength >= 4) && in_control_interface && (pDescriptor[pos + 2] == UVC_VC_PROCESSING_UNIT))
+        {
+            pDevice->processing_unit_id = pDescriptor[pos + 3];
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_CS_INTERFACE) && (bLength >= 5) && in_control_interface && (pDescriptor[pos + 2] == UVC_VC_HEADER))
+        {
+            pDevice->bcdUVC = GET_LE16(&pDescriptor[pos + 3]);
+            
+            if(pDevice->bcdUVC >= UVC_VERSION_1_5)
+            {
+                pDevice->probe_length = PROBE_LENGTH_UVC15;
+            }
+            else if(pDevice->bcdUVC >= UVC_VERSION_1_1)
+            {
+                pDevice->probe_length = PROBE_LENGTH_UVC11;
+            }
+            else
+            {
+                pDevice->probe_length = PROBE_LENGTH_UVC10;
+            }
+            
+            #ifdef DEBUG
+            
+            logMsg("%s: bcdUVC = %x, probe/commit length %d\n",__FUNCTION__,pDevice->bcdUVC,pDevice->probe_length,4,5,6);
+            
+            #endif
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_CS_INTERFACE) && (bLength >= 10) && in_streaming_interface && (pDescriptor[pos + 2] == UVC_VS_INPUT_HEADER))
+        {
+            pDevice->video_endpoint = pDescriptor[pos + 6];
+            pDevice->still_method   = pDescriptor[pos + 9];
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_ENDPOINT) && (bLength >= 7) && in_streaming_interface)
+        {
+            UINT8 bTransferType = pDescriptor[pos + 3] & ENDPOINT_TRANSFER_TYPE_MASK;
+            
+            if((bTransferType == ENDPOINT_TRANSFER_TYPE_BULK) && ((current_alt != 0) || !(pDescriptor[pos + 2] & ENDPOINT_DIRECTION_IN)))
+            {
+                bTransferType = 0;              /* Only a bulk IN endpoint on alternate setting 0 carries video */
+            }
+            
+            if((bTransferType == ENDPOINT_TRANSFER_TYPE_BULK) && (pDevice->video_endpoint != 0) && (pDescriptor[pos + 2] != pDevice->video_endpoint))
+            {
+                bTransferType = 0;              /* The bulk endpoint of method 3 still images */
+            }
+            
+            if(((bTransferType == ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS) || (bTransferType == ENDPOINT_TRANSFER_TYPE_BULK)) && (pDevice->num_alt_settings < MAX_ALT_SETTINGS))
+            {
+                pDevice->alt_settings[pDevice->num_alt_settings].bAlternateSetting = current_alt;
+                pDevice->alt_settings[pDevice->num_alt_settings].bEndpointAddress  = pDescriptor[pos + 2];
+                pDevice->alt_settings[pDevice->num_alt_settings].wMaxPacketSize    = GET_LE16(&pDescriptor[pos + 4]) & ENDPOINT_MAX_PACKET_SIZE_MASK;
+                pDevice->alt_settings[pDevice->num_alt_settings].bTransactions     = 1;
+                
+                /* A high speed isochronous endpoint can move up to two more packets in the same microframe. The host
+                 * controller splits one packet descriptor into the transactions, so a packet of the stream is the
+                 * sum of all of them and still carries a single payload header. */
+                
+                if((bTransferType == ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS) && (pDevice->uSpeed == USBHST_HIGH_SPEED))
+                {
+                    pDevice->alt_settings[pDevice->num_alt_settings].bTransactions += (GET_LE16(&pDescriptor[pos + 4]) & ENDPOINT_TRANSACTIONS_MASK) >> ENDPOINT_TRANSACTIONS_SHIFT;
+                }
+                
+                pDevice->alt_settings[pDevice->num_alt_settings].uBytesPerInterval = pDevice->alt_settings[pDevice->num_alt_settings].wMaxPacketSize * pDevice->alt_settings[pDevice->num_alt_settings].bTransactions;
+                pDevice->alt_settings[pDevice->num_alt_settings].bInterval         = pDescriptor[pos + 6];
+                pDevice->alt_settings[pDevice->num_alt_settings].bTransferType     = bTransferType;
+                
+                #ifdef DEBUG
+                
+                logMsg("%s: Interface %d alternate setting %d: endpoint %x, wMaxPacketSize = %d x %d\n",__FUNCTION__,pDevice->streaming_interface,current_alt,pDevice->alt_settings[pDevice->num_alt_settings].bEndpointAddress,pDevice->alt_settings[pDevice->num_alt_settings].wMaxPacketSize,pDevice->alt_settings[pDevice->num_alt_settings].bTransactions);
+                
+                #endif
+                
+                pDevice->num_alt_settings++;
+            }
+        }
+        
+        pos += bLength;
+    }
+    
+    return pDevice->num_alt_settings;
+}
+
+/**************************************************************************************
+ * Function:     UINT8 Parse_Streaming_Formats(pUVC_DEVICE pDevice)                   *
+ * Description:  Walks the class specific descriptors of the video streaming          *
+ *               interface and builds the capability table of the camera: every       *
+ *               uncompressed, MJPEG and frame based format, the frame sizes of each  *
+ *               format and the frame intervals of each frame size, and the still     *
+ *               image sizes of each format. Formats, frames, intervals and still     *
+ *               sizes beyond MAX_FORMATS, MAX_FRAMES_PER_FORMAT, MAX_FRAME_INTERVALS *
+ *               and MAX_STILL_SIZES are skipped. Returns the number of formats.      *
+ *************************************************************************************/
+
+UINT8 Parse_Streaming_Formats(pUVC_DEVICE pDevice)
+{
+    const UCHAR *pDescriptor = pDevice->config_descriptor;
+    UINT32 uLength = pDevice->config_descriptor_length;
+    UINT32 pos = 0;
+    UINT8 i = 0;
+    UINT8 in_streaming_interface = 0;
+    UINT8 uIntervalOffset = 0;
+    pUVC_FORMAT pFormat = NULL;
+    pUVC_FRAME pFrame = NULL;
+    
+    memset(pDevice->formats, 0, sizeof(pDevice->formats));
+    pDevice->num_formats = 0;
+    pDevice->still_endpoint = 0;
+    
+    if(pDescriptor == NULL)
+    {
+        return 0;
+    }
+    
+    while((pos + 3) <= uLength)
+    {
+        UINT8 bLength = pDescriptor[pos];
+        UINT8 bDescriptorType = pDescriptor[pos + 1];
+        UINT8 bDescriptorSubtype = pDescriptor[pos + 2];
+        
+        if((bLength < 3) || ((pos + bLength) > uLength))
+        {
+            break;                              /* Malformed descriptor; stop with what has been found so far */
+        }
+        
+        if((bDescriptorType == DESCRIPTOR_TYPE_INTERFACE) && (bLength >= 9))
+        {
+            /* The format and frame descriptors follow alternate setting 0 of the streaming interface */
+            
+            in_streaming_interface = ((pDescriptor[pos + 2] == pDevice->streaming_interface) && (pDescriptor[pos + 3] == 0) && (pDescriptor[pos + 5] == UVC_CLASS_VIDEO) && (pDescriptor[pos + 6] == UVC_SUBCLASS_VIDEOSTREAMING));
+            pFormat = NULL;
+        }
+        else if((bDescriptorType == DESCRIPTOR_TYPE_CS_INTERFACE) && in_streaming_interface)
+        {
+            switch(bDescriptorSubtype)
+            {
+                case UVC_VS_FORMAT_UNCOMPRESSED:
+                case UVC_VS_FORMAT_FRAME_BASED:
+                case UVC_VS_FORMAT_MJPEG:
+                    
+                    pFormat = NULL;
+                    
+                    if((pDevice->num_formats >= MAX_FORMATS) || (bLength < ((bDescriptorSubtype == UVC_VS_FORMAT_MJPEG) ? 11 : 27)))
+                    {
+                        break;
+                    }
+                    
+                    pFormat = &pDevice->formats[pDevice->num_formats++];
+                    pFormat->bFormatIndex       = pDescriptor[pos + 3];
+                    pFormat->bDescriptorSubtype = bDescriptorSubtype;
+                    
+                    if(bDescriptorSubtype == UVC_VS_FORMAT_MJPEG)
+                    {
+                        pFormat->bDefaultFrameIndex = pDescriptor[pos + 6];
+                    }
+                    else
+                    {
+                        memcpy(pFormat->guidFormat, &pDescriptor[pos + 5], UVC_GUID_LENGTH);
+                        pFormat->bBitsPerPixel      = pDescriptor[pos + 21];
+                        pFormat->bDefaultFrameIndex = pDescriptor[pos + 22];
+                    }
+                    
+                    break;
+                    
+                case UVC_VS_FRAME_UNCOMPRESSED:
+                case UVC_VS_FRAME_FRAME_BASED:
+                case UVC_VS_FRAME_MJPEG:
+                    
+                    if((pFormat == NULL) || (pFormat->num_frames >= MAX_FRAMES_PER_FORMAT) || (bLength < 26))
+                    {
+                        break;                  /* A frame of a skipped format, or one too many */
+                    }
+                    
+                    pFrame = &pFormat->frames[pFormat->num_frames++];
+                    pFrame->bFrameIndex = pDescriptor[pos + 3];
+                    pFrame->wWidth      = GET_LE16(&pDescriptor[pos + 5]);
+                    pFrame->wHeight     = GET_LE16(&pDescriptor[pos + 7]);
+                    
+                    /* A frame based frame has no dwMaxVideoFrameBufferSize but dwBytesPerLine after the interval type */
+                    
+                    if(bDescriptorSubtype == UVC_VS_FRAME_FRAME_BASED)
+                    {
+                        pFrame->dwDefaultFrameInterval = GET_LE32(&pDescriptor[pos + 17]);
+                        pFrame->bFrameIntervalType     = pDescriptor[pos + 21];
+                    }
+                    else
+                    {
+                        pFrame->dwMaxVideoFrameBufferSize = GET_LE32(&pDescriptor[pos + 17]);
+                        pFrame->dwDefaultFrameInterval    = GET_LE32(&pDescriptor[pos + 21]);
+                        pFrame->bFrameIntervalType        = pDescriptor[pos + 25];
+                    }
+                    
+                    uIntervalOffset = 26;
+                    
+                    for(i = 0; (i < ((pFrame->bFrameIntervalType == 0) ? 3 : pFrame->bFrameIntervalType)) && (i < MAX_FRAME_INTERVALS); i++)
+                    {
+                        if((uIntervalOffset + 4) > bLength)
+                        {
+                            break;
+                        }
+                        
+                        pFrame->intervals[i] = GET_LE32(&pDescriptor[pos + uIntervalOffset]);
+                        pFrame->num_intervals++;
+                        uIntervalOffset += 4;
+                    }
+                    
+                    #ifdef DEBUG
+                    
+                    logMsg("%s: Format %d frame %d: %dx%d, default interval %d\n",__FUNCTION__,pFormat->bFormatIndex,pFrame->bFrameIndex,pFrame->wWidth,pFrame->wHeight,pFrame->dwDefaultFrameInterval);
+                    
+                    #endif
+                    
+                    break;
+                    
+                case UVC_VS_STILL_IMAGE_FRAME:
+                    
+                    if((pFormat == NULL) || (bLength < 5))
+                    {
+                        break;
+                    }
+                    
+                    if(pDescriptor[pos + 3] != 0)
+                    {
+                        pDevice->still_endpoint = pDescriptor[pos + 3];     /* Only set for method 3 */
+                    }
+                    
+                    /* wWidth and wHeight of every size, then bNumCompressionPattern */
+                    
+                    uIntervalOffset = 5 + (pDescriptor[pos + 4] * 4);
+                    
+                    for(i = 0; (i < pDescriptor[pos + 4]) && (i < MAX_STILL_SIZES) && ((5 + ((i + 1) * 4)) <= bLength); i++)
+                    {
+                        pFormat->still_width[i]  = GET_LE16(&pDescriptor[pos + 5 + (i * 4)]);
+                        pFormat->still_height[i] = GET_LE16(&pDescriptor[pos + 7 + (i * 4)]);
+                        pFormat->num_still_sizes++;
+                    }
+                    
+                    if(uIntervalOffset < bLength)
+                    {
+                        pFormat->num_still_compressions = pDescriptor[pos + uIntervalOffset];
+                    }
+                    
+                    #ifdef DEBUG
+                    
+                    logMsg("%s: Format %d has %d still sizes, endpoint %x\n",__FUNCTION__,pFormat->bFormatIndex,pFormat->num_still_sizes,pDescriptor[pos + 3],5,6);
+                    
+                    #endif
+                    
+                    break;
+                    
+                default:
+                    break;
+            }
+        }
+        
+        pos += bLength;
+    }
+    
+    return pDevice->num_formats;
+}
+
+/**************************************************************************************
+ * Function:     UINT8 Uvc_Get_Format_Count(pUVC_DEVICE pDevice)                      *
+ * Description:  Returns the number of formats in the capability table of the camera. *
+ *************************************************************************************/
+
+UINT8 Uvc_Get_Format_Count(pUVC_DEVICE pDevice)
+{
+    return pDevice->num_formats;
+}
+
+/**************************************************************************************
+ * Function:     pUVC_FORMAT Uvc_Get_Format(pUVC_DEVICE pDevice, UINT8 uPosition)     *
+ * Description:  Returns the format at position uPosition (0 to                       *
+ *               Uvc_Get_Format_Count() - 1) of the capability table, or NULL.        *
+ *************************************************************************************/
+
+pUVC_FORMAT Uvc_Get_Format(pUVC_DEVICE pDevice, UINT8 uPosition)
+{
+    if(uPosition >= pDevice->num_formats)
+    {
+        return NULL;
+    }
+    
+    return &pDevice->formats[uPosition];
+}
+
+/**************************************************************************************
+ * Function:     pUVC_FORMAT Uvc_Find_Format(pUVC_DEVICE pDevice, UINT8 bFormatIndex) *
+ * Description:  Returns the format with the given bFormatIndex, or NULL.             *
+ *************************************************************************************/
+
+pUVC_FORMAT Uvc_Find_Format(pUVC_DEVICE pDevice, UINT8 bFormatIndex)
+{
+    UINT8 i = 0;
+    
+    for(i = 0; i < pDevice->num_formats; i++)
+    {
+        if(pDevice->formats[i].bFormatIndex == bFormatIndex)
+        {
+            return &pDevice->formats[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/**************************************************************************************
+ * Function:     pUVC_FRAME Uvc_Find_Frame(pUVC_DEVICE pDevice, UINT8 bFormatIndex,   *
+ *                                         UINT8 bFrameIndex)                         *
+ * Description:  Returns the frame size bFrameIndex of format bFormatIndex, or NULL.  *
+ *************************************************************************************/
+
+pUVC_FRAME Uvc_Find_Frame(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex)
+{
+    UINT8 i = 0;
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, bFormatIndex);
+    
+    if(pFormat == NULL)
+    {
+        return NULL;
+    }
+    
+    for(i = 0; i < pFormat->num_frames; i++)
+    {
+        if(pFormat->frames[i].bFrameIndex == bFrameIndex)
+        {
+            return &pFormat->frames[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/**************************************************************************************
+ * Function:     pUVC_FRAME Uvc_Find_Smaller_Frame(pUVC_DEVICE pDevice,               *
+ *                                                 UINT8 bFormatIndex,                *
+ *                                                 UINT8 bFrameIndex)                 *
+ * Description:  Returns the largest frame size of format bFormatIndex with fewer     *
+ *               pixels than frame bFrameIndex, or NULL if there is none.             *
+ *************************************************************************************/
+
+pUVC_FRAME Uvc_Find_Smaller_Frame(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex)
+{
+    UINT8 i = 0;
+    UINT32 uArea = 0;
+    pUVC_FRAME pBest = NULL;
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, bFormatIndex);
+    pUVC_FRAME pFrame = Uvc_Find_Frame(pDevice, bFormatIndex, bFrameIndex);
+    
+    if(pFrame == NULL)
+    {
+        return NULL;
+    }
+    
+    uArea = (UINT32)pFrame->wWidth * pFrame->wHeight;
+    
+    for(i = 0; i < pFormat->num_frames; i++)
+    {
+        if((((UINT32)pFormat->frames[i].wWidth * pFormat->frames[i].wHeight) < uArea) &&
+           ((pBest == NULL) || (((UINT32)pFormat->frames[i].wWidth * pFormat->frames[i].wHeight) > ((UINT32)pBest->wWidth * pBest->wHeight))))
+        {
+            pBest = &pFormat->frames[i];
+        }
+    }
+    
+    return pBest;
+}
+
+/**************************************************************************************
+ * Function:     UINT8 Uvc_Frame_Supports_Interval(pUVC_FRAME pFrame,                 *
+ *                                                 UINT32 uInterval)                  *
+ * Description:  Returns 1 if the frame size supports the frame interval, either as   *
+ *               one of its discrete intervals or inside its continuous range.        *
+ *************************************************************************************/
+
+UINT8 Uvc_Frame_Supports_Interval(pUVC_FRAME pFrame, UINT32 uInterval)
+{
+    UINT8 i = 0;
+    
+    if(pFrame->bFrameIntervalType == 0)
+    {
+        if((pFrame->num_intervals < 3) || (uInterval < pFrame->intervals[0]) || (uInterval > pFrame->intervals[1]))
+        {
+            return 0;
+        }
+        
+        return ((pFrame->intervals[2] == 0) || (((uInterval - pFrame->intervals[0]) % pFrame->intervals[2]) == 0));
+    }
+    
+    for(i = 0; i < pFrame->num_intervals; i++)
+    {
+        if(pFrame->intervals[i] == uInterval)
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/**************************************************************************************
+ * Function:     UINT32 Uvc_Nearest_Frame_Interval(pUVC_FRAME pFrame,                 *
+ *                                                 UINT32 uInterval)                  *
+ * Description:  Returns the frame interval of the frame size closest to uInterval:   *
+ *               the nearest discrete interval, or uInterval clamped to the           *
+ *               continuous range and rounded to the nearest step.                    *
+ *************************************************************************************/
+
+UINT32 Uvc_Nearest_Frame_Interval(pUVC_FRAME pFrame, UINT32 uInterval)
+{
+    UINT8 i = 0;
+    UINT32 uBest = 0;
+    UINT32 uSteps = 0;
+    
+    if(pFrame->num_intervals == 0)
+    {
+        return pFrame->dwDefaultFrameInterval;
+    }
+    
+    if(pFrame->bFrameIntervalType == 0)
+    {
+        if((pFrame->num_intervals < 3) || (uInterval <= pFrame->intervals[0]))
+        {
+            return pFrame->intervals[0];
+        }
+        
+        if(uInterval >= pFrame->intervals[1])
+        {
+            return pFrame->intervals[1];
+        }
+        
+        if(pFrame->intervals[2] == 0)
+        {
+            return uInterval;
+        }
+        
+        uSteps = (uInterval - pFrame->intervals[0] + (pFrame->intervals[2] / 2)) / pFrame->intervals[2];
+        uBest = pFrame->intervals[0] + (uSteps * pFrame->intervals[2]);
+        
+        return (uBest > pFrame->intervals[1]) ? pFrame->intervals[1] : uBest;
+    }
+    
+    uBest = pFrame->intervals[0];
+    
+    for(i = 1; i < pFrame->num_intervals; i++)
+    {
+        if(((pFrame->intervals[i] > uInterval) ? (pFrame->intervals[i] - uInterval) : (uInterval - pFrame->intervals[i])) <
+           ((uBest > uInterval) ? (uBest - uInterval) : (uInterval - uBest)))
+        {
+            uBest = pFrame->intervals[i];
+        }
+    }
+    
+    return uBest;
+}
+
+/**************************************************************************************
+ * Function:     VOID Uvc_Apply_Quirks(pUVC_DEVICE pDevice)                           *
+ * Description:  Looks the camera up in uvc_quirks[] by VID/PID. The flags of its     *
+ *               entry are kept in pDevice->quirks for the negotiation and the frame  *
+ *               assembly, a UVC 1.0 camera with QUIRK_PROBE_EXTRAFIELDS gets the 34  *
+ *               byte probe/commit structure, and the mode of the entry replaces the  *
+ *               default mode. Must run after the descriptors have been parsed and    *
+ *               before Uvc_Select_Default_Mode().                                    *
+ *************************************************************************************/
+
+VOID Uvc_Apply_Quirks(pUVC_DEVICE pDevice)
+{
+    UINT32 i = 0;
+    
+    pDevice->pQuirk = NULL;
+    pDevice->quirks = QUIRK_NONE;
+    
+    for(i = 0; uvc_quirks[i].idVendor != 0; i++)
+    {
+        if((uvc_quirks[i].idVendor == pDevice->idVendor) && (uvc_quirks[i].idProduct == pDevice->idProduct))
+        {
+            pDevice->pQuirk = &uvc_quirks[i];
+            pDevice->quirks = uvc_quirks[i].uFlags;
+            
+            break;
+        }
+    }
+    
+    if(pDevice->pQuirk == NULL)
+    {
+        return;
+    }
+    
+    if((pDevice->quirks & QUIRK_PROBE_EXTRAFIELDS) && (pDevice->probe_length < PROBE_LENGTH_UVC11))
+    {
+        pDevice->probe_length = PROBE_LENGTH_UVC11;
+    }
+    
+    if(pDevice->pQuirk->bFormatIndex != 0)
+    {
+        pDevice->probe.bFormatIndex = pDevice->pQuirk->bFormatIndex;
+    }
+    
+    if(pDevice->pQuirk->bFrameIndex != 0)
+    {
+        pDevice->probe.bFrameIndex = pDevice->pQuirk->bFrameIndex;
+    }
+    
+    if(pDevice->pQuirk->dwFrameInterval != 0)
+    {
+        pDevice->probe.dwFrameInterval = pDevice->pQuirk->dwFrameInterval;
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Camera %04x:%04x has quirks %x\n",__FUNCTION__,pDevice->idVendor,pDevice->idProduct,pDevice->quirks,5,6);
+    
+    #endif
+}
+
+/**************************************************************************************
+ * Function:     VOID Uvc_Select_Default_Mode(pUVC_DEVICE pDevice)                    *
+ * Description:  Checks the format, frame size and frame interval fill_defaults()     *
+ *               or the camera's quirk entry put in the probe against the capability  *
+ *               table. fill_defaults() asks for no particular format or frame, so a  *
+ *               camera without a quirk entry gets the first uncompressed format (or  *
+ *               the first MJPEG format, or the first format) and its default frame,  *
+ *               and an interval the frame does not support by the frame's default    *
+ *               interval. Nothing is changed if the camera described no formats.     *
+ *************************************************************************************/
+
+VOID Uvc_Select_Default_Mode(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    pUVC_FORMAT pFormat = NULL;
+    pUVC_FRAME pFrame = NULL;
+    
+    if(pDevice->num_formats == 0)
+    {
+        return;
+    }
+    
+    pFrame = Uvc_Find_Frame(pDevice, pDevice->probe.bFormatIndex, pDevice->probe.bFrameIndex);
+    
+    if(pFrame == NULL)
+    {
+        pFormat = &pDevice->formats[0];
+        
+        for(i = 0; i < pDevice->num_formats; i++)
+        {
+            if(pDevice->formats[i].bDescriptorSubtype == UVC_VS_FORMAT_UNCOMPRESSED)
+            {
+                pFormat = &pDevice->formats[i];
+                break;
+            }
+            
+            if((pDevice->formats[i].bDescriptorSubtype == UVC_VS_FORMAT_MJPEG) && (pFormat->bDescriptorSubtype != UVC_VS_FORMAT_MJPEG))
+            {
+                pFormat = &pDevice->formats[i];     /* Taken unless an uncompressed format follows */
+            }
+        }
+        
+        pFrame = Uvc_Find_Frame(pDevice, pFormat->bFormatIndex, pFormat->bDefaultFrameIndex);
+        
+        if((pFrame == NULL) && (pFormat->num_frames > 0))
+        {
+            pFrame = &pFormat->frames[0];
+        }
+        
+        if(pFrame == NULL)
+        {
+            return;
+        }
+        
+        pDevice->probe.bFormatIndex = pFormat->bFormatIndex;
+        pDevice->probe.bFrameIndex  = pFrame->bFrameIndex;
+    }
+    
+    if(Uvc_Frame_Supports_Interval(pFrame, pDevice->probe.dwFrameInterval) == 0)
+    {
+        pDevice->probe.dwFrameInterval = pFrame->dwDefaultFrameInterval;
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Format %d, frame %d (%dx%d), interval %d\n",__FUNCTION__,pDevice->probe.bFormatIndex,pDevice->probe.bFrameIndex,pFrame->wWidth,pFrame->wHeight,pDevice->probe.dwFrameInterval);
+    
+    #endif
+}
+
+/**************************************************************************************
+ * Function:     pALT_SETTING Select_Alt_Setting(pUVC_DEVICE pDevice,                 *
+ *                                               UINT32 uPayloadSize)                 *
+ * Description:  Selects the alternate setting with the smallest uBytesPerInterval    *
+ *               that is still large enough for uPayloadSize (the                     *
+ *               dwMaxPayloadTransferSize negotiated with the camera). If none is     *
+ *               large enough, the largest one is used. Sets selected_alt and         *
+ *               iso_packet_size.                                                     *
+ *                                                                                    *
+ *               If the selected endpoint is a bulk endpoint, the stream runs in bulk *
+ *               mode and the bulk URB size is derived from uPayloadSize.             *
+ *************************************************************************************/
+
+pALT_SETTING Select_Alt_Setting(pUVC_DEVICE pDevice, UINT32 uPayloadSize)
+{
+    UINT8 i = 0;
+    pALT_SETTING pBest = NULL;
+    pALT_SETTING pLargest = NULL;
+    
+    for(i = 0; i < pDevice->num_alt_settings; i++)
+    {
+        if((pLargest == NULL) || (pDevice->alt_settings[i].uBytesPerInterval > pLargest->uBytesPerInterval))
+        {
+            pLargest = &pDevice->alt_settings[i];
+        }
+        
+        if((pDevice->alt_settings[i].uBytesPerInterval >= uPayloadSize) && ((pBest == NULL) || (pDevice->alt_settings[i].uBytesPerInterval < pBest->uBytesPerInterval)))
+        {
+            pBest = &pDevice->alt_settings[i];
+        }
+    }
+    
+    if(pBest == NULL)
+    {
+        pBest = pLargest;
+    }
+    
+    pDevice->selected_alt = pBest;
+    
+    if(pBest != NULL)
+    {
+        pDevice->iso_packet_size = pBest->uBytesPerInterval;
+        pDevice->bulk_mode = (pBest->bTransferType == ENDPOINT_TRANSFER_TYPE_BULK);
+        
+        if(pDevice->bulk_mode)
+        {
+            /* A URB of a whole payload completes once per payload. Payloads larger than BULK_MAX_TRANSFER_SIZE span
+             * several URBs; the size is kept a multiple of the packet size so only the end of a payload is short. */
+            
+            pDevice->bulk_payload_size  = uPayloadSize;
+            pDevice->bulk_transfer_size = ((uPayloadSize == 0) || (uPayloadSize > BULK_MAX_TRANSFER_SIZE)) ? BULK_MAX_TRANSFER_SIZE : uPayloadSize;
+            pDevice->bulk_transfer_size = ((pDevice->bulk_transfer_size + pBest->wMaxPacketSize - 1) / pBest->wMaxPacketSize) * pBest->wMaxPacketSize;
+        }
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Payload size %d - selected alternate setting %d with packet size %d\n",__FUNCTION__,uPayloadSize,pBest->bAlternateSetting,pDevice->iso_packet_size,5,6);
+        
+        #endif
+    }
+    
+    return pBest;
+}
+
+/**************************************************************************
+ * Function:     STATUS Control_Pool_Init(void)                           *
+ * Description:  Allocates the events of the control contexts and links   *
+ *               all the contexts into the free list. The pool is created *
+ *               only once, so calling camInit() again after shutDown()   *
+ *               reuses it.                                               *
+ *************************************************************************/
+
+STATUS Control_Pool_Init(void)
+{
+    UINT8 i = 0;
+    
+    if(controlPoolMutex != NULL)
+    {
+        return OK;                              /* Already initialized */
+    }
+    
+    memset(controlPool, 0, sizeof(controlPool));
+    
+    for(i = 0; i < CONTROL_POOL_SIZE; i++)
+    {
+        controlPool[i].eventId = OS_CREATE_EVENT(OS_EVENT_NON_SIGNALED);
+        
+        if(controlPool[i].eventId == NULL)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: OS_CREATE_EVENT for context %d failed.\n",__FUNCTION__,i,3,4,5,6);
+            
+            #endif
+            
+            break;
+        }
+        
+        controlPool[i].pNext = pControlFreeList;
+        pControlFreeList = &controlPool[i];
+    }
+    
+    if(i == CONTROL_POOL_SIZE)
+    {
+        controlPoolCount = semCCreate(SEM_Q_FIFO, CONTROL_POOL_SIZE);
+        controlPoolMutex = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    }
+    
+    if((controlPoolCount == NULL) || (controlPoolMutex == NULL))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Creating the control pool failed.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        /* Everything is undone, so that the next call starts over instead of finding a half built pool */
+        
+        while(i > 0)
+        {
+            i--;
+            OS_DESTROY_EVENT(controlPool[i].eventId);
+            controlPool[i].eventId = NULL;
+        }
+        
+        pControlFreeList = NULL;
+        
+        if(controlPoolCount != NULL)
+        {
+            semDelete(controlPoolCount);
+            controlPoolCount = NULL;
+        }
+        
+        if(controlPoolMutex != NULL)
+        {
+            semDelete(controlPoolMutex);
+            controlPoolMutex = NULL;
+        }
+        
+        return ERROR;
+    }
+    
+    return OK;
+}
+
+/**************************************************************************
+ * Function:     pCONTROL_CONTEXT Control_Context_Get(void)               *
+ * Description:  Takes a context out of the pool. If all the contexts are *
+ *               in use, the caller blocks until one is returned.         *
+ *************************************************************************/
+
+pCONTROL_CONTEXT Control_Context_Get(void)
+{
+    pCONTROL_CONTEXT pContext = NULL;
+    
+    if(semTake(controlPoolCount, WAIT_FOREVER) != OK)
+    {
+        return NULL;
+    }
+    
+    semTake(controlPoolMutex, WAIT_FOREVER);
+    
+    pContext = pControlFreeList;
+    pControlFreeList = pContext->pNext;
+    pContext->pNext = NULL;
+    
+    semGive(controlPoolMutex);
+    
+    return pContext;
+}
+
+/**************************************************************************
+ * Function:     VOID Control_Context_Put(pCONTROL_CONTEXT pContext)      *
+ * Description:  Returns a context to the pool and wakes up a caller that *
+ *               may be waiting for one.                                  *
+ *************************************************************************/
+
+VOID Control_Context_Put(pCONTROL_CONTEXT pContext)
+{
+    semTake(controlPoolMutex, WAIT_FOREVER);
+    
+    pContext->pNext = pControlFreeList;
+    pControlFreeList = pContext;
+    
+    semGive(controlPoolMutex);
+    
+    semGive(controlPoolCount);
+}
+
+/**********************************************************************************
+ * Function:     USBHST_STATUS Control_Completion_Callback(pUSBHST_URB pUrb)      *
+ * Description:  Checks if the pointer pUrb is not a NULL pointer which indicates *
+ *               an error. Wakes up the task waiting on the control context.      *
+ *********************************************************************************/
+
+USBHST_STATUS Control_Completion_Callback(pUSBHST_URB pUrb)
+{
+    #ifdef DEBUG
+    
+    logMsg("%s: In the control completion callback function.\n",__FUNCTION__,2,3,4,5,6);
+
+    #endif
+    
+    if(pUrb == NULL)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: pUrb = NULL \n",__FUNCTION__,2,3,4,5,6);
+            
+        #endif
+        
+        return USBHST_FAILURE;                  /* There is no context to wake up; other cameras are unaffected */
+    }
+        
+    OS_RELEASE_EVENT(((pCONTROL_CONTEXT)pUrb->pContext)->eventId);
+        
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************************************************
+ * Function:    USBHST_STATUS Control_Transfer(pUVC_DEVICE pDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue,            *
+ *                                             UINT16 uIndex)                                                                    *
+ * Description: Performs a class specific control transfer using the camera's data[] array as the data stage buffer. The length *
+ *              is the probe/commit length of the camera's UVC revision.                                                         *
+ ********************************************************************************************************************************/
+
+USBHST_STATUS Control_Transfer(pUVC_DEVICE pDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex)
+{
+    return Control_Transfer_Buffer(pDevice->hDevice, uRequestType, uRequest, uValue, uIndex, &pDevice->data[0], pDevice->probe_length);
+}
+
+/*********************************************************************************************************************************
+ * Function:    USBHST_STATUS Control_Transfer_Buffer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue,         *
+ *                                                    UINT16 uIndex, UCHAR *pBuffer, UINT16 uLength)                             *
+ * Description: Takes a control context from the pool and fills up its setup packet based on the arguments passed with the call. *
+ *              This setup packet determines the type of request that the host is sending the device.                            *
+ *                                                                                                                               *
+ *              The URB of the context is filled and submitted. For OUT requests, pBuffer is copied into the context before the  *
+ *              transfer; for IN requests, the received data is copied back into pBuffer after it. A transfer that has not       *
+ *              completed after CONTROL_TIMEOUT ticks is cancelled and USBHST_TIMEOUT is returned. The context is then returned  *
+ *              to the pool, so no memory is allocated and no event is created for the transfer.                                 *
+ ********************************************************************************************************************************/
+
+USBHST_STATUS Control_Transfer_Buffer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex, UCHAR *pBuffer, UINT16 uLength)
+{   
+    #ifdef DEBUG
+    
+    UCHAR i = 0;
+    
+    for(i = 0; i < uLength; i++)
+    {
+        logMsg("%s: data = %x \n",__FUNCTION__,pBuffer[i],3,4,5,6);
+    }
+    
+    #endif
+    
+    pCONTROL_CONTEXT pContext;
+    
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    if(uLength > CONTROL_BUFFER_SIZE)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Transfer length %d is larger than the context buffer.\n",__FUNCTION__,uLength,3,4,5,6);
+        
+        #endif
+        
+        return USBHST_INVALID_PARAMETER;
+    }
+    
+    pContext = Control_Context_Get();
+    
+    if(NULL == pContext)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Control_Context_Get failed.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    
+    memset(&pContext->urb, 0, sizeof(USBHST_URB));
+    
+    if((uRequestType & USB_DIRECTION_MASK) != 0)
+    {
+        memset(pContext->buffer, 0, uLength);
+    }
+    else
+    {
+        memcpy(pContext->buffer, pBuffer, uLength);
+    }
+    
+    USBHST_FILL_SETUP_PACKET(&pContext->setupPacket, uRequestType, uRequest, uValue, uIndex, uLength);    
+    
+    #ifdef DEBUG
+    
+    logMsg("%s:Req type = %x, request = %x, value = %x, index = %x, size = %d\n",__FUNCTION__, pContext->setupPacket.bmRequestType, pContext->setupPacket.bRequest,OS_UINT16_LE_TO_CPU(pContext->setupPacket.wValue), OS_UINT16_LE_TO_CPU(pContext->setupPacket.wIndex), OS_UINT16_LE_TO_CPU(pContext->setupPacket.wLength));
+    
+    #endif
+    
+    USBHST_FILL_CONTROL_URB(&pContext->urb, hDevice, CONTROL_TRANSFER_ENDPOINT, pContext->buffer, uLength, USBHST_SHORT_TRANSFER_OK /* Source: www.jungo.com/st/support/tech_docs/td107.html - Says that control transfers are always short transfers */, &pContext->setupPacket, Control_Completion_Callback, pContext, USBHST_SUCCESS);
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: After filling the control URB\n",__FUNCTION__,2,3,4,5,6);
+    logMsg("hdevice = %d, Endpoint = %d, Transfer length = %d, Transfer flags = %d, context = %d, status = %d\n", pContext->urb.hDevice, pContext->urb.uEndPointAddress, pContext->urb.uTransferLength, pContext->urb.uTransferFlags, pContext->urb.pContext, pContext->urb.nStatus);
+    
+    #endif
+    
+    nStatus = usbHstURBSubmit(&pContext->urb);
+    
+    if(nStatus == USBHST_SUCCESS)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: usbHstUrbSubmit was successful\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        if(OS_WAIT_FOR_EVENT(pContext->eventId, CONTROL_TIMEOUT) == OK)
+        {
+            nStatus = pContext->urb.nStatus;
+        }
+        else
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: Control transfer timed out.\n",__FUNCTION__,2,3,4,5,6);
+            
+            #endif
+            
+            usbHstURBCancel(&pContext->urb);
+            OS_WAIT_FOR_EVENT(pContext->eventId, OS_WAIT_INFINITE);     /* The cancelled URB completes before the context is reused */
+            
+            nStatus = USBHST_TIMEOUT;
+        }
+        
+        if((nStatus == USBHST_SUCCESS) && ((uRequestType & USB_DIRECTION_MASK) != 0))
+        {
+            memcpy(pBuffer, pContext->buffer, uLength);
+        }
+    }   
+    
+    Control_Context_Put(pContext);
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Control transfer nStatus = %d\n",__FUNCTION__, nStatus,3,4,5,6);
+    
+    for(i = 0; i < uLength; i++)
+    {
+        logMsg("%s: data = %x \n",__FUNCTION__,pBuffer[i],3,4,5,6);
+    }
+    
+    #endif
+    
+    return nStatus;
+}
+
+/*****************************************************************************************
+ * Function:     VOID Stream_End_Frame(pUVC_DEVICE pDevice)                              *
+ * Description:  Called when the FID bit toggles, i.e. when the frame in image_buffer is *
+ *               complete. The frame is handed to processImage() in a task of its own,   *
+ *               unless it is damaged or it is the partial frame the stream started (or  *
+ *               was resynchronised) in the middle of; such frames are dropped. An MJPEG *
+ *               frame or a still image is handed over with the number of bytes         *
+ *               received for it.                                                        *
+ *                                                                                       *
+ *               The image task owns the buffer of its frame until it gives synch_sem;   *
+ *               image_buffer and spare_buffer are swapped, so the next frame is         *
+ *               assembled in the other one. If the image task is still working on the   *
+ *               previous frame, there is no free buffer; the completion path must not   *
+ *               wait for it, so the frame is dropped.                                   *
+ ****************************************************************************************/
+
+VOID Stream_End_Frame(pUVC_DEVICE pDevice)
+{
+    char task_name[TASK_NAME_LENGTH];
+    UINT32 uFrameSize = (UINT32)pDevice->frame_width * pDevice->frame_height * 2;     /* dwMaxVideoFrameSize may be larger */
+    UCHAR *pFrame = NULL;
+    
+    if(pDevice->frame_synced == 0)
+    {
+        pDevice->frame_synced = 1;              /* The next frame is the first complete one */
+    }
+    else if(pDevice->frame_damaged == 1)
+    {
+        pDevice->damaged_frames++;
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Damaged frame dropped (%d so far).\n",__FUNCTION__,pDevice->damaged_frames,3,4,5,6);
+        
+        #endif
+    }
+    else
+    {
+        if(pDevice->first_frame_sent == 0)
+        {
+            pDevice->first_frame_sent = 1;
+            
+            semGive(pDevice->first_frame_sem);
+            
+            if(streamEventCallback != NULL)
+            {
+                streamEventCallback(pDevice->hDevice, STREAM_EVENT_FIRST_FRAME);
+            }
+        }
+        
+        pDevice->recoveries = 0;                /* The stream is healthy again */
+        
+        if((pDevice->first == 1) && (semTake(pDevice->synch_sem, NO_WAIT) != OK))
+        {
+            pDevice->busy_frames++;             /* The image task still owns spare_buffer */
+            
+            #ifdef DEBUG
+            
+            logMsg("%s: Image task busy, frame dropped (%d so far).\n",__FUNCTION__,pDevice->busy_frames,3,4,5,6);
+            
+            #endif
+        }
+        else
+        {
+            pDevice->first = 0;                 /* synch_sem stays taken until the image task gives it */
+            
+            pDevice->frameCount--;
+            if(pDevice->frameCount == 0)
+            {
+                pDevice->aborted = 1;
+            }
+            
+            if((pDevice->format_subtype == UVC_VS_FORMAT_MJPEG) || (pDevice->frame_still == 1))
+            {
+                uFrameSize = pDevice->offset;   /* A compressed frame or a still is as long as the data received for it */
+            }
+            
+            pDevice->frame_info.uTicks    = tickGet();
+            pDevice->frame_info.uPts      = pDevice->frame_pts;
+            pDevice->frame_info.bPtsValid = pDevice->frame_pts_valid;
+            pDevice->frame_info.bStill    = pDevice->frame_still;
+            
+            pFrame                = pDevice->image_buffer;
+            pDevice->image_buffer = pDevice->spare_buffer;
+            pDevice->spare_buffer = pFrame;
+            
+            snprintf(task_name, sizeof(task_name), "tUvcImg%d", pDevice->uIndex);
+            
+            if(taskSpawn(task_name, IMAGE_TASK_PRIORITY, 0, IMAGE_TASK_STACK_SIZE, (FUNCPTR)processImage, pDevice, pFrame, uFrameSize, 0, 0, 0, 0, 0, 0, 0) == ERROR)
+            {
+                logMsg("Process image task spawn failed\n",1,2,3,4,5,6);
+                
+                /* The frame is dropped. Both buffers are free, so synch_sem is given back */
+                
+                semGive(pDevice->synch_sem);
+            }
+            
+            pDevice->first = 1;
+        }
+    }
+    
+    pDevice->frame_damaged = 0;
+    pDevice->frame_pts_valid = 0;
+    pDevice->frame_still = 0;
+    pDevice->offset = 0;
+}
+
+/*****************************************************************************************
+ * Function:     VOID Stream_Assemble_Payload(pUVC_DEVICE pDevice, const UCHAR *pPayload, *
+ *                                            UINT32 uLength)                             *
+ * Description:  Handles the start of one payload: pPayload points to the payload header *
+ *               and uLength counts the header and the data that follows it. Shared by   *
+ *               the isochronous and bulk paths.                                         *
+ *                                                                                       *
+ *               If the FID bit differs from the previous payload, the frame in          *
+ *               image_buffer is complete and is handed to Stream_End_Frame() before the *
+ *               data is copied in. Payloads with nothing but a header are ignored.      *
+ ****************************************************************************************/
+
+VOID Stream_Assemble_Payload(pUVC_DEVICE pDevice, const UCHAR *pPayload, UINT32 uLength)
+{
+    UINT32 uHeaderLength = 0;
+    
+    if(uLength < 2)
+    {
+        return;
+    }
+    
+    uHeaderLength = pPayload[0];
+    
+    if((uHeaderLength < 2) || (uHeaderLength > uLength))
+    {
+        pDevice->frame_damaged = 1;             /* Not a valid payload header */
+        
+        return;
+    }
+    
+    if(uLength == uHeaderLength)
+    {
+        if(pPayload[1] & HEADER_EOF_BIT)
+        {
+            pDevice->eof_seen = 1;
+        }
+        
+        return;                                 /* Stream header only */
+    }
+    
+    /* A new frame starts when the FID bit toggles, or for a camera that does not toggle it, after a payload with EOF */
+    
+    if((pDevice->quirks & QUIRK_STREAM_NO_FID) ? pDevice->eof_seen : (pDevice->mem_h != (pPayload[1] & HEADER_FID_BIT)))
+    {
+        pDevice->mem_h = (pPayload[1] & HEADER_FID_BIT);
+        pDevice->end_of_image  = 1;
+        
+        Stream_End_Frame(pDevice);
+        
+        if(pDevice->format_subtype != UVC_VS_FORMAT_MJPEG)
+        {
+            memset(pDevice->image_buffer, 0, pDevice->video_frame_size);     /* Clear the buffer the next frame is assembled in */
+        }
+    }
+    
+    if(pPayload[1] & HEADER_ERR_BIT)
+    {
+        pDevice->frame_damaged = 1;             /* The camera reports an error in this frame */
+    }
+    
+    if((pPayload[1] & HEADER_PTS_BIT) && (uHeaderLength >= (HEADER_PTS_OFFSET + 4)) && (pDevice->frame_pts_valid == 0))
+    {
+        pDevice->frame_pts = GET_LE32(&pPayload[HEADER_PTS_OFFSET]);     /* Every payload of a frame carries the same PTS */
+        pDevice->frame_pts_valid = 1;
+    }
+    
+    if(pPayload[1] & HEADER_STI_BIT)
+    {
+        pDevice->frame_still = 1;               /* A method 2 still, sent in place of a video frame */
+    }
+    
+    pDevice->eof_seen = ((pPayload[1] & HEADER_EOF_BIT) != 0);
+    
+    Stream_Append_Data(pDevice, pPayload + uHeaderLength, uLength - uHeaderLength);
+}
+
+/*****************************************************************************************
+ * Function:     VOID Stream_Append_Data(pUVC_DEVICE pDevice, const UCHAR *pData,         *
+ *                                       UINT32 uLength)                                 *
+ * Description:  Copies frame data to the end of image_buffer. If the frame would not    *
+ *               fit, a FID toggle was missed; the data is dropped and the frame is      *
+ *               marked as damaged.                                                      *
+ ****************************************************************************************/
+
+VOID Stream_Append_Data(pUVC_DEVICE pDevice, const UCHAR *pData, UINT32 uLength)
+{
+    if((pDevice->offset + uLength) > pDevice->image_buffer_size)
+    {
+        pDevice->frame_damaged = 1;
+        
+        return;
+    }
+    
+    memcpy((void *)(pDevice->image_buffer + pDevice->offset), (const void *)pData, uLength);
+    pDevice->offset += uLength;
+}
+
+/*****************************************************************************************
+ * Function:     VOID Stream_Request_Recovery(pUVC_DEVICE pDevice)                       *
+ * Description:  Asks the service task to restart the stream with Stream_Recover(). Used *
+ *               from the completion path, which cannot wait for URBs or send control    *
+ *               transfers itself. Only one request is queued at a time.                 *
+ ****************************************************************************************/
+
+VOID Stream_Request_Recovery(pUVC_DEVICE pDevice)
+{
+    SERVICE_MSG msg;
+    
+    if((pDevice->recovery_pending == 1) || (pDevice->stream_stopping == 1))
+    {
+        return;
+    }
+    
+    msg.uCommand = SERVICE_RECOVER;
+    msg.uParam   = 0;
+    
+    if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) == OK)
+    {
+        pDevice->recovery_pending = 1;
+    }
+}
+
+/*****************************************************************************************
+ * Function:     USBHST_STATUS Isochronous_Completion_Callback(pUSHBST_URB pUrb)         *
+ * Description:  This callback function is called when the host revieves data from the   *
+ *               camera.                                                                 *
+ *                                                                                       *
+ *               Normally the URB is processed with Isochronous_Process() and submitted  *
+ *               again with Isochronous_Resubmit() right here. In batch mode the URB is  *
+ *               only queued for the camera's batch task (see Stream_Batch_Task()), and  *
+ *               the task is woken up only if it is not already due to run.             *
+ ****************************************************************************************/
+
+USBHST_STATUS Isochronous_Completion_Callback(pUSBHST_URB pUrb)
+{
+    pISO_TRANSFER pTransfer = (pISO_TRANSFER)pUrb->pContext;
+    pUVC_DEVICE pDevice = pTransfer->pDevice;
+    
+    if((pUrb->nStatus == USBHST_TRANSFER_CANCELLED) || (pDevice->stream_stopping == 1))
+    {
+        Stream_Urb_Done(pTransfer);             /* Cancelled by Stream_Stop(). The buffer holds no valid data */
+        
+        return USBHST_SUCCESS;
+    }
+    
+    if(pDevice->batch_mode)
+    {
+        pDevice->batch_ring[vxAtomicGet(&pDevice->batch_head) & (BATCH_RING_SIZE - 1)] = pTransfer;
+        vxAtomicInc(&pDevice->batch_head);
+        
+        if(vxAtomicSet(&pDevice->batch_signalled, 1) == 0)
+        {
+            semGive(pDevice->batch_sem);        /* One wakeup for all the URBs that complete until the task runs */
+        }
+        
+        return USBHST_SUCCESS;
+    }
+    
+    if(Isochronous_Process(pDevice, pTransfer))
+    {
+        Isochronous_Resubmit(pDevice, pTransfer);
+    }
+    
+    return USBHST_SUCCESS;
+}
+
+/*****************************************************************************************
+ * Function:     UINT8 Isochronous_Process(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer) *
+ * Description:  Handles the data of a completed isochronous URB. Every packet without   *
+ *               an error is handed to Stream_Assemble_Payload(), which compares the FID *
+ *               bit of its header with the previous packet and copies the data to       *
+ *               image_buffer.                                                           *
+ *                                                                                       *
+ *               Errors are handled according to where they are reported:                *
+ *               -> a packet with a bad status, or with the ERR bit set in its header,   *
+ *                  marks the current frame as damaged; it is dropped at the next FID,   *
+ *               -> a URB that fails as a whole is resubmitted up to MAX_URB_RETRIES     *
+ *                  times in a row, after which the stream is recovered by the service   *
+ *                  task,                                                                *
+ *               -> a stalled endpoint is recovered by the service task, which clears    *
+ *                  the halt and restarts the stream; it resyncs at the next FID.        *
+ *                                                                                       *
+ *               Returns 1 if the URB must be submitted again, or 0 if it was retired.   *
+ ****************************************************************************************/
+
+UINT8 Isochronous_Process(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer)
+{
+    UINT16 i = 0;
+    UINT32 uLength = 0;
+    UCHAR *pPacket = NULL;
+    pUSBHST_URB pUrb = &pTransfer->urb;
+    
+    pUSBHST_ISO_PACKET_DESC pIsochronous_Packet_Descriptor;
+    
+    pIsochronous_Packet_Descriptor = pUrb->pTransferSpecificData;
+    
+    if(pUrb->nStatus != USBHST_SUCCESS)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: URB failed with status %d (retry %d)\n",__FUNCTION__,pUrb->nStatus,pTransfer->uRetries,4,5,6);
+        
+        #endif
+        
+        pDevice->frame_damaged = 1;             /* Whatever the URB carried is lost */
+        pDevice->urb_errors++;
+        
+        if(pUrb->nStatus == USBHST_STALL_ERROR)
+        {
+            pDevice->endpoint_halted = 1;       /* Resubmitting to a halted endpoint fails until the halt is cleared */
+            
+            Stream_Urb_Done(pTransfer);
+            Stream_Request_Recovery(pDevice);
+            
+            return 0;
+        }
+        
+        if(pTransfer->uRetries >= MAX_URB_RETRIES)
+        {
+            Stream_Urb_Done(pTransfer);
+            Stream_Request_Recovery(pDevice);
+            
+            return 0;
+        }
+        
+        pTransfer->uRetries++;
+    }
+    else
+    {
+        pTransfer->uRetries = 0;
+        
+        for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
+        {
+            pDevice->window_packets++;
+            
+            if(pIsochronous_Packet_Descriptor[i].nStatus != USBHST_SUCCESS)
+            {
+                #ifdef DEBUG
+                
+                logMsg("%s: The packet %d has status %d\n",__FUNCTION__, i, pIsochronous_Packet_Descriptor[i].nStatus,4,5,6);
+                
+                #endif
+                
+                pDevice->window_errors++;
+                pDevice->frame_damaged = 1;     /* Part of the frame is missing */
+                
+                continue;
+            }
+            
+            uLength = pIsochronous_Packet_Descriptor[i].uLength;
+            pPacket = pUrb->pTransferBuffer + (i * pDevice->iso_packet_size);
+            
+            Stream_Assemble_Payload(pDevice, pPacket, uLength);     /* Every isochronous packet is one payload */
+        }
+    }
+    
+    /* If too many packets of the last window were bad, the bus is likely too busy for the current setting. The
+     * downshift needs control transfers, so it is handed to the service task. */
+    
+    if(pDevice->window_packets >= ERROR_RATE_WINDOW)
+    {
+        if(pDevice->adaptive_mode && (pDevice->downshift_pending == 0) && ((pDevice->window_errors * 100) >= (pDevice->window_packets * ERROR_RATE_THRESHOLD)))
+        {
+            SERVICE_MSG msg;
+            
+            msg.uCommand = SERVICE_DOWNSHIFT;
+            msg.uParam   = 0;
+            
+            if(msgQSend(pDevice->service_queue, (char *)&msg, sizeof(msg), NO_WAIT, MSG_PRI_NORMAL) == OK)
+            {
+                pDevice->downshift_pending = 1;
+            }
+        }
+        
+        pDevice->window_packets = 0;
+        pDevice->window_errors  = 0;
+    }
+    
+    return 1;
+}
+
+/*****************************************************************************************
+ * Function:     VOID Isochronous_Resubmit(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer) *
+ * Description:  Refills the packet descriptors of a processed URB and submits it again, *
+ *               in the next slot of the schedule if ISO_SCHEDULE_EXPLICIT is used. A    *
+ *               URB that cannot be submitted is retired and a recovery is requested,    *
+ *               otherwise the stream would die once all URBs are lost.                  *
+ ****************************************************************************************/
+
+VOID Isochronous_Resubmit(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer)
+{
+    UINT16 i = 0;
+    UINT16 uStartFrame = 0;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    pUSBHST_URB pUrb = &pTransfer->urb;
+    
+    pUSBHST_ISO_PACKET_DESC pIsochronous_Packet_Descriptor;
+    
+    pIsochronous_Packet_Descriptor = pUrb->pTransferSpecificData;
+    
+    /* Refill the URB and submit it */
+    for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
+    {
+        pIsochronous_Packet_Descriptor[i].uLength = pDevice->iso_packet_size;
+        pIsochronous_Packet_Descriptor[i].uOffset = i*pDevice->iso_packet_size;
+        pIsochronous_Packet_Descriptor[i].nStatus = USBHST_SUCCESS;
+    }
+    
+    if(pDevice->aborted || pDevice->stream_stopping)
+    {
+        Stream_Urb_Done(pTransfer);             /* The URB is no longer owned by the host stack */
+        
+        return;
+    }
+    
+    if(pDevice->schedule_mode == ISO_SCHEDULE_EXPLICIT)
+    {
+        if(Stream_Schedule_Next(pDevice, &uStartFrame) == OK)
+        {
+            pUrb->uStartFrame = uStartFrame;
+            pUrb->uTransferFlags &= ~USBHST_START_ISOCHRONOUS_TRANSFER_ASAP;
+        }
+        else
+        {
+            pUrb->uTransferFlags |= USBHST_START_ISOCHRONOUS_TRANSFER_ASAP;
+        }
+    }
+    
+    nStatus = usbHstURBSubmit(pUrb);
+    
+    if((nStatus == USBHST_BAD_START_OF_FRAME) && (pDevice->schedule_mode == ISO_SCHEDULE_EXPLICIT) && !(pUrb->uTransferFlags & USBHST_START_ISOCHRONOUS_TRANSFER_ASAP))
+    {
+        /* The host controller could not take the URB in time for its frame. The schedule restarts a little ahead
+         * of the current frame, but not inside the frames of the URBs that are still queued. */
+        
+        pUrb->uStartFrame = Stream_Schedule_Restart(pDevice, pUrb->uStartFrame);
+        
+        nStatus = usbHstURBSubmit(pUrb);
+    }
+    
+    if(nStatus != USBHST_SUCCESS)
+    {
+        Stream_Urb_Done(pTransfer);             /* The URB is no longer owned by the host stack */
+        Stream_Request_Recovery(pDevice);       /* Otherwise the stream dies once all URBs are lost */
+    }
+}
+
+/*****************************************************************************************
+ * Function:     VOID Stream_Batch_Task(pUVC_DEVICE pDevice)                             *
+ * Description:  The completion worker of a camera in batch mode. Every wakeup drains    *
+ *               all the URBs that have completed since the last one: their packets are  *
+ *               assembled first, then all of them are submitted again together. The     *
+ *               work per wakeup grows with the number of packets, but the number of     *
+ *               wakeups does not. Runs until Device_Destroy() sets batch_exit.          *
+ ****************************************************************************************/
+
+VOID Stream_Batch_Task(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    UINT8 uCount = 0;
+    pISO_TRANSFER pTransfer = NULL;
+    pISO_TRANSFER resubmit[BATCH_RING_SIZE];
+    
+    while(1)
+    {
+        semTake(pDevice->batch_sem, WAIT_FOREVER);
+        
+        if(pDevice->batch_exit == 1)
+        {
+            semGive(pDevice->batch_exit_sem);
+            return;
+        }
+        
+        vxAtomicSet(&pDevice->batch_signalled, 0);      /* URBs queued from now on wake the task again */
+        
+        uCount = 0;
+        
+        while(vxAtomicGet(&pDevice->batch_tail) != vxAtomicGet(&pDevice->batch_head))
+        {
+            pTransfer = pDevice->batch_ring[vxAtomicGet(&pDevice->batch_tail) & (BATCH_RING_SIZE - 1)];
+            vxAtomicInc(&pDevice->batch_tail);
+            
+            if(pDevice->stream_stopping == 1)
+            {
+                Stream_Urb_Done(pTransfer);
+            }
+            else if(Isochronous_Process(pDevice, pTransfer))
+            {
+                resubmit[uCount++] = pTransfer;
+            }
+        }
+        
+        for(i = 0; i < uCount; i++)
+        {
+            Isochronous_Resubmit(pDevice, resubmit[i]);
+        }
+        
+        pDevice->batch_wakeups++;
+        pDevice->batch_urbs += uCount;
+    }
+}
+
+/*****************************************************************************************
+ * Function:     STATUS Stream_Set_Batching(pUVC_DEVICE pDevice, UINT8 enable)           *
+ * Description:  Enables (1) or disables (0) batched completion processing. The stream   *
+ *               must be stopped (or parked at suspend): with URBs in flight, the batch  *
+ *               task and the completion callback would both process and resubmit them.  *
+ *               Returns ERROR, leaving the mode as it was, while URBs are in flight.    *
+ ****************************************************************************************/
+
+STATUS Stream_Set_Batching(pUVC_DEVICE pDevice, UINT8 enable)
+{
+    STATUS status = OK;
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    if(vxAtomicGet(&pDevice->urbs_in_flight) > 0)
+    {
+        status = ERROR;
+    }
+    else
+    {
+        pDevice->batch_mode = enable;
+    }
+    
+    semGive(pDevice->stream_mutex);
+    
+    return status;
+}
+
+
+/*****************************************************************************************************************************************
+ * Function:     USBHST_STATUS Isochronous_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer, UINT32 uTransferFlags) *
+ * Description:  This function fills the isochronous packet descriptors of the transfer based on the buffer size and also fills the      *
+ *               offset field of the descriptors.                                                                                        *
+ *                                                                                                                                       *
+ *               It fills the URB of the transfer and submits it. The function does not wait for the URB to complete; the data is        *
+ *               handled in Isochronous_Completion_Callback().                                                                           *
+ *                                                                                                                                       *
+ *               With ISO_SCHEDULE_EXPLICIT, the ASAP flag is dropped and the URB gets the start frame from Stream_Schedule_Next(),      *
+ *               unless the current frame cannot be read; the URB is then submitted ASAP.                                                *
+ ****************************************************************************************************************************************/
+
+USBHST_STATUS Isochronous_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer, UINT32 uTransferFlags)
+{
+    UINT8 i = 0;
+    UINT16 uStartFrame = 1;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    memset(&pTransfer->urb, 0, sizeof(USBHST_URB));
+    
+    for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
+    {
+        pTransfer->pPacketDesc[i].uLength = pDevice->iso_packet_size;
+        pTransfer->pPacketDesc[i].uOffset = pDevice->iso_packet_size*(UINT32)i;
+        pTransfer->pPacketDesc[i].nStatus = USBHST_SUCCESS;
+    }
+        
+    if((pDevice->schedule_mode == ISO_SCHEDULE_EXPLICIT) && (Stream_Schedule_Next(pDevice, &uStartFrame) == OK))
+    {
+        uTransferFlags &= ~USBHST_START_ISOCHRONOUS_TRANSFER_ASAP;
+    }
+        
+    USBHST_FILL_ISOCHRONOUS_URB(&pTransfer->urb, pDevice->hDevice, pDevice->selected_alt->bEndpointAddress, pTransfer->pBuffer, NUMBER_OF_ISOCHRONOUS_PACKETS*pDevice->iso_packet_size, uTransferFlags, uStartFrame, NUMBER_OF_ISOCHRONOUS_PACKETS, pTransfer->pPacketDesc, Isochronous_Completion_Callback, pTransfer, USBHST_SUCCESS);
+    
+    #ifdef DEBUG
+    
+    logMsg("%s:After filling the isochronous urb.\n Endpoint Address = %x\n no of packets = %d\n  Total length = %d\n ",__FUNCTION__, pTransfer->urb.uEndPointAddress, pTransfer->urb.uNumberOfPackets, pTransfer->urb.uTransferLength,5,6);
+    
+    #endif
+    
+    pTransfer->bSubmitted = 1;
+    vxAtomicInc(&pDevice->urbs_in_flight);
+    
+    nStatus = usbHstURBSubmit(&pTransfer->urb);
+    
+    if(nStatus != USBHST_SUCCESS)
+    {
+        pTransfer->bSubmitted = 0;
+        vxAtomicDec(&pDevice->urbs_in_flight);
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: usbHstUrbSubmit status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+    
+    #endif
+    
+    return nStatus;
+}
+
+/*****************************************************************************************
+ * Function:     USBHST_STATUS Bulk_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer)*
+ * Description:  Fills the URB of the transfer as a bulk IN URB of bulk_transfer_size    *
+ *               bytes and submits it. Short transfers are allowed; a short transfer     *
+ *               ends a payload. The data is handled in Bulk_Completion_Callback().      *
+ ****************************************************************************************/
+
+USBHST_STATUS Bulk_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    memset(&pTransfer->urb, 0, sizeof(USBHST_URB));
+    
+    USBHST_FILL_BULK_URB(&pTransfer->urb, pDevice->hDevice, pDevice->selected_alt->bEndpointAddress, pTransfer->pBuffer, pDevice->bulk_transfer_size, USBHST_SHORT_TRANSFER_OK, Bulk_Completion_Callback, pTransfer, USBHST_SUCCESS);
+    
+    pTransfer->bSubmitted = 1;
+    vxAtomicInc(&pDevice->urbs_in_flight);
+    
+    nStatus = usbHstURBSubmit(&pTransfer->urb);
+    
+    if(nStatus != USBHST_SUCCESS)
+    {
+        pTransfer->bSubmitted = 0;
+        vxAtomicDec(&pDevice->urbs_in_flight);
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: usbHstUrbSubmit status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+    
+    #endif
+    
+    return nStatus;
+}
+
+/*****************************************************************************************
+ * Function:     USBHST_STATUS Bulk_Completion_Callback(pUSBHST_URB pUrb)                *
+ * Description:  Called when a bulk URB of the stream completes. A payload starts with   *
+ *               its header, but may be longer than one URB: the URB that starts a       *
+ *               payload is handed to Stream_Assemble_Payload(), the URBs that continue  *
+ *               it go straight to Stream_Append_Data(). The payload ends with a short   *
+ *               transfer or once bulk_payload_size bytes have been received.            *
+ *                                                                                       *
+ *               URB errors are handled like in Isochronous_Completion_Callback(). Since *
+ *               the URBs complete in the order they were submitted, a lost URB breaks   *
+ *               the payload it belonged to; the frame is marked damaged and the next    *
+ *               URB is taken as the start of a new payload.                             *
+ ****************************************************************************************/
+
+USBHST_STATUS Bulk_Completion_Callback(pUSBHST_URB pUrb)
+{
+    UINT32 uLength = 0;
+    
+    pISO_TRANSFER pTransfer = (pISO_TRANSFER)pUrb->pContext;
+    pUVC_DEVICE pDevice = pTransfer->pDevice;
+    
+    if((pUrb->nStatus == USBHST_TRANSFER_CANCELLED) || (pDevice->stream_stopping == 1))
+    {
+        Stream_Urb_Done(pTransfer);             /* Cancelled by Stream_Stop(). The buffer holds no valid data */
+        
+        return USBHST_SUCCESS;
+    }
+    
+    if(pUrb->nStatus != USBHST_SUCCESS)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: URB failed with status %d (retry %d)\n",__FUNCTION__,pUrb->nStatus,pTransfer->uRetries,4,5,6);
+        
+        #endif
+        
+        pDevice->frame_damaged = 1;
+        pDevice->bulk_in_payload = 0;
+        pDevice->urb_errors++;
+        
+        if(pUrb->nStatus == USBHST_STALL_ERROR)
+        {
+            pDevice->endpoint_halted = 1;
+            
+            Stream_Urb_Done(pTransfer);
+            Stream_Request_Recovery(pDevice);
+            
+            return USBHST_SUCCESS;
+        }
+        
+        if(pTransfer->uRetries >= MAX_URB_RETRIES)
+        {
+            Stream_Urb_Done(pTransfer);
+            Stream_Request_Recovery(pDevice);
+            
+            return USBHST_SUCCESS;
+        }
+        
+        pTransfer->uRetries++;
+    }
+    else
+    {
+        pTransfer->uRetries = 0;
+        uLength = pUrb->uTransferLength;        /* The host stack returns the number of bytes received */
+        
+        if(pDevice->bulk_in_payload == 0)
+        {
+            Stream_Assemble_Payload(pDevice, pTransfer->pBuffer, uLength);
+            
+            pDevice->bulk_payload_received = uLength;
+            pDevice->bulk_in_payload = 1;
+        }
+        else
+        {
+            Stream_Append_Data(pDevice, pTransfer->pBuffer, uLength);
+            
+            pDevice->bulk_payload_received += uLength;
+        }
+        
+        if((uLength < pDevice->bulk_transfer_size) || ((pDevice->bulk_payload_size != 0) && (pDevice->bulk_payload_received >= pDevice->bulk_payload_size)))
+        {
+            pDevice->bulk_in_payload = 0;       /* The next URB starts with a payload header */
+        }
+    }
+    
+    /* Refill the URB and submit it */
+    pUrb->uTransferLength = pDevice->bulk_transfer_size;
+    pUrb->nStatus = USBHST_SUCCESS;
+    
+    if(!pDevice->aborted && !pDevice->stream_stopping)
+    {
+        if(usbHstURBSubmit(pUrb) == USBHST_SUCCESS)
+        {
+            return USBHST_SUCCESS;
+        }
+        
+        Stream_Urb_Done(pTransfer);
+        Stream_Request_Recovery(pDevice);
+        
+        return USBHST_SUCCESS;
+    }
+    
+    Stream_Urb_Done(pTransfer);
+
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Probe_Parse(const UCHAR *pData, UINT16 uLength, pUVC_PROBE pProbe)     *
+ * Description:  Decodes uLength bytes of a probe/commit structure received from the camera. *
+ *               Fields beyond uLength (the UVC 1.1 fields of a UVC 1.0 camera) are zero.    *
+ ********************************************************************************************/
+
+VOID Probe_Parse(const UCHAR *pData, UINT16 uLength, pUVC_PROBE pProbe)
+{
+    memset(pProbe, 0, sizeof(UVC_PROBE));
+    
+    if(uLength < PROBE_LENGTH_UVC10)
+    {
+        return;
+    }
+    
+    pProbe->bmHint                   = GET_LE16(&pData[PROBE_HINT_OFFSET]);
+    pProbe->bFormatIndex             = pData[PROBE_FORMAT_INDEX_OFFSET];
+    pProbe->bFrameIndex              = pData[PROBE_FRAME_INDEX_OFFSET];
+    pProbe->dwFrameInterval          = GET_LE32(&pData[PROBE_FRAME_INTERVAL_OFFSET]);
+    pProbe->wKeyFrameRate            = GET_LE16(&pData[PROBE_KEY_FRAME_RATE_OFFSET]);
+    pProbe->wPFrameRate              = GET_LE16(&pData[PROBE_P_FRAME_RATE_OFFSET]);
+    pProbe->wCompQuality             = GET_LE16(&pData[PROBE_COMP_QUALITY_OFFSET]);
+    pProbe->wCompWindowSize          = GET_LE16(&pData[PROBE_COMP_WINDOW_SIZE_OFFSET]);
+    pProbe->wDelay                   = GET_LE16(&pData[PROBE_DELAY_OFFSET]);
+    pProbe->dwMaxVideoFrameSize      = GET_LE32(&pData[PROBE_MAX_VIDEO_FRAME_SIZE_OFFSET]);
+    pProbe->dwMaxPayloadTransferSize = GET_LE32(&pData[PROBE_MAX_PAYLOAD_TRANSFER_SIZE_OFFSET]);
+    
+    if(uLength >= PROBE_LENGTH_UVC11)
+    {
+        pProbe->dwClockFrequency     = GET_LE32(&pData[PROBE_CLOCK_FREQUENCY_OFFSET]);
+        pProbe->bmFramingInfo        = pData[PROBE_FRAMING_INFO_OFFSET];
+        pProbe->bPreferedVersion     = pData[PROBE_PREFERED_VERSION_OFFSET];
+        pProbe->bMinVersion          = pData[PROBE_MIN_VERSION_OFFSET];
+        pProbe->bMaxVersion          = pData[PROBE_MAX_VERSION_OFFSET];
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Probe_Serialize(const UVC_PROBE *pProbe, UCHAR *pData, UINT16 uLength) *
+ * Description:  Encodes the probe/commit structure for a transfer of uLength bytes. Bytes   *
+ *               of fields UVC_PROBE does not cover (the UVC 1.5 fields) are left as they    *
+ *               are, so the values the camera returned are sent back unchanged.            *
+ ********************************************************************************************/
+
+VOID Probe_Serialize(const UVC_PROBE *pProbe, UCHAR *pData, UINT16 uLength)
+{
+    if(uLength < PROBE_LENGTH_UVC10)
+    {
+        return;
+    }
+    
+    SET_LE16(&pData[PROBE_HINT_OFFSET], pProbe->bmHint);
+    pData[PROBE_FORMAT_INDEX_OFFSET] = pProbe->bFormatIndex;
+    pData[PROBE_FRAME_INDEX_OFFSET]  = pProbe->bFrameIndex;
+    SET_LE32(&pData[PROBE_FRAME_INTERVAL_OFFSET], pProbe->dwFrameInterval);
+    SET_LE16(&pData[PROBE_KEY_FRAME_RATE_OFFSET], pProbe->wKeyFrameRate);
+    SET_LE16(&pData[PROBE_P_FRAME_RATE_OFFSET], pProbe->wPFrameRate);
+    SET_LE16(&pData[PROBE_COMP_QUALITY_OFFSET], pProbe->wCompQuality);
+    SET_LE16(&pData[PROBE_COMP_WINDOW_SIZE_OFFSET], pProbe->wCompWindowSize);
+    SET_LE16(&pData[PROBE_DELAY_OFFSET], pProbe->wDelay);
+    SET_LE32(&pData[PROBE_MAX_VIDEO_FRAME_SIZE_OFFSET], pProbe->dwMaxVideoFrameSize);
+    SET_LE32(&pData[PROBE_MAX_PAYLOAD_TRANSFER_SIZE_OFFSET], pProbe->dwMaxPayloadTransferSize);
+    
+    if(uLength >= PROBE_LENGTH_UVC11)
+    {
+        SET_LE32(&pData[PROBE_CLOCK_FREQUENCY_OFFSET], pProbe->dwClockFrequency);
+        pData[PROBE_FRAMING_INFO_OFFSET]     = pProbe->bmFramingInfo;
+        pData[PROBE_PREFERED_VERSION_OFFSET] = pProbe->bPreferedVersion;
+        pData[PROBE_MIN_VERSION_OFFSET]      = pProbe->bMinVersion;
+        pData[PROBE_MAX_VERSION_OFFSET]      = pProbe->bMaxVersion;
+    }
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Negotiate_Stream(pUVC_DEVICE pDevice)                         *
+ * Description:  Sends pDevice->probe to the camera with VS_PROBE_CONTROL SET_CUR, reads     *
+ *               back the values the camera can support with GET_CUR, decodes them into      *
+ *               pDevice->probe and commits them with VS_COMMIT_CONTROL SET_CUR. data[]      *
+ *               then holds the committed structure as the camera returned it.               *
+ ********************************************************************************************/
+
+USBHST_STATUS Negotiate_Stream(pUVC_DEVICE pDevice)
+{
+    /* The host probes the device with the format, frame and frame interval it wants */
+    
+    pDevice->probe_committed = 0;
+    
+    Probe_Serialize(&pDevice->probe, pDevice->data, pDevice->probe_length);
+    
+    if(USBHST_SUCCESS != Control_Transfer(pDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_PROBE_CONTROL, pDevice->streaming_interface))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Probe SET_CUR failed.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    else
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Probe SET_CUR Succeeded.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+    }
+    
+/*  memset(data, 0, sizeof(data));    Clear the array so as to store new information after control transfer 2 */
+    
+    /* The device sends the configuration data to the host when the following control transfer URB is submitted
+     * Based on this configuration data, the host can then send a third control transfer with a VS_COMMIT flag
+     * to actually configure the device. */
+    
+    if(USBHST_SUCCESS != Control_Transfer(pDevice, USB_DIRECTION_IN, USB_GET_CURRENT, UVC_VS_PROBE_CONTROL, pDevice->streaming_interface))
+    {
+        #ifdef DEBUG
+            
+        logMsg("%s: Probe GET_CUR failed.\n",__FUNCTION__,2,3,4,5,6);
+            
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    else
+    {
+        #ifdef DEBUG
+            
+        logMsg("%s: Probe GET_CUR Succeeded.\n",__FUNCTION__,2,3,4,5,6);
+            
+        #endif
+    }
+    
+    Probe_Parse(pDevice->data, pDevice->probe_length, &pDevice->probe);
+    Probe_Update_Frame_Size(pDevice);
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Format %d, frame %d, interval %d, max frame size %d, max payload %d\n",__FUNCTION__,pDevice->probe.bFormatIndex,pDevice->probe.bFrameIndex,pDevice->probe.dwFrameInterval,pDevice->probe.dwMaxVideoFrameSize,pDevice->probe.dwMaxPayloadTransferSize);
+    
+    #endif
+    
+    /* This is where the host actually configures the device with the values the camera returned */
+    
+    if(USBHST_SUCCESS != Control_Transfer(pDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_COMMIT_CONTROL, pDevice->streaming_interface))
+    {
+        #ifdef DEBUG
+            
+        logMsg("%s: Commit SET_CUR failed.\n",__FUNCTION__,2,3,4,5,6);
+            
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    else
+    {
+        #ifdef DEBUG
+            
+        logMsg("%s: Commit SET_CUR Succeeded.\n",__FUNCTION__,2,3,4,5,6);
+            
+        #endif
+    }
+    
+    pDevice->probe_committed = 1;
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Probe_Update_Frame_Size(pUVC_DEVICE pDevice)                           *
+ * Description:  Takes the format and size of the committed frame from the capability table. *
+ *               A camera without descriptors gets the YUYV frame size this driver was      *
+ *               written for.                                                                *
+ ********************************************************************************************/
+
+VOID Probe_Update_Frame_Size(pUVC_DEVICE pDevice)
+{
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, pDevice->probe.bFormatIndex);
+    pUVC_FRAME pFrame = Uvc_Find_Frame(pDevice, pDevice->probe.bFormatIndex, pDevice->probe.bFrameIndex);
+    
+    pDevice->format_subtype = (pFormat != NULL) ? pFormat->bDescriptorSubtype : UVC_VS_FORMAT_UNCOMPRESSED;
+    pDevice->frame_width    = (pFrame != NULL) ? pFrame->wWidth  : HRES;
+    pDevice->frame_height   = (pFrame != NULL) ? pFrame->wHeight : VRES;
+    
+    Probe_Fix_Sizes(pDevice);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Probe_Fix_Sizes(pUVC_DEVICE pDevice)                                   *
+ * Description:  Replaces the sizes a quirky camera reports in the committed probe with      *
+ *               values computed from the frame size, bits per pixel and frame interval.     *
+ *               QUIRK_FIX_FRAME_SIZE sets dwMaxVideoFrameSize; QUIRK_FIX_BANDWIDTH sets     *
+ *               dwMaxPayloadTransferSize to the bytes of one (micro)frame's worth of video  *
+ *               plus a payload header, instead of the maximum some cameras always ask for.  *
+ *               Only uncompressed formats can be computed this way.                         *
+ ********************************************************************************************/
+
+VOID Probe_Fix_Sizes(pUVC_DEVICE pDevice)
+{
+    UINT32 uBitsPerPixel = QUIRK_DEFAULT_BITS_PER_PIXEL;
+    UINT32 uFrameBytes = 0;
+    UINT64 uPayload = 0;
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, pDevice->probe.bFormatIndex);
+    
+    if(((pDevice->quirks & (QUIRK_FIX_FRAME_SIZE | QUIRK_FIX_BANDWIDTH)) == 0) || ((pFormat != NULL) && (pFormat->bDescriptorSubtype != UVC_VS_FORMAT_UNCOMPRESSED)))
+    {
+        return;
+    }
+    
+    if((pFormat != NULL) && (pFormat->bBitsPerPixel != 0))
+    {
+        uBitsPerPixel = pFormat->bBitsPerPixel;
+    }
+    
+    uFrameBytes = ((UINT32)pDevice->frame_width * pDevice->frame_height * uBitsPerPixel) / 8;
+    
+    if(pDevice->quirks & QUIRK_FIX_FRAME_SIZE)
+    {
+        pDevice->probe.dwMaxVideoFrameSize = uFrameBytes;
+    }
+    
+    if((pDevice->quirks & QUIRK_FIX_BANDWIDTH) && (pDevice->probe.dwFrameInterval != 0))
+    {
+        uPayload = ((UINT64)uFrameBytes * FRAME_INTERVAL_UNITS_PER_SECOND) / pDevice->probe.dwFrameInterval;     /* Bytes per second */
+        uPayload = (uPayload + ((pDevice->uSpeed == USBHST_HIGH_SPEED) ? (1000 * MICROFRAMES_PER_FRAME) : 1000) - 1) / ((pDevice->uSpeed == USBHST_HIGH_SPEED) ? (1000 * MICROFRAMES_PER_FRAME) : 1000);
+        
+        pDevice->probe.dwMaxPayloadTransferSize = (UINT32)uPayload + PAYLOAD_HEADER_MAX_LENGTH;
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Quirks %x - max frame size %d, max payload %d\n",__FUNCTION__,pDevice->quirks,pDevice->probe.dwMaxVideoFrameSize,pDevice->probe.dwMaxPayloadTransferSize,5,6);
+    
+    #endif
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Negotiate_From_Cache(pUVC_DEVICE pDevice)                     *
+ * Description:  Looks the camera up in the reattach cache by VID/PID, serial number and     *
+ *               configuration descriptor hash. On a hit, the remembered probe/commit        *
+ *               structure is committed with a single VS_COMMIT_CONTROL SET_CUR and decoded  *
+ *               into pDevice->probe. Returns USBHST_FAILURE on a miss, or if the camera     *
+ *               rejects the commit, in which case the entry is dropped and the caller must  *
+ *               run Negotiate_Stream().                                                     *
+ ********************************************************************************************/
+
+USBHST_STATUS Negotiate_From_Cache(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    pREATTACH_ENTRY pEntry = NULL;
+    
+    if(reattach_cache_mutex == NULL)
+    {
+        return USBHST_FAILURE;
+    }
+    
+    semTake(reattach_cache_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < REATTACH_CACHE_SIZE; i++)
+    {
+        pEntry = &reattach_cache[i];
+        
+        if(pEntry->bValid && (pEntry->idVendor == pDevice->idVendor) && (pEntry->idProduct == pDevice->idProduct) && (pEntry->descriptor_hash == pDevice->descriptor_hash) &&
+           (pEntry->probe_length == pDevice->probe_length) && (strncmp(pEntry->serial, pDevice->serial, SERIAL_NUMBER_LENGTH) == 0))
+        {
+            memcpy(pDevice->data, pEntry->data, PROBE_MAX_LENGTH);
+            pEntry->uLastUsed = ++reattach_cache_clock;
+            
+            break;
+        }
+    }
+    
+    semGive(reattach_cache_mutex);
+    
+    if(i == REATTACH_CACHE_SIZE)
+    {
+        return USBHST_FAILURE;
+    }
+    
+    if(USBHST_SUCCESS != Control_Transfer(pDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_COMMIT_CONTROL, pDevice->streaming_interface))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: The camera rejected the cached configuration. Negotiating again.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        semTake(reattach_cache_mutex, WAIT_FOREVER);
+        reattach_cache[i].bValid = 0;
+        semGive(reattach_cache_mutex);
+        
+        return USBHST_FAILURE;
+    }
+    
+    Probe_Parse(pDevice->data, pDevice->probe_length, &pDevice->probe);
+    Probe_Update_Frame_Size(pDevice);
+    pDevice->probe_committed = 1;
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Camera %04x:%04x committed from the cache - format %d, frame %d, interval %d\n",__FUNCTION__,pDevice->idVendor,pDevice->idProduct,pDevice->probe.bFormatIndex,pDevice->probe.bFrameIndex,pDevice->probe.dwFrameInterval);
+    
+    #endif
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Reattach_Cache_Store(pUVC_DEVICE pDevice)                              *
+ * Description:  Remembers the configuration committed with the camera. The entry of the     *
+ *               same camera is updated; otherwise a free entry or the least recently used   *
+ *               one is taken.                                                               *
+ ********************************************************************************************/
+
+VOID Reattach_Cache_Store(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    pREATTACH_ENTRY pEntry = NULL;
+    pREATTACH_ENTRY pVictim = NULL;
+    
+    if((reattach_cache_mutex == NULL) || (pDevice->probe_committed == 0))
+    {
+        return;
+    }
+    
+    semTake(reattach_cache_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < REATTACH_CACHE_SIZE; i++)
+    {
+        pEntry = &reattach_cache[i];
+        
+        if(pEntry->bValid && (pEntry->idVendor == pDevice->idVendor) && (pEntry->idProduct == pDevice->idProduct) && (strncmp(pEntry->serial, pDevice->serial, SERIAL_NUMBER_LENGTH) == 0))
+        {
+            pVictim = pEntry;                   /* The same camera; its old configuration is replaced */
+            break;
+        }
+        
+        if((pVictim == NULL) || (pVictim->bValid && ((pEntry->bValid == 0) || (pEntry->uLastUsed < pVictim->uLastUsed))))
+        {
+            pVictim = pEntry;
+        }
+    }
+    
+    pVictim->bValid          = 1;
+    pVictim->idVendor        = pDevice->idVendor;
+    pVictim->idProduct       = pDevice->idProduct;
+    pVictim->descriptor_hash = pDevice->descriptor_hash;
+    pVictim->probe_length    = pDevice->probe_length;
+    pVictim->uLastUsed       = ++reattach_cache_clock;
+    
+    memcpy(pVictim->serial, pDevice->serial, SERIAL_NUMBER_LENGTH);
+    memcpy(pVictim->data, pDevice->data, PROBE_MAX_LENGTH);
+    
+    semGive(reattach_cache_mutex);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Reattach_Cache_Clear(void)                                             *
+ * Description:  Forgets every remembered configuration, so the next attach of any camera    *
+ *               runs the full probe/commit.                                                 *
+ ********************************************************************************************/
+
+VOID Reattach_Cache_Clear(void)
+{
+    if(reattach_cache_mutex == NULL)
+    {
+        return;
+    }
+    
+    semTake(reattach_cache_mutex, WAIT_FOREVER);
+    memset(reattach_cache, 0, sizeof(reattach_cache));
+    semGive(reattach_cache_mutex);
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Stream_Open_Pipe(pUVC_DEVICE pDevice)                         *
+ * Description:  Selects the alternate setting chosen by Select_Alt_Setting() on the video   *
+ *               streaming interface and sets up the pipe to its isochronous endpoint. For   *
+ *               a bulk endpoint only the pipe is set up.                                    *
+ ********************************************************************************************/
+
+USBHST_STATUS Stream_Open_Pipe(pUVC_DEVICE pDevice)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    USB_TRANSFER_SETUP_INFO setupInfo;
+    
+    /* Since the device is in configured state, the video streaming interface and its alternate setting can be selected */
+    
+    if(pDevice->selected_alt == NULL)
+    {
+        return USBHST_INVALID_PARAMETER;
+    }
+    
+    if(pDevice->bulk_mode == 0)                 /* A bulk endpoint is on alternate setting 0, which is already selected */
+    {
+        nStatus = usbHstSetInterface(pDevice->hDevice, pDevice->streaming_interface, pDevice->selected_alt->bAlternateSetting);
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Set interface status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+
+        #endif
+        
+        if(nStatus != USBHST_SUCCESS)
+        {
+            return nStatus;
+        }
+    }
+    
+    /* Before requesting the image data from the camera, a pipe needs to be established with the isochronous tranfer
+     * endpoint. You need to specify the max number of bytes that will be recieved  per transfer and the max number 
+     * of transfers that are going to take place via that pipe. */
+    
+    memset(&setupInfo, 0, sizeof(setupInfo));
+    
+    setupInfo.uMaxNumReqests   = NO_OF_TRANSFERS;
+    setupInfo.uMaxTransferSize = (pDevice->bulk_mode) ? pDevice->bulk_transfer_size : NUMBER_OF_ISOCHRONOUS_PACKETS*pDevice->iso_packet_size;
+    setupInfo.uFlags           = 0;
+        
+    nStatus = usbHstPipePrepare(pDevice->hDevice, pDevice->selected_alt->bEndpointAddress, &setupInfo);
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Pipe prepare status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+    
+    #endif
+    
+    if(nStatus != USBHST_SUCCESS)
+    {
+        usbHstSetInterface(pDevice->hDevice, pDevice->streaming_interface, 0);    /* Give back the bandwidth reserved by the alternate setting */
+        
+        return nStatus;
+    }
+    
+    pDevice->pipe_open = 1;
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Stream_Start(pUVC_DEVICE pDevice)                             *
+ * Description:  Opens the pipe if Stream_Stop() has closed it, allocates the URB queue of   *
+ *               the stream (if it has not been allocated yet) and submits all               *
+ *               NO_OF_TRANSFERS URBs back-to-back.                                          *
+ *                                                                                           *
+ *               The function returns as soon as the URBs are queued with the host stack.    *
+ *               Completion of the first frame is signalled through first_frame_sem (see     *
+ *               Stream_Wait_First_Frame()) and the stream event callback.                   *
+ ********************************************************************************************/
+
+USBHST_STATUS Stream_Start(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    UINT32 uPeriod = 1;
+    UINT32 uTransferSize = 0;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    if(pDevice->pipe_open == 0)
+    {
+        nStatus = Stream_Open_Pipe(pDevice);
+        
+        if(nStatus != USBHST_SUCCESS)
+        {
+            return nStatus;
+        }
+    }
+    
+    /* The transfer buffers are sized for the selected setting. Buffers kept from a suspend or a recovery are reused,
+     * unless the setting has changed since they were allocated. */
+    
+    uTransferSize = (pDevice->bulk_mode) ? pDevice->bulk_transfer_size : NUMBER_OF_ISOCHRONOUS_PACKETS*pDevice->iso_packet_size;
+    
+    if(pDevice->transfer_size != uTransferSize)
+    {
+        Stream_Free_Transfers(pDevice);
+        pDevice->transfer_size = uTransferSize;
+    }
+    
+    if(Stream_Alloc_Frame_Buffers(pDevice) != OK)
+    {
+        return USBHST_INSUFFICIENT_MEMORY;
+    }
+    
+    for(i = 0; i < NO_OF_TRANSFERS; i++)
+    {
+        if(pDevice->isoTransfers[i].pBuffer == NULL)
+        {
+            pDevice->isoTransfers[i].pBuffer = (UCHAR *)OSS_CALLOC(uTransferSize);
+        }
+        
+        if((pDevice->isoTransfers[i].pPacketDesc == NULL) && (pDevice->bulk_mode == 0))
+        {
+            pDevice->isoTransfers[i].pPacketDesc = (pUSBHST_ISO_PACKET_DESC)OSS_CALLOC((UINT32)NUMBER_OF_ISOCHRONOUS_PACKETS*(sizeof(USBHST_ISO_PACKET_DESC)));
+        }
+        
+        if((pDevice->isoTransfers[i].pBuffer == NULL) || ((pDevice->isoTransfers[i].pPacketDesc == NULL) && (pDevice->bulk_mode == 0)))
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: OSS_CALLOC for transfer %d failed.\n",__FUNCTION__,i,3,4,5,6);
+            
+            #endif
+            
+            return USBHST_INSUFFICIENT_MEMORY;
+        }
+    }
+    
+    pDevice->frame_synced = 0;                  /* The first FID toggle only resynchronises the frame assembly */
+    pDevice->eof_seen = 0;
+    pDevice->frame_damaged = 0;
+    pDevice->frame_pts_valid = 0;
+    pDevice->frame_still = 0;
+    pDevice->offset = 0;
+    pDevice->first_frame_sent = 0;
+    pDevice->bulk_in_payload = 0;
+    pDevice->schedule_valid = 0;                /* The first URB starts ISO_SCHEDULE_MARGIN frames from now */
+    
+    if(pDevice->bulk_mode == 0)
+    {
+        /* bInterval gives the packet period as 2^(bInterval-1) microframes at high speed, or frames at full speed */
+        
+        uPeriod = 1 << (((pDevice->selected_alt->bInterval >= 1) && (pDevice->selected_alt->bInterval <= 16)) ? (pDevice->selected_alt->bInterval - 1) : 0);
+        
+        if(pDevice->uSpeed == USBHST_HIGH_SPEED)
+        {
+            pDevice->frames_per_urb = (UINT16)((NUMBER_OF_ISOCHRONOUS_PACKETS * uPeriod) / MICROFRAMES_PER_FRAME);
+        }
+        else
+        {
+            pDevice->frames_per_urb = (UINT16)(NUMBER_OF_ISOCHRONOUS_PACKETS * uPeriod);
+        }
+    }
+    pDevice->stream_stopping = 0;
+    pDevice->window_packets = 0;
+    pDevice->window_errors = 0;
+    
+    for(i = 0; i < NO_OF_TRANSFERS; i++)
+    {
+        if(pDevice->bulk_mode)
+        {
+            nStatus = Bulk_Transfer(pDevice, &pDevice->isoTransfers[i]);
+        }
+        else
+        {
+            nStatus = Isochronous_Transfer(pDevice, &pDevice->isoTransfers[i], USBHST_START_ISOCHRONOUS_TRANSFER_ASAP | USB_FLAG_SHORT_OK);
+        }
+        
+        if(nStatus != USBHST_SUCCESS)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: %s Transfer %d failed. Status = %d\n",__FUNCTION__,(pDevice->bulk_mode) ? "Bulk" : "Isochronous",i,nStatus,5,6);
+            
+            #endif
+            
+            return nStatus;
+        }
+    }
+    
+    pDevice->stream_started = 1;
+    
+    if(streamEventCallback != NULL)
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_STARTED);
+    }
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Wait_First_Frame(pUVC_DEVICE pDevice, int timeout)                                 *
+ * Description:  Blocks the calling task until the first complete frame of the stream has    *
+ *               been received or the timeout (in ticks) expires.                            *
+ ********************************************************************************************/
+
+STATUS Stream_Wait_First_Frame(pUVC_DEVICE pDevice, int timeout)
+{
+    return semTake(pDevice->first_frame_sem, timeout);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Urb_Done(pISO_TRANSFER pTransfer)                               *
+ * Description:  Called from the completion path when a URB is not resubmitted. When the    *
+ *               last URB in flight is done, the task waiting in Stream_Stop() is woken up.  *
+ ********************************************************************************************/
+
+VOID Stream_Urb_Done(pISO_TRANSFER pTransfer)
+{
+    pUVC_DEVICE pDevice = pTransfer->pDevice;
+    
+    pTransfer->bSubmitted = 0;
+    
+    if(vxAtomicDec(&pDevice->urbs_in_flight) == 1)       /* vxAtomicDec() returns the value before the decrement */
+    {
+        semGive(pDevice->drain_sem);
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Free_Transfers(pUVC_DEVICE pDevice)                             *
+ * Description:  Releases the buffers and packet descriptors of all the transfers. Must      *
+ *               only be called when no URB is in flight.                                    *
+ ********************************************************************************************/
+
+VOID Stream_Free_Transfers(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    
+    for(i = 0; i < NO_OF_TRANSFERS; i++)
+    {
+        if(pDevice->isoTransfers[i].pBuffer != NULL)
+        {
+            OSS_FREE(pDevice->isoTransfers[i].pBuffer);
+        }
+        
+        if(pDevice->isoTransfers[i].pPacketDesc != NULL)
+        {
+            OSS_FREE(pDevice->isoTransfers[i].pPacketDesc);
+        }
+        
+        memset(&pDevice->isoTransfers[i], 0, sizeof(ISO_TRANSFER));
+        pDevice->isoTransfers[i].pDevice = pDevice;
+    }
+    
+    pDevice->transfer_size = 0;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Alloc_Frame_Buffers(pUVC_DEVICE pDevice)                      *
+ * Description:  Sizes image_buffer and spare_buffer from the dwMaxVideoFrameSize committed  *
+ *               with the camera, or of a method 2 still if that is larger, with room after  *
+ *               the frame for the Huffman tables that MJPEG passthrough may insert, and has *
+ *               Stream_Alloc_Rgb_Buffer() size bigBuffer. An MJPEG stream in passthrough    *
+ *               mode gets no bigBuffer or decoder. The buffers are only allocated again     *
+ *               when the committed sizes have changed, so a resume or a recovery keeps the  *
+ *               buffers of the stream.                                                      *
+ ********************************************************************************************/
+
+STATUS Stream_Alloc_Frame_Buffers(pUVC_DEVICE pDevice)
+{
+    UINT32 uFrameSize = pDevice->probe.dwMaxVideoFrameSize;
+    UINT32 uVideoSize = 0;
+    
+    if(uFrameSize == 0)
+    {
+        uFrameSize = (UINT32)pDevice->frame_width * pDevice->frame_height * 2;    /* Some cameras leave dwMaxVideoFrameSize to the host */
+    }
+    
+    if((pDevice->format_subtype != UVC_VS_FORMAT_MJPEG) && (uFrameSize < ((UINT32)pDevice->frame_width * pDevice->frame_height * 2)))
+    {
+        uFrameSize = (UINT32)pDevice->frame_width * pDevice->frame_height * 2;    /* processImage() converts a whole frame */
+    }
+    
+    uVideoSize = uFrameSize;
+    
+    if((pDevice->still_committed == 1) && (pDevice->still_method == STILL_METHOD_STREAM) && (pDevice->still_probe.dwMaxVideoFrameSize > uFrameSize))
+    {
+        uFrameSize = pDevice->still_probe.dwMaxVideoFrameSize;     /* The still is assembled in image_buffer too */
+    }
+    
+    if((pDevice->image_buffer == NULL) || (pDevice->image_buffer_size != uFrameSize))
+    {
+        if(Stream_Free_Frame_Buffers(pDevice) != OK)
+        {
+            return ERROR;
+        }
+        
+        pDevice->image_buffer = (UCHAR *)OSS_CALLOC(uFrameSize + JPEG_DHT_SEGMENT_LENGTH);
+        pDevice->spare_buffer = (UCHAR *)OSS_CALLOC(uFrameSize + JPEG_DHT_SEGMENT_LENGTH);
+        
+        if((pDevice->image_buffer == NULL) || (pDevice->spare_buffer == NULL))
+        {
+            Stream_Free_Frame_Buffers(pDevice);
+            
+            #ifdef DEBUG
+            
+            logMsg("%s: OSS_CALLOC for a frame of %d bytes failed.\n",__FUNCTION__,uFrameSize,3,4,5,6);
+            
+            #endif
+            
+            return ERROR;
+        }
+        
+        pDevice->image_buffer_size = uFrameSize;
+        pDevice->offset            = 0;
+    }
+    else if(Stream_Wait_Image_Task(pDevice, STREAM_DRAIN_TIMEOUT) != OK)
+    {
+        return ERROR;                           /* bigBuffer is still in use */
+    }
+    
+    pDevice->video_frame_size = uVideoSize;     /* Set after Stream_Free_Frame_Buffers(), which clears it */
+    
+    if((pDevice->passthrough == 1) && (pDevice->format_subtype == UVC_VS_FORMAT_MJPEG))
+    {
+        return OK;
+    }
+    
+    return Stream_Alloc_Rgb_Buffer(pDevice);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Alloc_Rgb_Buffer(pUVC_DEVICE pDevice)                         *
+ * Description:  Sizes bigBuffer for the committed frame size: 3 bytes of RGB for every      *
+ *               pixel, converted from YUYV or decoded from MJPEG, in which case the JPEG    *
+ *               decoder is allocated too. Called when the stream        *
+ *               starts, and by the image task when passthrough has been turned off after    *
+ *               the stream was started without these buffers. Nothing else may be using     *
+ *               bigBuffer.                                                                  *
+ ********************************************************************************************/
+
+STATUS Stream_Alloc_Rgb_Buffer(pUVC_DEVICE pDevice)
+{
+    UINT32 uRgbSize = (UINT32)pDevice->frame_width * pDevice->frame_height * 3;
+    
+    if((pDevice->bigBuffer != NULL) && (pDevice->rgb_buffer_size != uRgbSize))
+    {
+        OSS_FREE(pDevice->bigBuffer);
+        pDevice->bigBuffer = NULL;
+    }
+    
+    if(pDevice->bigBuffer == NULL)
+    {
+        pDevice->bigBuffer       = (char *)OSS_CALLOC(uRgbSize);
+        pDevice->rgb_buffer_size = (pDevice->bigBuffer != NULL) ? uRgbSize : 0;
+    }
+    
+    if((pDevice->format_subtype == UVC_VS_FORMAT_MJPEG) && (pDevice->jpeg_decoder == NULL))
+    {
+        pDevice->jpeg_decoder = (pJPEG_DECODER)OSS_CALLOC(sizeof(JPEG_DECODER));
+        
+        if(pDevice->jpeg_decoder != NULL)
+        {
+            Jpeg_Decoder_Init(pDevice->jpeg_decoder);
+        }
+    }
+    
+    if((pDevice->bigBuffer == NULL) || ((pDevice->format_subtype == UVC_VS_FORMAT_MJPEG) && (pDevice->jpeg_decoder == NULL)))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: OSS_CALLOC for %d bytes of RGB data failed.\n",__FUNCTION__,uRgbSize,3,4,5,6);
+        
+        #endif
+        
+        return ERROR;
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Free_Frame_Buffers(pUVC_DEVICE pDevice)                       *
+ * Description:  Waits for the image task still working on the last frame, then releases     *
+ *               both frame buffers, bigBuffer and the JPEG decoder. Must only be called     *
+ *               when no URB is in flight.                                                   *
+ ********************************************************************************************/
+
+STATUS Stream_Free_Frame_Buffers(pUVC_DEVICE pDevice)
+{
+    if(Stream_Wait_Image_Task(pDevice, STREAM_DRAIN_TIMEOUT) != OK)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: the image task did not finish, the frame buffers are kept.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        return ERROR;
+    }
+    
+    if(pDevice->image_buffer != NULL)
+    {
+        OSS_FREE(pDevice->image_buffer);
+        pDevice->image_buffer = NULL;
+    }
+    
+    if(pDevice->spare_buffer != NULL)
+    {
+        OSS_FREE(pDevice->spare_buffer);
+        pDevice->spare_buffer = NULL;
+    }
+    
+    if(pDevice->bigBuffer != NULL)
+    {
+        OSS_FREE(pDevice->bigBuffer);
+        pDevice->bigBuffer = NULL;
+    }
+    
+    if(pDevice->jpeg_decoder != NULL)
+    {
+        OSS_FREE(pDevice->jpeg_decoder);
+        pDevice->jpeg_decoder = NULL;
+    }
+    
+    pDevice->image_buffer_size = 0;
+    pDevice->video_frame_size  = 0;
+    pDevice->rgb_buffer_size   = 0;
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Wait_Image_Task(pUVC_DEVICE pDevice, int timeout)             *
+ * Description:  Waits until the image task spawned for the last frame has written it out,   *
+ *               so the frame buffers, bigBuffer and the frame size may change. Must only be      *
+ *               called when no URB is in flight.                                            *
+ ********************************************************************************************/
+
+STATUS Stream_Wait_Image_Task(pUVC_DEVICE pDevice, int timeout)
+{
+    if(pDevice->first == 1)
+    {
+        if(semTake(pDevice->synch_sem, timeout) != OK)
+        {
+            return ERROR;
+        }
+        
+        pDevice->first = 0;
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Quiesce(pUVC_DEVICE pDevice)                                  *
+ * Description:  Cancels the URBs in flight and waits (at most STREAM_DRAIN_TIMEOUT ticks    *
+ *               per wait) until all of them have completed. The buffers, the packet         *
+ *               descriptors and the negotiated parameters are left untouched. Returns ERROR *
+ *               if the URBs did not complete, in which case the buffers must not be freed.  *
+ ********************************************************************************************/
+
+STATUS Stream_Quiesce(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    
+    pDevice->stream_stopping = 1;
+    
+    for(i = 0; i < NO_OF_TRANSFERS; i++)
+    {
+        if(pDevice->isoTransfers[i].bSubmitted == 1)
+        {
+            usbHstURBCancel(&pDevice->isoTransfers[i].urb);
+        }
+    }
+    
+    while(vxAtomicGet(&pDevice->urbs_in_flight) > 0)
+    {
+        if(semTake(pDevice->drain_sem, STREAM_DRAIN_TIMEOUT) != OK)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: %d URBs did not complete after cancellation.\n",__FUNCTION__,(int)vxAtomicGet(&pDevice->urbs_in_flight),3,4,5,6);
+            
+            #endif
+            
+            return ERROR;
+        }
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Stop(pUVC_DEVICE pDevice)                                     *
+ * Description:  Stops the stream and reclaims everything Stream_Start() allocated:          *
+ *               -> the URBs in flight are cancelled,                                        *
+ *               -> the completions are waited for (at most STREAM_DRAIN_TIMEOUT ticks),     *
+ *               -> the transfer buffers and packet descriptors are freed,                   *
+ *               -> the pipe is closed by selecting alternate setting 0, which also gives    *
+ *                  the isochronous bandwidth back to the host controller (a bulk stream is  *
+ *                  stopped with CLEAR_FEATURE(ENDPOINT_HALT) instead).                      *
+ *                                                                                           *
+ *               A later Stream_Start() opens the pipe and allocates the transfers again,    *
+ *               so repeated start/stop cycles do not leak memory. This function waits for   *
+ *               the completions and must not be called from a completion callback.          *
+ ********************************************************************************************/
+
+STATUS Stream_Stop(pUVC_DEVICE pDevice)
+{
+    if(Stream_Quiesce(pDevice) != OK)
+    {
+        return ERROR;                           /* The buffers may still be in use by the host controller; keep them */
+    }
+    
+    Stream_Free_Transfers(pDevice);
+    
+    pDevice->resume_streaming = 0;              /* A stream stopped while suspended is not restarted on resume */
+    pDevice->stream_started = 0;
+    
+    if(pDevice->pipe_open == 1)
+    {
+        if(pDevice->bulk_mode)
+        {
+            /* A bulk stream has no zero bandwidth setting; UVC stops it with CLEAR_FEATURE(ENDPOINT_HALT) */
+            
+            usbHstClearFeature(pDevice->hDevice, USBHST_RECIPIENT_ENDPOINT, pDevice->selected_alt->bEndpointAddress, USBHST_FEATURE_ENDPOINT_HALT);
+        }
+        else
+        {
+            usbHstSetInterface(pDevice->hDevice, pDevice->streaming_interface, 0);
+        }
+        
+        pDevice->pipe_open = 0;
+    }
+    
+    if(streamEventCallback != NULL)
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_STOPPED);
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Suspend(pUVC_DEVICE pDevice)                                  *
+ * Description:  Parks the stream before the bus is suspended. The URBs are cancelled and    *
+ *               drained, but unlike Stream_Stop() the transfer buffers, the packet          *
+ *               descriptors and the committed probe data are kept, so Stream_Resume() does  *
+ *               not have to allocate or negotiate anything. No control transfer is sent,    *
+ *               since the bus is about to go idle.                                          *
+ ********************************************************************************************/
+
+STATUS Stream_Suspend(pUVC_DEVICE pDevice)
+{
+    if(pDevice->suspended == 1)
+    {
+        return OK;
+    }
+    
+    /* Not taken from urbs_in_flight: URBs that failed around the suspend have been retired, and the recovery they
+     * asked for is skipped while the suspend is under way, but the stream must still come back on resume. */
+    
+    pDevice->resume_streaming = pDevice->stream_started;
+    
+    if(Stream_Quiesce(pDevice) != OK)
+    {
+        return ERROR;
+    }
+    
+    /* The camera may come back from suspend with its streaming interface reset to alternate setting 0, so the pipe is
+     * treated as closed and Stream_Start() selects the alternate setting again. */
+    
+    pDevice->pipe_open = 0;
+    pDevice->suspended = 1;
+    
+    if(streamEventCallback != NULL)
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_SUSPENDED);
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Stream_Resume(pUVC_DEVICE pDevice)                            *
+ * Description:  Restarts a stream parked by Stream_Suspend(). The cached probe data is sent *
+ *               again with a single VS_COMMIT_CONTROL SET_CUR, then Stream_Start() selects  *
+ *               the cached alternate setting and resubmits the URBs with the buffers that   *
+ *               were kept. A full probe/commit is only done if the camera rejects the       *
+ *               commit (for example because it lost power while suspended). A camera the    *
+ *               bandwidth manager has moved while it was suspended is started at its new    *
+ *               setting with Bandwidth_Reconfigure() instead.                               *
+ ********************************************************************************************/
+
+USBHST_STATUS Stream_Resume(pUVC_DEVICE pDevice)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    if(pDevice->suspended == 0)
+    {
+        return USBHST_SUCCESS;
+    }
+    
+    pDevice->suspended = 0;
+    
+    if(pDevice->resume_streaming == 0)
+    {
+        pDevice->bw_deferred = 0;               /* The next start uses bw_target */
+        
+        return USBHST_SUCCESS;                  /* The stream was not running when the bus was suspended */
+    }
+    
+    if(pDevice->bw_deferred == 1)
+    {
+        /* The bandwidth manager moved the camera to another setting while it was suspended. The parked transfers are
+         * sized for the old one; the pipe is closed already, so Stream_Stop() only frees them. */
+        
+        if((Stream_Stop(pDevice) != OK) || (Bandwidth_Reconfigure(pDevice, pDevice->bw_target) != OK))
+        {
+            return USBHST_FAILURE;
+        }
+        
+        if((pDevice->pipe_open == 1) && (streamEventCallback != NULL))
+        {
+            streamEventCallback(pDevice->hDevice, STREAM_EVENT_RESUMED);
+        }
+        
+        return USBHST_SUCCESS;
+    }
+    
+    if(USBHST_SUCCESS != Control_Transfer(pDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_COMMIT_CONTROL, pDevice->streaming_interface))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Commit of the cached probe data failed. Negotiating again.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        nStatus = Negotiate_Stream(pDevice);
+        
+        if(nStatus != USBHST_SUCCESS)
+        {
+            return nStatus;
+        }
+    }
+    
+    nStatus = Stream_Start_Adaptive(pDevice);
+    
+    if(nStatus == USBHST_SUCCESS)
+    {
+        if(streamEventCallback != NULL)
+        {
+            streamEventCallback(pDevice->hDevice, STREAM_EVENT_RESUMED);
+        }
+    }
+    
+    return nStatus;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Stream_Recover(pUVC_DEVICE pDevice)                           *
+ * Description:  Restarts a stream that lost its URBs to errors. The remaining URBs are      *
+ *               drained, a halted endpoint is cleared with CLEAR_FEATURE(ENDPOINT_HALT)     *
+ *               and the URBs are resubmitted with the buffers they already have. The        *
+ *               frame assembly resyncs at the next FID toggle. At most                      *
+ *               MAX_STREAM_RECOVERIES recoveries are tried without a good frame in between. *
+ ********************************************************************************************/
+
+USBHST_STATUS Stream_Recover(pUVC_DEVICE pDevice)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    if((pDevice->suspended == 1) || (pDevice->suspend_requested == 1) || (pDevice->aborted == 1))
+    {
+        return USBHST_SUCCESS;                  /* The URBs were lost on purpose */
+    }
+    
+    if(pDevice->recoveries >= MAX_STREAM_RECOVERIES)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Giving up after %d recoveries.\n",__FUNCTION__,pDevice->recoveries,3,4,5,6);
+        
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    
+    pDevice->recoveries++;
+    
+    if(Stream_Quiesce(pDevice) != OK)
+    {
+        return USBHST_FAILURE;
+    }
+    
+    if(pDevice->endpoint_halted == 1)
+    {
+        nStatus = usbHstClearFeature(pDevice->hDevice, USBHST_RECIPIENT_ENDPOINT, pDevice->selected_alt->bEndpointAddress, USBHST_FEATURE_ENDPOINT_HALT);
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Clear endpoint halt status = %d\n",__FUNCTION__,nStatus,3,4,5,6);
+        
+        #endif
+        
+        if(nStatus != USBHST_SUCCESS)
+        {
+            return nStatus;
+        }
+        
+        pDevice->endpoint_halted = 0;
+    }
+    
+    nStatus = Stream_Start(pDevice);
+    
+    if((nStatus == USBHST_SUCCESS) && (streamEventCallback != NULL))
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_RECOVERED);
+    }
+    
+    return nStatus;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Set_Event_Callback(STREAM_EVENT_CALLBACK pCallback)             *
+ * Description:  Registers the function which is notified of STREAM_EVENT_* events. Pass    *
+ *               NULL to remove it.                                                          *
+ ********************************************************************************************/
+
+VOID Stream_Set_Event_Callback(STREAM_EVENT_CALLBACK pCallback)
+{
+    streamEventCallback = pCallback;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Set_Passthrough(pUVC_DEVICE pDevice, UINT8 enable,              *
+ *                                           FRAME_SINK_CALLBACK pSink, void *pContext)      *
+ * Description:  Enables (1) or disables (0) MJPEG passthrough: the frames of an MJPEG      *
+ *               stream are checked, completed with the standard Huffman tables if they     *
+ *               have none and given to pSink, or written to /tgtsvr as JPEG files if pSink *
+ *               is NULL, without being decoded. Frames of other formats are decoded as      *
+ *               before. The sink and its context are changed under sink_mutex, which the    *
+ *               image task holds while it calls the sink, so a frame is never given to a    *
+ *               sink with the context of another one, and the old sink is not called once   *
+ *               this function has returned.                                                 *
+ ********************************************************************************************/
+
+VOID Stream_Set_Passthrough(pUVC_DEVICE pDevice, UINT8 enable, FRAME_SINK_CALLBACK pSink, void *pContext)
+{
+    semTake(pDevice->sink_mutex, WAIT_FOREVER);
+    
+    pDevice->frame_sink         = pSink;
+    pDevice->frame_sink_context = pContext;
+    pDevice->passthrough        = enable;
+    
+    semGive(pDevice->sink_mutex);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Fit_Payload(pUVC_DEVICE pDevice, pALT_SETTING pAlt)           *
+ * Description:  Makes the payload the camera asks for fit into one packet of pAlt through   *
+ *               probe/commit: the frame size is first stepped down to the next smaller one  *
+ *               of the committed format (see Uvc_Find_Smaller_Frame()), keeping the frame   *
+ *               rate as far as the smaller size supports it. At the smallest frame size,    *
+ *               the frame interval is doubled until the payload fits or until               *
+ *               MAX_FRAME_INTERVAL is reached. The stream must be stopped. Returns ERROR if *
+ *               a probe/commit fails.                                                       *
+ ********************************************************************************************/
+
+STATUS Stream_Fit_Payload(pUVC_DEVICE pDevice, pALT_SETTING pAlt)
+{
+    UINT32 interval = 0;
+    UINT32 payload = 0;
+    pUVC_FRAME pSmaller = NULL;
+    
+    payload  = pDevice->probe.dwMaxPayloadTransferSize;
+    interval = pDevice->probe.dwFrameInterval;
+    
+    while(payload > pAlt->uBytesPerInterval)
+    {
+        pSmaller = Uvc_Find_Smaller_Frame(pDevice, pDevice->probe.bFormatIndex, pDevice->probe.bFrameIndex);
+        
+        if(pSmaller != NULL)
+        {
+            Stream_Wait_Image_Task(pDevice, STREAM_DRAIN_TIMEOUT);     /* dump_ppm() of the last frame still uses the old frame size */
+            
+            pDevice->probe.bFrameIndex     = pSmaller->bFrameIndex;
+            pDevice->probe.dwFrameInterval = Uvc_Nearest_Frame_Interval(pSmaller, interval);
+        }
+        else if(interval < MAX_FRAME_INTERVAL)
+        {
+            interval = interval * 2;
+            
+            if(interval > MAX_FRAME_INTERVAL)
+            {
+                interval = MAX_FRAME_INTERVAL;
+            }
+            
+            pDevice->probe.dwFrameInterval = interval;
+        }
+        else
+        {
+            break;
+        }
+        
+        if(Negotiate_Stream(pDevice) != USBHST_SUCCESS)
+        {
+            return ERROR;
+        }
+        
+        payload  = pDevice->probe.dwMaxPayloadTransferSize;
+        interval = pDevice->probe.dwFrameInterval;      /* The camera may have adjusted it */
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Downshift(pUVC_DEVICE pDevice)                                *
+ * Description:  Moves the stream one step down: the next smaller alternate setting is       *
+ *               selected, and if the payload the camera asks for does not fit into it, the  *
+ *               frame size and then the frame rate are lowered through probe/commit until   *
+ *               it does (see Stream_Fit_Payload()). The stream must be stopped. The share   *
+ *               of the bus reserved by the bandwidth manager follows the new setting.       *
+ *               Returns ERROR if there is no smaller alternate setting left.                *
+ ********************************************************************************************/
+
+STATUS Stream_Downshift(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    pALT_SETTING pNext = NULL;
+    
+    if(pDevice->selected_alt == NULL)
+    {
+        return ERROR;
+    }
+    
+    for(i = 0; i < pDevice->num_alt_settings; i++)
+    {
+        if((pDevice->alt_settings[i].uBytesPerInterval < pDevice->selected_alt->uBytesPerInterval) && ((pNext == NULL) || (pDevice->alt_settings[i].uBytesPerInterval > pNext->uBytesPerInterval)))
+        {
+            pNext = &pDevice->alt_settings[i];
+        }
+    }
+    
+    if(pNext == NULL)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Already at the smallest alternate setting.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        return ERROR;
+    }
+    
+    if(Stream_Fit_Payload(pDevice, pNext) != OK)
+    {
+        return ERROR;
+    }
+    
+    pDevice->selected_alt    = pNext;
+    pDevice->iso_packet_size = pNext->uBytesPerInterval;
+    pDevice->degrade_level++;
+    
+    /* The bandwidth manager must see the setting the camera really uses: the bandwidth it no longer needs goes back
+     * to the budget, and a later rebalance to the setting it had is not taken for "already there". */
+    
+    if(pDevice->bw_registered == 1)
+    {
+        pDevice->bw_target = pNext;
+        pDevice->bw_cost   = Bandwidth_Cost(pDevice, pNext);
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Level %d - alternate setting %d, packet size %d, frame interval %d, payload %d\n",__FUNCTION__,pDevice->degrade_level,pNext->bAlternateSetting,pDevice->iso_packet_size,pDevice->probe.dwFrameInterval,pDevice->probe.dwMaxPayloadTransferSize);
+    
+    #endif
+    
+    if(streamEventCallback != NULL)
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_DEGRADED);
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Stream_Start_Adaptive(pUVC_DEVICE pDevice)                    *
+ * Description:  Starts the stream at the selected alternate setting. If the pipe cannot be *
+ *               opened (usually because the host controller cannot reserve the periodic   *
+ *               bandwidth) and the adaptive mode is enabled, the stream is stepped down     *
+ *               with Stream_Downshift() and started again until it succeeds or there is no  *
+ *               smaller setting left, or until the stream cannot be stopped for the next    *
+ *               step.                                                                       *
+ ********************************************************************************************/
+
+USBHST_STATUS Stream_Start_Adaptive(pUVC_DEVICE pDevice)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    while(1)
+    {
+        nStatus = Stream_Start(pDevice);
+        
+        if((nStatus == USBHST_SUCCESS) || (pDevice->adaptive_mode == 0))
+        {
+            return nStatus;
+        }
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Stream start at alternate setting %d failed. Status = %d\n",__FUNCTION__,pDevice->selected_alt->bAlternateSetting,nStatus,4,5,6);
+        
+        #endif
+        
+        if(Stream_Stop(pDevice) != OK)
+        {
+            return nStatus;                     /* URBs may still be queued; nothing may be freed or renegotiated */
+        }
+        
+        if(Stream_Downshift(pDevice) != OK)
+        {
+            return nStatus;
+        }
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Set_Adaptive(pUVC_DEVICE pDevice, UINT8 enable)                                      *
+ * Description:  Enables (1) or disables (0) the adaptive mode.                              *
+ ********************************************************************************************/
+
+VOID Stream_Set_Adaptive(pUVC_DEVICE pDevice, UINT8 enable)
+{
+    pDevice->adaptive_mode = enable;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Get_Degradation(pUVC_DEVICE pDevice, UINT8 *pLevel,             *
+ *                                           UINT8 *pAlternateSetting,                       *
+ *                                           UINT32 *pFrameInterval)                         *
+ * Description:  Reports how far the stream has been stepped down, the alternate setting in *
+ *               use and the committed frame interval (in 100 ns units).                     *
+ ********************************************************************************************/
+
+VOID Stream_Get_Degradation(pUVC_DEVICE pDevice, UINT8 *pLevel, UINT8 *pAlternateSetting, UINT32 *pFrameInterval)
+{
+    *pLevel = pDevice->degrade_level;
+    *pAlternateSetting = (pDevice->selected_alt != NULL) ? pDevice->selected_alt->bAlternateSetting : 0;
+    *pFrameInterval = pDevice->probe.dwFrameInterval;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Schedule_Next(pUVC_DEVICE pDevice, UINT16 *pStartFrame)       *
+ * Description:  Returns in pStartFrame the frame in which the URB about to be submitted     *
+ *               must start, and moves the end of the schedule frames_per_urb frames         *
+ *               further. The URBs are submitted in the order they complete, so every URB    *
+ *               continues exactly where the previously submitted one ends.                  *
+ *                                                                                           *
+ *               If that frame has already passed (or is the current one), the resubmission  *
+ *               came too late and the host controller would drop the URB or the packets of  *
+ *               the missed frames. Such a gap is counted in schedule_gaps, the skipped      *
+ *               frames in lost_frames, and the schedule restarts ISO_SCHEDULE_MARGIN frames *
+ *               ahead of the current frame.                                                 *
+ *                                                                                           *
+ *               Returns ERROR if the current frame cannot be read. The URB must then be     *
+ *               submitted ASAP, and the schedule restarts with the next URB.                *
+ ********************************************************************************************/
+
+STATUS Stream_Schedule_Next(pUVC_DEVICE pDevice, UINT16 *pStartFrame)
+{
+    UINT16 uCurrentFrame = 0;
+    UINT16 uAhead = 0;
+    
+    if(usbHstGetFrameNumber(pDevice->hDevice, &uCurrentFrame) != USBHST_SUCCESS)
+    {
+        pDevice->schedule_valid = 0;            /* Any start frame would be a guess */
+        
+        return ERROR;
+    }
+    
+    if(pDevice->schedule_valid == 0)
+    {
+        pDevice->next_start_frame = (uCurrentFrame + ISO_SCHEDULE_MARGIN) & FRAME_NUMBER_MASK;
+        pDevice->schedule_valid = 1;
+    }
+    else
+    {
+        uAhead = (pDevice->next_start_frame - uCurrentFrame) & FRAME_NUMBER_MASK;
+        
+        if((uAhead == 0) || (uAhead > (FRAME_NUMBER_MASK / 2)))
+        {
+            pDevice->schedule_gaps++;
+            pDevice->lost_frames += (uCurrentFrame + ISO_SCHEDULE_MARGIN - pDevice->next_start_frame) & FRAME_NUMBER_MASK;
+            
+            #ifdef DEBUG
+            
+            logMsg("%s: Schedule gap at frame %d, URB was due in frame %d\n",__FUNCTION__,uCurrentFrame,pDevice->next_start_frame,4,5,6);
+            
+            #endif
+            
+            pDevice->next_start_frame = (uCurrentFrame + ISO_SCHEDULE_MARGIN) & FRAME_NUMBER_MASK;
+        }
+    }
+    
+    *pStartFrame = pDevice->next_start_frame;
+    pDevice->next_start_frame = (pDevice->next_start_frame + pDevice->frames_per_urb) & FRAME_NUMBER_MASK;
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     UINT16 Stream_Schedule_Restart(pUVC_DEVICE pDevice, UINT16 uRejectedFrame)  *
+ * Description:  Called when the host controller rejected a URB scheduled to start in frame  *
+ *               uRejectedFrame with USBHST_BAD_START_OF_FRAME. That URB was the last one of *
+ *               the schedule, so the URBs still queued end in uRejectedFrame. The URB is    *
+ *               moved ISO_SCHEDULE_MARGIN frames ahead of the current frame, or to          *
+ *               uRejectedFrame if that is later and other URBs are still queued, so that it *
+ *               never overlaps them. The frames it skips are counted in lost_frames like    *
+ *               the frames of any other gap. Returns the frame in which the URB must start. *
+ ********************************************************************************************/
+
+UINT16 Stream_Schedule_Restart(pUVC_DEVICE pDevice, UINT16 uRejectedFrame)
+{
+    UINT16 uCurrentFrame = 0;
+    UINT16 uStartFrame = 0;
+    UINT16 uSkipped = 0;
+    
+    pDevice->schedule_gaps++;
+    
+    if(usbHstGetFrameNumber(pDevice->hDevice, &uCurrentFrame) != USBHST_SUCCESS)
+    {
+        uCurrentFrame = uRejectedFrame;         /* Retried one margin further on */
+    }
+    
+    uStartFrame = (uCurrentFrame + ISO_SCHEDULE_MARGIN) & FRAME_NUMBER_MASK;
+    uSkipped = (uStartFrame - uRejectedFrame) & FRAME_NUMBER_MASK;
+    
+    if(uSkipped > (FRAME_NUMBER_MASK / 2))
+    {
+        /* The rejected frame is still ahead of the restart. Starting earlier would overlap the URBs still queued
+         * (the URB being resubmitted is one of urbs_in_flight), so the URB keeps its frame. */
+        
+        if(vxAtomicGet(&pDevice->urbs_in_flight) > 1)
+        {
+            uStartFrame = uRejectedFrame;
+        }
+        
+        uSkipped = 0;
+    }
+    
+    pDevice->lost_frames += uSkipped;
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: URB rejected for frame %d at frame %d, restarting in frame %d\n",__FUNCTION__,uRejectedFrame,uCurrentFrame,uStartFrame,5,6);
+    
+    #endif
+    
+    pDevice->next_start_frame = (uStartFrame + pDevice->frames_per_urb) & FRAME_NUMBER_MASK;
+    pDevice->schedule_valid = 1;
+    
+    return uStartFrame;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Set_Scheduling(pUVC_DEVICE pDevice, UINT8 uMode)              *
+ * Description:  Selects ISO_SCHEDULE_ASAP or ISO_SCHEDULE_EXPLICIT. The stream must be      *
+ *               stopped (or parked at suspend): a schedule restarted while URBs are queued  *
+ *               could overlap their frames. Returns ERROR, leaving the mode as it was,      *
+ *               while URBs are in flight. Takes effect when the stream is started.          *
+ ********************************************************************************************/
+
+STATUS Stream_Set_Scheduling(pUVC_DEVICE pDevice, UINT8 uMode)
+{
+    STATUS status = OK;
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    if(vxAtomicGet(&pDevice->urbs_in_flight) > 0)
+    {
+        status = ERROR;
+    }
+    else
+    {
+        pDevice->schedule_valid = 0;
+        pDevice->schedule_mode = uMode;
+    }
+    
+    semGive(pDevice->stream_mutex);
+    
+    return status;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Get_Schedule_Stats(pUVC_DEVICE pDevice, UINT32 *pGaps,          *
+ *                                              UINT32 *pLostFrames)                         *
+ * Description:  Reports how often the explicit schedule could not be continued and how     *
+ *               many frames were lost because of it. A growing count means that the URBs   *
+ *               are resubmitted too late; more or longer URBs are needed.                   *
+ ********************************************************************************************/
+
+VOID Stream_Get_Schedule_Stats(pUVC_DEVICE pDevice, UINT32 *pGaps, UINT32 *pLostFrames)
+{
+    *pGaps = pDevice->schedule_gaps;
+    *pLostFrames = pDevice->lost_frames;
+}
+
+/*********************************************************************************************
+ * Function:     UINT32 Bandwidth_Cost(pUVC_DEVICE pDevice, pALT_SETTING pAlt)               *
+ * Description:  Returns the share of the bus (per mille of a microframe at high speed, or   *
+ *               of a frame at full speed) that the periodic endpoint of pAlt reserves.      *
+ *               Transaction overheads are not counted; BANDWIDTH_BUDGET_PERMILLE leaves     *
+ *               room for them.                                                              *
+ ********************************************************************************************/
+
+UINT32 Bandwidth_Cost(pUVC_DEVICE pDevice, pALT_SETTING pAlt)
+{
+    UINT32 uPeriod = 1;
+    UINT32 uBytes = 0;
+    UINT32 uCapacity = BANDWIDTH_FULL_SPEED_BYTES;
+    
+    if((pAlt == NULL) || (pAlt->bTransferType != ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS))
+    {
+        return 0;
+    }
+    
+    if((pAlt->bInterval >= 1) && (pAlt->bInterval <= 16))
+    {
+        uPeriod = 1 << (pAlt->bInterval - 1);
+    }
+    
+    if(pDevice->uSpeed == USBHST_HIGH_SPEED)
+    {
+        uCapacity = BANDWIDTH_HIGH_SPEED_BYTES;
+    }
+    
+    uBytes = (pAlt->uBytesPerInterval + uPeriod - 1) / uPeriod;
+    
+    return ((uBytes * 1000) + uCapacity - 1) / uCapacity;
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Bandwidth_Attach(pUVC_DEVICE pDevice)                         *
+ * Description:  Called once the stream of a new camera has been negotiated. A bulk camera   *
+ *               does not use periodic bandwidth and is started right away. An isochronous   *
+ *               camera is added to the budget of its bus and Bandwidth_Rebalance() decides  *
+ *               which alternate setting it gets (if any) and starts it.                     *
+ ********************************************************************************************/
+
+USBHST_STATUS Bandwidth_Attach(pUVC_DEVICE pDevice)
+{
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    pDevice->requested_payload  = Stream_Payload_Size(pDevice);
+    pDevice->requested_interval = pDevice->probe.dwFrameInterval;
+    pDevice->requested_frame    = pDevice->probe.bFrameIndex;
+    
+    if(Select_Alt_Setting(pDevice, pDevice->requested_payload) == NULL)
+    {
+        return USBHST_FAILURE;
+    }
+    
+    if(pDevice->bulk_mode)
+    {
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+        nStatus = Stream_Start_Adaptive(pDevice);
+        semGive(pDevice->stream_mutex);
+        
+        return nStatus;
+    }
+    
+    semTake(bandwidth_mutex, WAIT_FOREVER);
+    
+    pDevice->bw_registered = 1;
+    Bandwidth_Rebalance(pDevice->bus_index);
+    
+    semGive(bandwidth_mutex);
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Bandwidth_Detach(pUVC_DEVICE pDevice)                                  *
+ * Description:  Stops the camera's stream, removes it from the budget of its bus and hands  *
+ *               the bandwidth it had to the remaining cameras.                              *
+ ********************************************************************************************/
+
+VOID Bandwidth_Detach(pUVC_DEVICE pDevice)
+{
+    if(pDevice->bw_registered == 0)
+    {
+        return;
+    }
+    
+    semTake(bandwidth_mutex, WAIT_FOREVER);
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    Stream_Stop(pDevice);
+    semGive(pDevice->stream_mutex);
+    
+    pDevice->bw_registered = 0;
+    pDevice->bw_target = NULL;
+    pDevice->bw_cost = 0;
+    
+    Bandwidth_Rebalance(pDevice->bus_index);
+    
+    semGive(bandwidth_mutex);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Bandwidth_Rebalance(UINT8 uBus)                                        *
+ * Description:  Shares BANDWIDTH_BUDGET_PERMILLE of bus uBus between its cameras, in the    *
+ *               order of their priority:                                                    *
+ *               -> first every camera gets its smallest alternate setting, as long as the  *
+ *                  budget lasts, so that as many cameras as possible can stream;           *
+ *               -> then every camera is moved up to the smallest setting that carries the   *
+ *                  payload it negotiated at attach time, or to the largest one the rest of  *
+ *                  the budget allows.                                                       *
+ *               The cameras that lose bandwidth are reconfigured before the ones that gain  *
+ *               it, so the host controller always has the bandwidth to give. Must be called *
+ *               with bandwidth_mutex taken.                                                 *
+ ********************************************************************************************/
+
+VOID Bandwidth_Rebalance(UINT8 uBus)
+{
+    UINT8 i = 0, j = 0, k = 0;
+    UINT8 uCount = 0;
+    UINT32 uRemaining = BANDWIDTH_BUDGET_PERMILLE;
+    UINT32 uCost = 0;
+    pALT_SETTING pAlt = NULL;
+    pALT_SETTING pChoice = NULL;
+    pUVC_DEVICE pDevice = NULL;
+    pUVC_DEVICE cameras[MAX_CAMERAS];
+    pALT_SETTING targets[MAX_CAMERAS];
+    
+    /* Collect the cameras of the bus, highest priority first */
+    
+    semTake(device_table_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < MAX_CAMERAS; i++)
+    {
+        pDevice = uvc_devices[i];
+        
+        if((pDevice == NULL) || (pDevice->bw_registered == 0) || (pDevice->bus_index != uBus))
+        {
+            continue;
+        }
+        
+        for(j = uCount; (j > 0) && (cameras[j - 1]->priority < pDevice->priority); j--)
+        {
+            cameras[j] = cameras[j - 1];
+        }
+        
+        cameras[j] = pDevice;
+        uCount++;
+    }
+    
+    semGive(device_table_mutex);
+    
+    /* Pass 1: the smallest setting for every camera the budget can take */
+    
+    for(i = 0; i < uCount; i++)
+    {
+        pDevice = cameras[i];
+        pChoice = NULL;
+        
+        for(k = 0; k < pDevice->num_alt_settings; k++)
+        {
+            pAlt = &pDevice->alt_settings[k];
+            
+            if((pChoice == NULL) || (pAlt->uBytesPerInterval < pChoice->uBytesPerInterval))
+            {
+                pChoice = pAlt;
+            }
+        }
+        
+        uCost = Bandwidth_Cost(pDevice, pChoice);
+        
+        if((pChoice != NULL) && (uCost <= uRemaining))
+        {
+            targets[i] = pChoice;
+            uRemaining -= uCost;
+        }
+        else
+        {
+            targets[i] = NULL;
+        }
+    }
+    
+    /* Pass 2: move every camera up towards the payload it asked for */
+    
+    for(i = 0; i < uCount; i++)
+    {
+        pDevice = cameras[i];
+        pChoice = targets[i];
+        
+        if(pChoice == NULL)
+        {
+            continue;
+        }
+        
+        for(k = 0; k < pDevice->num_alt_settings; k++)
+        {
+            pAlt = &pDevice->alt_settings[k];
+            
+            if((Bandwidth_Cost(pDevice, pAlt) - Bandwidth_Cost(pDevice, targets[i])) > uRemaining)
+            {
+                continue;                       /* Also skips the settings that cost less (the difference wraps) */
+            }
+            
+            if(pChoice->uBytesPerInterval < pDevice->requested_payload)
+            {
+                if(pAlt->uBytesPerInterval > pChoice->uBytesPerInterval)
+                {
+                    pChoice = pAlt;             /* Still too small: take the larger one */
+                }
+            }
+            else if((pAlt->uBytesPerInterval >= pDevice->requested_payload) && (pAlt->uBytesPerInterval < pChoice->uBytesPerInterval))
+            {
+                pChoice = pAlt;                 /* Large enough: take the smallest that is */
+            }
+        }
+        
+        uRemaining -= Bandwidth_Cost(pDevice, pChoice) - Bandwidth_Cost(pDevice, targets[i]);
+        targets[i] = pChoice;
+    }
+    
+    /* Apply the cameras that shrink first, then the ones that grow or stay the same */
+    
+    for(i = 0; i < uCount; i++)
+    {
+        if(Bandwidth_Cost(cameras[i], targets[i]) < cameras[i]->bw_cost)
+        {
+            Bandwidth_Apply(cameras[i], targets[i]);
+        }
+    }
+    
+    for(i = 0; i < uCount; i++)
+    {
+        if(Bandwidth_Cost(cameras[i], targets[i]) >= cameras[i]->bw_cost)
+        {
+            Bandwidth_Apply(cameras[i], targets[i]);
+        }
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Bus %d - %d cameras, %d per mille of the budget left\n",__FUNCTION__,uBus,uCount,uRemaining,5,6);
+    
+    #endif
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Bandwidth_Apply(pUVC_DEVICE pDevice, pALT_SETTING pTarget)           *
+ * Description:  Moves the camera to the alternate setting given by the bandwidth manager    *
+ *               with Bandwidth_Reconfigure(). Nothing is done if the camera already streams *
+ *               at pTarget. A camera parked (or about to be parked) for a suspend only gets *
+ *               pTarget recorded; Stream_Resume() moves it there. If the stream cannot be   *
+ *               stopped or reconfigured, STREAM_EVENT_FAILED is sent and ERROR returned.    *
+ ********************************************************************************************/
+
+STATUS Bandwidth_Apply(pUVC_DEVICE pDevice, pALT_SETTING pTarget)
+{
+    STATUS status = OK;
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    if((pTarget != NULL) && (pTarget == pDevice->bw_target) && (pDevice->pipe_open == 1))
+    {
+        semGive(pDevice->stream_mutex);
+        
+        return OK;
+    }
+    
+    if((pDevice->suspended == 1) || (pDevice->suspend_requested == 1))
+    {
+        /* No control transfers or URBs while the bus is suspended */
+        
+        pDevice->bw_target   = pTarget;
+        pDevice->bw_cost     = Bandwidth_Cost(pDevice, pTarget);
+        pDevice->bw_deferred = 1;
+        
+        semGive(pDevice->stream_mutex);
+        
+        return OK;
+    }
+    
+    if(Stream_Stop(pDevice) != OK)
+    {
+        status = ERROR;                         /* URBs may still be queued on the pipe, so the stream is left as it is */
+    }
+    else
+    {
+        status = Bandwidth_Reconfigure(pDevice, pTarget);
+    }
+    
+    if((status != OK) && (streamEventCallback != NULL))
+    {
+        streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+    }
+    
+    semGive(pDevice->stream_mutex);
+    
+    return status;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Bandwidth_Reconfigure(pUVC_DEVICE pDevice, pALT_SETTING pTarget)     *
+ * Description:  Starts the stopped stream at pTarget. The frame size and interval           *
+ *               negotiated at attach time are requested again and lowered (see             *
+ *               Stream_Fit_Payload()) if the payload does not fit the setting. With         *
+ *               pTarget == NULL the stream stays stopped until bandwidth is available.      *
+ *               Must be called with stream_mutex taken. Returns ERROR, with the stream      *
+ *               stopped, if a probe/commit or the start fails.                              *
+ ********************************************************************************************/
+
+STATUS Bandwidth_Reconfigure(pUVC_DEVICE pDevice, pALT_SETTING pTarget)
+{
+    pDevice->bw_target   = pTarget;
+    pDevice->bw_cost     = Bandwidth_Cost(pDevice, pTarget);
+    pDevice->bw_deferred = 0;
+    
+    if(pTarget == NULL)
+    {
+        if(streamEventCallback != NULL)
+        {
+            streamEventCallback(pDevice->hDevice, STREAM_EVENT_NO_BANDWIDTH);
+        }
+        
+        return OK;
+    }
+    
+    /* The committed configuration is kept if it already has the requested frame size and interval (as after an attach,
+     * or an attach from the reattach cache); only a setting too small for its payload needs another probe/commit. */
+    
+    if((pDevice->probe_committed == 0) || (pDevice->probe.dwFrameInterval != pDevice->requested_interval) || (pDevice->probe.bFrameIndex != pDevice->requested_frame))
+    {
+        if(pDevice->probe.bFrameIndex != pDevice->requested_frame)
+        {
+            Stream_Wait_Image_Task(pDevice, STREAM_DRAIN_TIMEOUT);     /* dump_ppm() of the last frame still uses the old frame size */
+        }
+        
+        pDevice->probe.bFrameIndex     = pDevice->requested_frame;
+        pDevice->probe.dwFrameInterval = pDevice->requested_interval;
+        
+        if(Negotiate_Stream(pDevice) != USBHST_SUCCESS)
+        {
+            return ERROR;
+        }
+    }
+    
+    if(Stream_Fit_Payload(pDevice, pTarget) != OK)
+    {
+        return ERROR;
+    }
+    
+    pDevice->selected_alt    = pTarget;
+    pDevice->iso_packet_size = pTarget->uBytesPerInterval;
+    pDevice->degrade_level   = 0;
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Camera %d - alternate setting %d, %d per mille of the bus\n",__FUNCTION__,pDevice->uIndex,pTarget->bAlternateSetting,pDevice->bw_cost,5,6);
+    
+    #endif
+    
+    if(Stream_Start_Adaptive(pDevice) != USBHST_SUCCESS)
+    {
+        Stream_Stop(pDevice);
+        
+        return ERROR;
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Bandwidth_Set_Priority(pUVC_DEVICE pDevice, UINT8 uPriority)           *
+ * Description:  Changes the priority of a camera and shares the bus out again.              *
+ ********************************************************************************************/
+
+VOID Bandwidth_Set_Priority(pUVC_DEVICE pDevice, UINT8 uPriority)
+{
+    semTake(bandwidth_mutex, WAIT_FOREVER);
+    
+    pDevice->priority = uPriority;
+    
+    if(pDevice->bw_registered == 1)
+    {
+        Bandwidth_Rebalance(pDevice->bus_index);
+    }
+    
+    semGive(bandwidth_mutex);
+}
+
+/*********************************************************************************************
+ * Function:     UINT32 Bandwidth_Get_Reserved(UINT8 uBus)                                   *
+ * Description:  Returns the share of bus uBus (per mille) reserved by its cameras.          *
+ ********************************************************************************************/
+
+UINT32 Bandwidth_Get_Reserved(UINT8 uBus)
+{
+    UINT8 i = 0;
+    UINT32 uReserved = 0;
+    
+    semTake(device_table_mutex, WAIT_FOREVER);
+    
+    for(i = 0; i < MAX_CAMERAS; i++)
+    {
+        if((uvc_devices[i] != NULL) && (uvc_devices[i]->bw_registered == 1) && (uvc_devices[i]->bus_index == uBus))
+        {
+            uReserved += uvc_devices[i]->bw_cost;
+        }
+    }
+    
+    semGive(device_table_mutex);
+    
+    return uReserved;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Set_Mode(pUVC_DEVICE pDevice, UINT8 bFormatIndex,             *
+ *                                      UINT8 bFrameIndex, UINT32 dwFrameInterval)           *
+ * Description:  Switches a running camera to another format, frame size and frame interval  *
+ *               (in 100 ns units; 0 selects the frame's default interval). The stream is    *
+ *               stopped, probe/commit is run for the new mode and the stream is restarted   *
+ *               through the bandwidth manager, which picks the alternate setting for the    *
+ *               new payload size. Stream_Start() resizes the frame buffers. The service and *
+ *               batch tasks keep running and the camera stays registered with the host      *
+ *               stack, so nothing has to be attached again.                                 *
+ *                                                                                           *
+ *               Uncompressed and MJPEG formats can be selected, the ones processImage()     *
+ *               can turn into RGB. If the camera rejects the new mode, the previous one is  *
+ *               committed and restarted and ERROR is returned. If it rejects the previous   *
+ *               one as well, the stream stays stopped and STREAM_EVENT_FAILED is sent.      *
+ *               ERROR is also returned while the camera is still being brought up (see      *
+ *               Uvc_Wait_Ready()), and if the URBs of the stream did not complete after     *
+ *               Stream_Stop(); the pipe and the mode are then left as they are. If the      *
+ *               bandwidth manager cannot start the stream in the new mode, ERROR is         *
+ *               returned and the mode is not stored in the reattach cache.                  *
+ ********************************************************************************************/
+
+STATUS Stream_Set_Mode(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex, UINT32 dwFrameInterval)
+{
+    STATUS status = OK;
+    UVC_PROBE previous;
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, bFormatIndex);
+    pUVC_FRAME pFrame = Uvc_Find_Frame(pDevice, bFormatIndex, bFrameIndex);
+    
+    /* A camera without format descriptors is trusted with whatever is asked for */
+    
+    if(pDevice->num_formats > 0)
+    {
+        if((pFrame == NULL) || ((pFormat->bDescriptorSubtype != UVC_VS_FORMAT_UNCOMPRESSED) && (pFormat->bDescriptorSubtype != UVC_VS_FORMAT_MJPEG)))
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: Format %d frame %d is not an uncompressed or MJPEG mode of the camera.\n",__FUNCTION__,bFormatIndex,bFrameIndex,4,5,6);
+            
+            #endif
+            
+            return ERROR;
+        }
+        
+        if(dwFrameInterval == 0)
+        {
+            dwFrameInterval = pFrame->dwDefaultFrameInterval;
+        }
+        
+        if(Uvc_Frame_Supports_Interval(pFrame, dwFrameInterval) == 0)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: Frame %d does not support the interval %d.\n",__FUNCTION__,bFrameIndex,dwFrameInterval,4,5,6);
+            
+            #endif
+            
+            return ERROR;
+        }
+    }
+    
+    if(pDevice->attach_state != ATTACH_STATE_READY)
+    {
+        return ERROR;                           /* The bring-up owns the stream until it has finished */
+    }
+    
+    semTake(bandwidth_mutex, WAIT_FOREVER);
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    if((pDevice->suspended == 1) || (pDevice->suspend_requested == 1))
+    {
+        semGive(pDevice->stream_mutex);
+        semGive(bandwidth_mutex);
+        
+        return ERROR;                           /* No control transfers while the bus is suspended */
+    }
+    
+    if(Stream_Stop(pDevice) != OK)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: The stream did not stop. The mode is not changed.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        /* URBs may still be queued on the pipe of the current mode, so the alternate setting must stay as it is */
+        
+        semGive(pDevice->stream_mutex);
+        semGive(bandwidth_mutex);
+        
+        return ERROR;
+    }
+    
+    Stream_Wait_Image_Task(pDevice, STREAM_DRAIN_TIMEOUT);     /* dump_ppm() of the last frame still uses the old frame size */
+    
+    previous = pDevice->probe;
+    
+    pDevice->probe.bmHint          = PROBE_HINT_FRAME_INTERVAL;
+    pDevice->probe.bFormatIndex    = bFormatIndex;
+    pDevice->probe.bFrameIndex     = bFrameIndex;
+    pDevice->probe.dwFrameInterval = dwFrameInterval;
+    
+    if(Negotiate_Stream(pDevice) != USBHST_SUCCESS)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: The camera rejected the new mode. Going back to the previous one.\n",__FUNCTION__,2,3,4,5,6);
+        
+        #endif
+        
+        pDevice->probe = previous;
+        
+        if(Negotiate_Stream(pDevice) != USBHST_SUCCESS)
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: The camera rejected the previous mode as well. The stream stays stopped.\n",__FUNCTION__,2,3,4,5,6);
+            
+            #endif
+            
+            /* Nothing the camera has accepted can be started, so the restart is skipped */
+            
+            semGive(pDevice->stream_mutex);
+            semGive(bandwidth_mutex);
+            
+            if(streamEventCallback != NULL)
+            {
+                streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+            }
+            
+            return ERROR;
+        }
+        
+        status = ERROR;
+    }
+    
+    /* The still size is kept if the format has not changed; a new format gets its largest still */
+    
+    Still_Negotiate(pDevice, (pDevice->still_probe.bFormatIndex == pDevice->probe.bFormatIndex) ? pDevice->still_probe.bFrameIndex : 0);
+    
+    pDevice->requested_payload  = Stream_Payload_Size(pDevice);
+    pDevice->requested_interval = pDevice->probe.dwFrameInterval;
+    pDevice->requested_frame    = pDevice->probe.bFrameIndex;
+    pDevice->degrade_level      = 0;
+    
+    semGive(pDevice->stream_mutex);
+    
+    /* A bulk camera is started right away. An isochronous camera may need a different share of the bus now, so the
+     * bandwidth manager chooses its alternate setting again (and may move the other cameras to make room). */
+    
+    if(pDevice->bulk_mode)
+    {
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+        
+        if((Select_Alt_Setting(pDevice, pDevice->requested_payload) == NULL) || (Stream_Start_Adaptive(pDevice) != USBHST_SUCCESS))
+        {
+            Stream_Stop(pDevice);
+            status = ERROR;
+        }
+        
+        semGive(pDevice->stream_mutex);
+    }
+    else if(pDevice->bw_registered == 1)
+    {
+        Bandwidth_Rebalance(pDevice->bus_index);
+        
+        /* The rebalance reports its failures (no bandwidth, or a probe/commit or start that failed) only through the
+         * stream events; a camera it has left without a running stream did not get the new mode. */
+        
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+        
+        if((pDevice->pipe_open == 0) && (pDevice->suspended == 0) && (pDevice->suspend_requested == 0))
+        {
+            status = ERROR;
+        }
+        
+        semGive(pDevice->stream_mutex);
+    }
+    
+    semGive(bandwidth_mutex);
+    
+    if(status == OK)
+    {
+        Reattach_Cache_Store(pDevice);          /* The camera comes back in this mode after a replug */
+        
+        if(streamEventCallback != NULL)
+        {
+            streamEventCallback(pDevice->hDevice, STREAM_EVENT_MODE_CHANGED);
+        }
+    }
+    
+    return status;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Set_Frame_Interval(pUVC_DEVICE pDevice,                       *
+ *                                                UINT32 dwFrameInterval,                    *
+ *                                                UINT32 *pCommitted)                        *
+ * Description:  Changes the frame interval (in 100 ns units) of the current format and     *
+ *               of the frame size the application asked for, which the bandwidth manager    *
+ *               may have lowered for now (see requested_frame). The interval is moved to    *
+ *               the closest one the frame size supports (see Uvc_Nearest_Frame_Interval())  *
+ *               and the stream is switched with Stream_Set_Mode(). The interval the camera  *
+ *               committed is returned in pCommitted (if not NULL), also when the camera     *
+ *               rejected the new one.                                                       *
+ ********************************************************************************************/
+
+STATUS Stream_Set_Frame_Interval(pUVC_DEVICE pDevice, UINT32 dwFrameInterval, UINT32 *pCommitted)
+{
+    STATUS status = OK;
+    UINT8 bFormatIndex = 0;
+    UINT8 bFrameIndex = 0;
+    pUVC_FRAME pFrame = NULL;
+    
+    if(dwFrameInterval == 0)
+    {
+        return ERROR;
+    }
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    bFormatIndex = pDevice->probe.bFormatIndex;
+    bFrameIndex  = (pDevice->requested_frame != 0) ? pDevice->requested_frame : pDevice->probe.bFrameIndex;
+    
+    semGive(pDevice->stream_mutex);
+    
+    pFrame = Uvc_Find_Frame(pDevice, bFormatIndex, bFrameIndex);
+    
+    if(pFrame != NULL)
+    {
+        dwFrameInterval = Uvc_Nearest_Frame_Interval(pFrame, dwFrameInterval);
+    }
+    
+    status = Stream_Set_Mode(pDevice, bFormatIndex, bFrameIndex, dwFrameInterval);
+    
+    if(pCommitted != NULL)
+    {
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);
+        *pCommitted = pDevice->probe.dwFrameInterval;
+        semGive(pDevice->stream_mutex);
+    }
+    
+    return status;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Stream_Set_Frame_Rate(pUVC_DEVICE pDevice, UINT32 uNumerator,        *
+ *                                            UINT32 uDenominator, UINT32 *pCommitted)       *
+ * Description:  Same as Stream_Set_Frame_Interval() for a frame rate of                     *
+ *               uNumerator/uDenominator frames per second (30000/1001 for 29.97 fps).       *
+ ********************************************************************************************/
+
+STATUS Stream_Set_Frame_Rate(pUVC_DEVICE pDevice, UINT32 uNumerator, UINT32 uDenominator, UINT32 *pCommitted)
+{
+    UINT64 uInterval = 0;
+    
+    if((uNumerator == 0) || (uDenominator == 0))
+    {
+        return ERROR;
+    }
+    
+    uInterval = (((UINT64)FRAME_INTERVAL_UNITS_PER_SECOND * uDenominator) + (uNumerator / 2)) / uNumerator;
+    
+    if((uInterval == 0) || (uInterval > 0xFFFFFFFF))
+    {
+        return ERROR;
+    }
+    
+    return Stream_Set_Frame_Interval(pDevice, (UINT32)uInterval, pCommitted);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Stream_Service_Task(pUVC_DEVICE pDevice)                                              *
+ * Description:  Runs the requests that the completion callbacks cannot run themselves       *
+ *               because they need control transfers or have to wait for URBs.               *
+ *                                                                                           *
+ *               There is one service task per camera; pDevice is its context.               *
+ *                                                                                           *
+ *               SERVICE_DOWNSHIFT - the stream is stopped, stepped down and restarted. If   *
+ *               there is no smaller setting left, it is restarted as it was.                *
+ *               SERVICE_RECOVER   - the stream is restarted after URB errors or a stall     *
+ *               with Stream_Recover(). If that fails, the stream is stopped.                *
+ *               SERVICE_SUSPEND   - the stream is parked with Stream_Suspend().             *
+ *               SERVICE_RESUME    - the stream parked at suspend is restarted with          *
+ *               Stream_Resume().                                                            *
+ *               SERVICE_ATTACH    - the next step of the bring-up of a new camera is run    *
+ *               with Attach_Step(), without stream_mutex, which the bandwidth manager takes *
+ *               after bandwidth_mutex.                                                      *
+ *               SERVICE_EXIT      - sent by Device_Destroy(); the task exits.               *
+ ********************************************************************************************/
+
+VOID Stream_Service_Task(pUVC_DEVICE pDevice)
+{
+    SERVICE_MSG msg;
+    
+    while(1)
+    {
+        if(msgQReceive(pDevice->service_queue, (char *)&msg, sizeof(msg), WAIT_FOREVER) != sizeof(msg))
+        {
+            return;                                     /* The queue has been deleted */
+        }
+        
+        if(msg.uCommand == SERVICE_EXIT)
+        {
+            semGive(pDevice->exit_sem);
+            return;
+        }
+        
+        if(msg.uCommand == SERVICE_ATTACH)
+        {
+            Attach_Step(pDevice);
+            continue;
+        }
+        
+        semTake(pDevice->stream_mutex, WAIT_FOREVER);   /* The bandwidth manager may be reconfiguring the stream */
+        
+        switch(msg.uCommand)
+        {
+            case SERVICE_DOWNSHIFT:
+            
+                if((pDevice->suspended == 1) || (pDevice->suspend_requested == 1))
+                {
+                    pDevice->downshift_pending = 0;     /* The bus is idle; the stream resumes at its current setting */
+                    break;
+                }
+                
+                if(Stream_Stop(pDevice) == OK)
+                {
+                    Stream_Downshift(pDevice);
+                    
+                    if(Stream_Start_Adaptive(pDevice) != USBHST_SUCCESS)
+                    {
+                        Stream_Stop(pDevice);
+                        
+                        if(streamEventCallback != NULL)
+                        {
+                            streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+                        }
+                    }
+                }
+                
+                pDevice->downshift_pending = 0;
+                break;
+                
+            case SERVICE_RECOVER:
+            
+                pDevice->recovery_pending = 0;
+                
+                if(Stream_Recover(pDevice) != USBHST_SUCCESS)
+                {
+                    Stream_Stop(pDevice);
+                    
+                    if(streamEventCallback != NULL)
+                    {
+                        streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+                    }
+                }
+                break;
+                
+            case SERVICE_SUSPEND:
+            
+                if(Stream_Suspend(pDevice) != OK)
+                {
+                    if(streamEventCallback != NULL)
+                    {
+                        streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+                    }
+                }
+                break;
+                
+            case SERVICE_RESUME:
+            
+                if(Stream_Resume(pDevice) != USBHST_SUCCESS)
+                {
+                    Stream_Stop(pDevice);
+                    
+                    if(streamEventCallback != NULL)
+                    {
+                        streamEventCallback(pDevice->hDevice, STREAM_EVENT_FAILED);
+                    }
+                }
+                break;
+                
+            default:
+                break;
+        }
+        
+        semGive(pDevice->stream_mutex);
+    }
+}
+
+/*********************************************************************************************
+ * Function:     UINT32 Stream_Payload_Size(pUVC_DEVICE pDevice)                             *
+ * Description:  Returns the payload size the streaming endpoint must carry: the committed   *
+ *               dwMaxPayloadTransferSize of the video, or of the still if the camera sends  *
+ *               method 2 stills on the video pipe and needs more for them.                  *
+ ********************************************************************************************/
+
+UINT32 Stream_Payload_Size(pUVC_DEVICE pDevice)
+{
+    if((pDevice->still_committed == 1) && (pDevice->still_method == STILL_METHOD_STREAM) && (pDevice->still_probe.dwMaxPayloadTransferSize > pDevice->probe.dwMaxPayloadTransferSize))
+    {
+        return pDevice->still_probe.dwMaxPayloadTransferSize;
+    }
+    
+    return pDevice->probe.dwMaxPayloadTransferSize;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Uvc_Control_Set_Async(pUVC_DEVICE pDevice, UINT8 uEntity,            *
+ *                                            UINT8 uSelector, UINT32 uValue, UINT8 uLength, *
+ *                                            UINT8 bCoalesce, CONTROL_CALLBACK pCallback,   *
+ *                                            void *pContext)                                *
+ * Description:  Queues a SET_CUR of a camera terminal or processing unit control and        *
+ *               returns without waiting for it. uValue is sent as uLength little endian     *
+ *               bytes. With bCoalesce set, a write of the same control that is still        *
+ *               waiting in the queue is replaced by this one, so a control loop that        *
+ *               writes faster than the camera accepts only ever has its latest value sent. *
+ *               pCallback (if not NULL) is called by the control task when it is done.      *
+ ********************************************************************************************/
+
+STATUS Uvc_Control_Set_Async(pUVC_DEVICE pDevice, UINT8 uEntity, UINT8 uSelector, UINT32 uValue, UINT8 uLength, UINT8 bCoalesce, CONTROL_CALLBACK pCallback, void *pContext)
+{
+    UVC_CONTROL_REQUEST request;
+    
+    request.uEntity   = uEntity;
+    request.uSelector = uSelector;
+    request.uRequest  = USB_SET_CURRENT;
+    request.uLength   = uLength;
+    request.bCoalesce = bCoalesce;
+    request.uValue    = uValue;
+    request.pCallback = pCallback;
+    request.pContext  = pContext;
+    
+    return Control_Queue_Put(pDevice, &request);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Uvc_Control_Get_Async(pUVC_DEVICE pDevice, UINT8 uEntity,            *
+ *                                            UINT8 uSelector, UINT8 uRequest,               *
+ *                                            UINT8 uLength, CONTROL_CALLBACK pCallback,     *
+ *                                            void *pContext)                                *
+ * Description:  Queues a read of a control (uRequest is USB_GET_CURRENT or one of the other *
+ *               USB_GET_* requests). The value is handed to pCallback.                      *
+ ********************************************************************************************/
+
+STATUS Uvc_Control_Get_Async(pUVC_DEVICE pDevice, UINT8 uEntity, UINT8 uSelector, UINT8 uRequest, UINT8 uLength, CONTROL_CALLBACK pCallback, void *pContext)
+{
+    UVC_CONTROL_REQUEST request;
+    
+    if((uRequest & USB_DIRECTION_MASK) == 0)
+    {
+        return ERROR;
+    }
+    
+    request.uEntity   = uEntity;
+    request.uSelector = uSelector;
+    request.uRequest  = uRequest;
+    request.uLength   = uLength;
+    request.bCoalesce = 0;
+    request.uValue    = 0;
+    request.pCallback = pCallback;
+    request.pContext  = pContext;
+    
+    return Control_Queue_Put(pDevice, &request);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Control_Queue_Put(pUVC_DEVICE pDevice,                               *
+ *                                        pUVC_CONTROL_REQUEST pRequest)                     *
+ * Description:  Adds a request to the control queue of the camera, or replaces a waiting    *
+ *               write of the same control if both may be coalesced. The replaced request's  *
+ *               callback is called with USBHST_TRANSFER_CANCELLED from the calling task.    *
+ *               Returns ERROR if the camera has no such entity or the queue is full.        *
+ ********************************************************************************************/
+
+STATUS Control_Queue_Put(pUVC_DEVICE pDevice, pUVC_CONTROL_REQUEST pRequest)
+{
+    UINT8 i = 0;
+    UINT8 bReplaced = 0;
+    pUVC_CONTROL_REQUEST pQueued = NULL;
+    UVC_CONTROL_REQUEST replaced;
+    
+    if((pRequest->uLength == 0) || (pRequest->uLength > CONTROL_VALUE_MAX_LENGTH) ||
+       (((pRequest->uEntity == UVC_ENTITY_CAMERA_TERMINAL) ? pDevice->camera_terminal_id : pDevice->processing_unit_id) == 0))
+    {
+        return ERROR;
+    }
+    
+    replaced.pCallback = NULL;
+    
+    semTake(pDevice->control_mutex, WAIT_FOREVER);
+    
+    if((pRequest->uRequest == USB_SET_CURRENT) && pRequest->bCoalesce)
+    {
+        for(i = 0; i < pDevice->control_count; i++)
+        {
+            pQueued = &pDevice->control_queue[(pDevice->control_head + i) % CONTROL_QUEUE_LENGTH];
+            
+            if((pQueued->uRequest == USB_SET_CURRENT) && pQueued->bCoalesce && (pQueued->uEntity == pRequest->uEntity) && (pQueued->uSelector == pRequest->uSelector))
+            {
+                replaced = *pQueued;
+                *pQueued = *pRequest;
+                pDevice->controls_coalesced++;
+                bReplaced = 1;
+                
+                break;
+            }
+        }
+    }
+    
+    if(bReplaced == 0)
+    {
+        if(pDevice->control_count == CONTROL_QUEUE_LENGTH)
+        {
+            semGive(pDevice->control_mutex);
+            
+            #ifdef DEBUG
+            
+            logMsg("%s: The control queue of camera %d is full.\n",__FUNCTION__,pDevice->uIndex,3,4,5,6);
+            
+            #endif
+            
+            return ERROR;
+        }
+        
+        pDevice->control_queue[(pDevice->control_head + pDevice->control_count) % CONTROL_QUEUE_LENGTH] = *pRequest;
+        pDevice->control_count++;
+        
+        semGive(pDevice->control_mutex);
+        semGive(pDevice->control_sem);
+        
+        return OK;
+    }
+    
+    semGive(pDevice->control_mutex);
+    
+    if(replaced.pCallback != NULL)
+    {
+        replaced.pCallback(pDevice->hDevice, replaced.uEntity, replaced.uSelector, USBHST_TRANSFER_CANCELLED, 0, replaced.pContext);
+    }
+    
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Control_Queue_Flush(pUVC_DEVICE pDevice)                               *
+ * Description:  Empties the control queue and calls the callback of every request that was  *
+ *               still waiting with USBHST_TRANSFER_CANCELLED. Used when the camera is       *
+ *               destroyed, after the control task has exited.                               *
+ ********************************************************************************************/
+
+VOID Control_Queue_Flush(pUVC_DEVICE pDevice)
+{
+    UVC_CONTROL_REQUEST request;
+    
+    while(1)
+    {
+        semTake(pDevice->control_mutex, WAIT_FOREVER);
+        
+        if(pDevice->control_count == 0)
+        {
+            semGive(pDevice->control_mutex);
+            
+            return;
+        }
+        
+        request = pDevice->control_queue[pDevice->control_head];
+        pDevice->control_head = (pDevice->control_head + 1) % CONTROL_QUEUE_LENGTH;
+        pDevice->control_count--;
+        
+        semGive(pDevice->control_mutex);
+        
+        if(request.pCallback != NULL)
+        {
+            request.pCallback(pDevice->hDevice, request.uEntity, request.uSelector, USBHST_TRANSFER_CANCELLED, 0, request.pContext);
+        }
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Control_Task(pUVC_DEVICE pDevice)                                      *
+ * Description:  Runs the queued control requests of one camera in order, each as a         *
+ *               blocking control transfer on the default pipe, and reports them through     *
+ *               their callbacks. The streaming URBs are not involved, so a slow control     *
+ *               request delays only the requests behind it. Exits when Device_Destroy()     *
+ *               sets control_exit.                                                          *
+ ********************************************************************************************/
+
+VOID Control_Task(pUVC_DEVICE pDevice)
+{
+    UINT8 i = 0;
+    UINT8 uEntityId = 0;
+    UINT32 uValue = 0;
+    UCHAR buffer[CONTROL_VALUE_MAX_LENGTH];
+    UVC_CONTROL_REQUEST request;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    
+    while(1)
+    {
+        semTake(pDevice->control_sem, WAIT_FOREVER);
+        
+        if(pDevice->control_exit == 1)
+        {
+            semGive(pDevice->control_exit_sem);
+            return;
+        }
+        
+        semTake(pDevice->control_mutex, WAIT_FOREVER);
+        
+        if(pDevice->control_count == 0)
+        {
+            semGive(pDevice->control_mutex);
+            continue;
+        }
+        
+        request = pDevice->control_queue[pDevice->control_head];
+        pDevice->control_head = (pDevice->control_head + 1) % CONTROL_QUEUE_LENGTH;
+        pDevice->control_count--;
+        
+        semGive(pDevice->control_mutex);
+        
+        uEntityId = (request.uEntity == UVC_ENTITY_CAMERA_TERMINAL) ? pDevice->camera_terminal_id : pDevice->processing_unit_id;
+        
+        for(i = 0; i < request.uLength; i++)
+        {
+            buffer[i] = (UCHAR)(request.uValue >> (8 * i));
+        }
+        
+        nStatus = Control_Transfer_Buffer(pDevice->hDevice, (request.uRequest == USB_SET_CURRENT) ? USB_DIRECTION_OUT : USB_DIRECTION_IN, request.uRequest,
+                                          (UINT16)(request.uSelector << 8), (UINT16)((uEntityId << 8) | pDevice->control_interface), buffer, request.uLength);
+        
+        uValue = 0;
+        
+        if((nStatus == USBHST_SUCCESS) && (request.uRequest != USB_SET_CURRENT))
+        {
+            for(i = 0; i < request.uLength; i++)
+            {
+                uValue |= ((UINT32)buffer[i]) << (8 * i);
+            }
+        }
+        
+        #ifdef DEBUG
+        
+        logMsg("%s: Entity %d selector %x request %x: status %d, value %d\n",__FUNCTION__,uEntityId,request.uSelector,request.uRequest,nStatus,(request.uRequest == USB_SET_CURRENT) ? request.uValue : uValue);
+        
+        #endif
+        
+        if(request.pCallback != NULL)
+        {
+            request.pCallback(pDevice->hDevice, request.uEntity, request.uSelector, nStatus, uValue, request.pContext);
+        }
+    }
+}
+
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Still_Negotiate(pUVC_DEVICE pDevice, UINT8 bFrameIndex)       *
+ * Description:  Runs still probe/commit for still size bFrameIndex (starting at 1) of the   *
+ *               committed video format, or for its largest still if bFrameIndex is 0, and   *
+ *               leaves the committed values in pDevice->still_probe. Only method 2 and 3    *
+ *               cameras can take stills without stopping the stream; for the others it      *
+ *               returns USBHST_FAILURE without a transfer.                                  *
+ *                                                                                           *
+ *               A method 2 still is assembled in image_buffer, which is sized for it when   *
+ *               the stream starts. A larger still committed while streaming is dropped as   *
+ *               damaged until the stream is restarted.                                      *
+ ********************************************************************************************/
+
+USBHST_STATUS Still_Negotiate(pUVC_DEVICE pDevice, UINT8 bFrameIndex)
+{
+    UCHAR buffer[STILL_PROBE_LENGTH];
+    UINT8 i = 0;
+    UINT32 uArea = 0;
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, pDevice->probe.bFormatIndex);
+    
+    pDevice->still_committed = 0;
+    
+    if(((pDevice->still_method != STILL_METHOD_STREAM) && (pDevice->still_method != STILL_METHOD_BULK)) || (pFormat == NULL) || (pFormat->num_still_sizes == 0) || (bFrameIndex > pFormat->num_still_sizes))
+    {
+        return USBHST_FAILURE;
+    }
+    
+    if((pDevice->still_method == STILL_METHOD_BULK) && (pDevice->still_endpoint == 0))
+    {
+        return USBHST_FAILURE;                  /* Method 3 without a still endpoint */
+    }
+    
+    if(bFrameIndex == 0)
+    {
+        for(i = 0; i < pFormat->num_still_sizes; i++)
+        {
+            if(((UINT32)pFormat->still_width[i] * pFormat->still_height[i]) > uArea)
+            {
+                uArea = (UINT32)pFormat->still_width[i] * pFormat->still_height[i];
+                bFrameIndex = i + 1;
+            }
+        }
+    }
+    
+    memset(buffer, 0, sizeof(buffer));
+    
+    buffer[STILL_PROBE_FORMAT_INDEX_OFFSET]      = pFormat->bFormatIndex;
+    buffer[STILL_PROBE_FRAME_INDEX_OFFSET]       = bFrameIndex;
+    buffer[STILL_PROBE_COMPRESSION_INDEX_OFFSET] = (pFormat->num_still_compressions != 0) ? 1 : 0;
+    
+    if((USBHST_SUCCESS != Control_Transfer_Buffer(pDevice->hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_STILL_PROBE_CONTROL, pDevice->streaming_interface, buffer, STILL_PROBE_LENGTH)) ||
+       (USBHST_SUCCESS != Control_Transfer_Buffer(pDevice->hDevice, USB_DIRECTION_IN, USB_GET_CURRENT, UVC_VS_STILL_PROBE_CONTROL, pDevice->streaming_interface, buffer, STILL_PROBE_LENGTH)))
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: Still probe of format %d still %d failed.\n",__FUNCTION__,pFormat->bFormatIndex,bFrameIndex,4,5,6);
+        
+        #endif
+        
+        return USBHST_FAILURE;
+    }
+    
+    pDevice->still_probe.bFormatIndex             = buffer[STILL_PROBE_FORMAT_INDEX_OFFSET];
+    pDevice->still_probe.bFrameIndex              = buffer[STILL_PROBE_FRAME_INDEX_OFFSET];
+    pDevice->still_probe.bCompressionIndex        = buffer[STILL_PROBE_COMPRESSION_INDEX_OFFSET];
+    pDevice->still_probe.dwMaxVideoFrameSize      = GET_LE32(&buffer[STILL_PROBE_MAX_VIDEO_FRAME_SIZE_OFFSET]);
+    pDevice->still_probe.dwMaxPayloadTransferSize = GET_LE32(&buffer[STILL_PROBE_MAX_PAYLOAD_TRANSFER_SIZE_OFFSET]);
+    
+    if((pDevice->still_probe.bFrameIndex == 0) || (pDevice->still_probe.bFrameIndex > pFormat->num_still_sizes))
+    {
+        pDevice->still_probe.bFrameIndex = bFrameIndex;
+    }
+    
+    if(pDevice->still_probe.dwMaxVideoFrameSize == 0)
+    {
+        /* Like for the video, some cameras leave the size to the host */
+        
+        pDevice->still_probe.dwMaxVideoFrameSize = (UINT32)pFormat->still_width[pDevice->still_probe.bFrameIndex - 1] * pFormat->still_height[pDevice->still_probe.bFrameIndex - 1] * 2;
+    }
+    
+    if(USBHST_SUCCESS != Control_Transfer_Buffer(pDevice->hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_STILL_COMMIT_CONTROL, pDevice->streaming_interface, buffer, STILL_PROBE_LENGTH))
+    {
         #ifdef DEBUG
         
-        logMsg("%s: OSS_CALLOC for pUrb failed.\n",__FUNCTION__,2,3,4,5,6);
+        logMsg("%s: Still commit SET_CUR failed.\n",__FUNCTION__,2,3,4,5,6);
         
         #endif
         
-        shutDown();
+        return USBHST_FAILURE;
+    }
+    
+    #ifdef DEBUG
+    
+    logMsg("%s: Method %d still %d of format %d, max size %d, max payload %d\n",__FUNCTION__,pDevice->still_method,pDevice->still_probe.bFrameIndex,pDevice->still_probe.bFormatIndex,pDevice->still_probe.dwMaxVideoFrameSize,pDevice->still_probe.dwMaxPayloadTransferSize);
+    
+    #endif
+    
+    pDevice->still_committed = 1;
+    
+    return USBHST_SUCCESS;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Still_Capture(pUVC_DEVICE pDevice, FRAME_SINK_CALLBACK pSink,        *
+ *                                    void *pContext)                                        *
+ * Description:  Takes a still image at the size committed by Still_Negotiate() while the    *
+ *               video keeps streaming, and gives it to pSink, which also gets the stills    *
+ *               the camera sends on its own (e.g. for a button on the camera).              *
+ *                                                                                           *
+ *               Method 2: VS_STILL_IMAGE_TRIGGER_CONTROL asks the camera to send the still  *
+ *               on the video pipe in place of the next frame. Still_Capture() returns once  *
+ *               the trigger is sent; the still is recognised by HEADER_STI_BIT and given to *
+ *               pSink by the image task.                                                    *
+ *               Method 3: the camera is asked to send the still on its bulk still endpoint, *
+ *               which is read here (at most STILL_TIMEOUT ticks per URB). pSink is called   *
+ *               before Still_Capture() returns. stream_mutex is held only for the trigger;  *
+ *               the read is serialised by still_mutex, which owns still_buffer, so the      *
+ *               service task is not held up by it.                                          *
+ *                                                                                           *
+ *               The stream must be running. Returns ERROR if the camera has no still        *
+ *               committed, or if the still could not be triggered or read.                  *
+ ********************************************************************************************/
+
+STATUS Still_Capture(pUVC_DEVICE pDevice, FRAME_SINK_CALLBACK pSink, void *pContext)
+{
+    UCHAR trigger = STILL_TRIGGER_TRANSMIT;
+    UINT32 uLength = 0;
+    STATUS status = OK;
+    FRAME_INFO info;
+    
+    if((pSink == NULL) || (pDevice->still_committed == 0))
+    {
+        return ERROR;
+    }
+    
+    if(pDevice->still_method == STILL_METHOD_BULK)
+    {
+        semTake(pDevice->still_mutex, WAIT_FOREVER);   /* Taken before stream_mutex, never after it */
+    }
+    
+    semTake(pDevice->stream_mutex, WAIT_FOREVER);
+    
+    if((pDevice->suspended == 1) || (pDevice->suspend_requested == 1) || (pDevice->pipe_open == 0))
+    {
+        semGive(pDevice->stream_mutex);
+        
+        if(pDevice->still_method == STILL_METHOD_BULK)
+        {
+            semGive(pDevice->still_mutex);
+        }
         
         return ERROR;
     }
     
-    memset(pUrb, 0, sizeof(USBHST_URB));
-    
-    EventId = OS_CREATE_EVENT(OS_EVENT_NON_SIGNALED);                  /* Creates a context for the transfer */
-    
-    #ifdef DEBUG
-    
-    logMsg("%s: Event id is %d\n",__FUNCTION__,EventId,3,4,5,6);
-    
-    #endif
-    
-    pUSBHST_SETUP_PACKET pSetupPacket; 
-        
-    pSetupPacket = (USBHST_SETUP_PACKET *)OSS_CALLOC(sizeof(USBHST_SETUP_PACKET));
+    semTake(pDevice->sink_mutex, WAIT_FOREVER);     /* Still_Deliver() calls the sink with it held */
+    pDevice->still_sink         = pSink;
+    pDevice->still_sink_context = pContext;
+    semGive(pDevice->sink_mutex);
     
-    if(pSetupPacket == NULL)
+    if(pDevice->still_method == STILL_METHOD_BULK)
     {
-        #ifdef DEBUG
+        trigger = STILL_TRIGGER_TRANSMIT_BULK;
         
-        logMsg("%s: OSS_CALLOC for pSetupPacket failed.\n",__FUNCTION__,2,3,4,5,6);
+        /* The still is read with its payload headers, which are removed as it is assembled. The room after it is for
+         * the Huffman tables Mjpeg_Complete_Frame() may insert. */
         
-        #endif
+        if((pDevice->still_buffer != NULL) && (pDevice->still_buffer_size != pDevice->still_probe.dwMaxVideoFrameSize))
+        {
+            OSS_FREE(pDevice->still_buffer);
+            pDevice->still_buffer = NULL;
+        }
         
-        shutDown();
+        if(pDevice->still_buffer == NULL)
+        {
+            pDevice->still_buffer      = (UCHAR *)OSS_CALLOC(pDevice->still_probe.dwMaxVideoFrameSize + PAYLOAD_HEADER_MAX_LENGTH + JPEG_DHT_SEGMENT_LENGTH);
+            pDevice->still_buffer_size = (pDevice->still_buffer != NULL) ? pDevice->still_probe.dwMaxVideoFrameSize : 0;
+        }
         
-        return ERROR;
+        if(pDevice->still_buffer == NULL)
+        {
+            semGive(pDevice->stream_mutex);
+            semGive(pDevice->still_mutex);
+            
+            return ERROR;
+        }
     }
     
-    USBHST_FILL_SETUP_PACKET(pSetupPacket, uRequestType, uRequest, uValue, uIndex, sizeof(data));    
-    
-    #ifdef DEBUG
-    
-    logMsg("%s:Req type = %x, request = %x, value = %x, index = %x, size = %d\n",__FUNCTION__, pSetupPacket->bmRequestType, pSetupPacket->bRequest,OS_UINT16_LE_TO_CPU(pSetupPacket->wValue), OS_UINT16_LE_TO_CPU(pSetupPacket->wIndex), OS_UINT16_LE_TO_CPU(pSetupPacket->wLength));
-    
-    #endif
-    
-    USBHST_FILL_CONTROL_URB(pUrb, hDevice, CONTROL_TRANSFER_ENDPOINT, &data[0], sizeof(data), USBHST_SHORT_TRANSFER_OK /* Source: www.jungo.com/st/support/tech_docs/td107.html - Says that control transfers are always short transfers */, pSetupPacket, Control_Completion_Callback, EventId, USBHST_SUCCESS);
-    
-    #ifdef DEBUG
-    
-    logMsg("%s: After filling the control URB\n",__FUNCTION__,2,3,4,5,6);
-    logMsg("hdevice = %d, Endpoint = %d, Transfer length = %d, Transfer flags = %d, context = %d, status = %d\n", pUrb->hDevice, pUrb->uEndPointAddress, pUrb->uTransferLength, pUrb->uTransferFlags, pUrb->pContext, pUrb->nStatus);
-    logMsg("%s: pUrb = %x, Address = %x",__FUNCTION__,pUrb, &pUrb,4,5,6);
-    
-    #endif
-    
-    nStatus = usbHstURBSubmit(pUrb);
-    
-    if(nStatus == USBHST_SUCCESS)
+    if(USBHST_SUCCESS != Control_Transfer_Buffer(pDevice->hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_STILL_IMAGE_TRIGGER_CONTROL, pDevice->streaming_interface, &trigger, 1))
     {
         #ifdef DEBUG
         
-        logMsg("%s: usbHstUrbSubmit was successful\n",__FUNCTION__,2,3,4,5,6);
+        logMsg("%s: Still image trigger failed.\n",__FUNCTION__,2,3,4,5,6);
         
         #endif
         
-        OS_WAIT_FOR_EVENT(EventId, OS_WAIT_INFINITE);
-        
-        nStatus = pUrb->nStatus;
-    }   
-    
-    OSS_FREE(pSetupPacket);
-    OSS_FREE(pUrb);
-    OS_DESTROY_EVENT(EventId);
+        status = ERROR;
+    }
     
-    #ifdef DEBUG
+    semGive(pDevice->stream_mutex);
     
-    logMsg("%s: Control transfer nStatus = %d\n",__FUNCTION__, nStatus,3,4,5,6);
+    if(pDevice->still_method != STILL_METHOD_BULK)
+    {
+        return status;
+    }
     
-    for(i = 0; i < 26; i++)
+    if(status == OK)
     {
-        logMsg("%s: data = %x \n",__FUNCTION__,data[i],3,4,5,6);
+        memset(&info, 0, sizeof(info));
+        
+        status = Still_Read_Bulk(pDevice, &info, &uLength);
+        
+        if(status == OK)
+        {
+            Still_Deliver(pDevice, pDevice->still_buffer, uLength, &info);
+        }
+        else
+        {
+            trigger = STILL_TRIGGER_ABORT;      /* The camera stops sending the rest of the still */
+            
+            Control_Transfer_Buffer(pDevice->hDevice, USB_DIRECTION_OUT, USB_SET_CURRENT, UVC_VS_STILL_IMAGE_TRIGGER_CONTROL, pDevice->streaming_interface, &trigger, 1);
+        }
     }
     
-    #endif
+    semGive(pDevice->still_mutex);
     
-    return nStatus;
+    return status;
 }
 
-/*****************************************************************************************
- * Function:     USBHST_STATUS Isochronous_Completion_Callback(pUSHBST_URB pUrb)         *
- * Description:  This callback function is called when the host revieves data from the   *
- *               camera.                                                                 *
- *                                                                                       *
- *               On recieving the data, the host checks the length field of all the      *
- *               isochronous packet descriptor structures. If the value of the field of  *
- *               any descriptor is 12, that means that the camera has sent only the      *
- *               stream header in the corresponding packet. There is not data. We ignore *
- *               the corresponding section of the transfer buffer (here - buffer pointed *
- *               by pUrb->pTransferBuffer). If the length is greater than 12 bytes, then *
- *               the value of the FID bit of the header is compared to its value in the  *
- *               previous transfer. If the value has changed, that means that the current*
- *               frame contains the data of a new image. So, before copying the current  *
- *               data in the image_buffer and thus overwriting the image data, the data  *
- *               in the image_buffer is processed (converted to RGB and saved as a PPM   *
- *               file) and after that, the current data is copied to the image_buffer.   *
- *                                                                                       *
- *               If the FID bit has not changed, then the data is simply copied to the   *
- *               image_buffer and the loop continues.                                    *
- *                                                                                       *
- *               Once the data corresponding to all the isochronous packet descriptors   *
- *               has been analyzed, the Urb is again filled and submitted to recieve new *
- *               data from the camera.                                                   *
- ****************************************************************************************/
+/*********************************************************************************************
+ * Function:     STATUS Still_Read_Bulk(pUVC_DEVICE pDevice, pFRAME_INFO pInfo,              *
+ *                                      UINT32 *pLength)                                     *
+ * Description:  Reads a method 3 still from the still endpoint into still_buffer, payload   *
+ *               by payload, like Bulk_Completion_Callback() does for a bulk stream: a       *
+ *               payload ends with a short transfer or after dwMaxPayloadTransferSize bytes, *
+ *               and the still ends with the payload that has the EOF bit. The payload       *
+ *               headers are removed. Returns the length of the still in pLength and its     *
+ *               time stamps in pInfo, or ERROR if the camera reports an error, the still    *
+ *               does not fit or a URB fails or times out.                                   *
+ ********************************************************************************************/
 
-USBHST_STATUS Isochronous_Completion_Callback(pUSBHST_URB pUrb)
+STATUS Still_Read_Bulk(pUVC_DEVICE pDevice, pFRAME_INFO pInfo, UINT32 *pLength)
 {
-    UINT16 i = 0;
-    UINT32 taskId;
-    
-    pUSBHST_ISO_PACKET_DESC pIsochronous_Packet_Descriptor;
+    UCHAR *pData = NULL;
+    UINT32 uOffset = 0;
+    UINT32 uTransfer = 0;
+    UINT32 uReceived = 0;
+    UINT32 uHeaderLength = 0;
+    UINT32 uPayloadReceived = 0;
+    UINT8 bInPayload = 0;
+    UINT8 bEof = 0;
     
-    pIsochronous_Packet_Descriptor = pUrb->pTransferSpecificData;
-
-    for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
+    for(;;)
     {
-        if(pIsochronous_Packet_Descriptor[i].uLength != HEADER_LENGTH)                    
+        uTransfer = pDevice->still_buffer_size + PAYLOAD_HEADER_MAX_LENGTH - uOffset;
+        
+        if(uTransfer > BULK_MAX_TRANSFER_SIZE)
+        {
+            uTransfer = BULK_MAX_TRANSFER_SIZE;
+        }
+        
+        pData = pDevice->still_buffer + uOffset;
+        
+        if(USBHST_SUCCESS != Still_Bulk_Transfer(pDevice, pData, uTransfer, &uReceived))
+        {
+            return ERROR;
+        }
+        
+        if(bInPayload == 0)
         {
-            if(mem_h != (pUrb->pTransferBuffer[(i*ISOCHRONOUS_BUFFER_SIZE) + 1] & 0x01))  /* Check for the FID bit */
+            uHeaderLength = (uReceived >= 2) ? pData[0] : 0;
+            
+            if((uHeaderLength < 2) || (uHeaderLength > uReceived) || (pData[1] & HEADER_ERR_BIT))
             {
-                mem_h = (pUrb->pTransferBuffer[(i*ISOCHRONOUS_BUFFER_SIZE) + 1] & 0x01);
-                end_of_image  = 1;
-                offset = 0;
-                frameCount--;
-                if(frameCount == 0)
-                {
-                    aborted = 1;
-                }               
-                
-                if(taskSpawn("processImage", 51, 0, 6000, processImage, image_buffer, (UINT32)(HRES*VRES*2), 0, 0, 0, 0, 0, 0, 0, 0) == ERROR)
-                {
-                    logMsg("Process image task spawn failed\n",1,2,3,4,5,6);
-                    
-                    shutDown();
-                    
-                    return ERROR;
-                }
-                                
-                /*processImage(image_buffer, (UINT32)(HRES*VRES*2));*/
+                #ifdef DEBUG
                 
-                first = 1;
+                logMsg("%s: Bad payload header or camera error after %d bytes of the still.\n",__FUNCTION__,uOffset,3,4,5,6);
                 
-                memset(image_buffer, 0, sizeof(image_buffer));        /* Clear the image_buffer after a complete frame has been processed */
+                #endif
                 
-                void* buffer_ptr = (void *)pUrb->pTransferBuffer;
-                memcpy((void *)(image_buffer + offset), (const void *)(buffer_ptr + ((i * ISOCHRONOUS_BUFFER_SIZE) + HEADER_LENGTH)), (pIsochronous_Packet_Descriptor[i].uLength) - HEADER_LENGTH);
-                offset += pIsochronous_Packet_Descriptor[i].uLength - HEADER_LENGTH;
+                return ERROR;
             }
-            else
+            
+            if((pData[1] & HEADER_PTS_BIT) && (uHeaderLength >= (HEADER_PTS_OFFSET + 4)) && (pInfo->bPtsValid == 0))
             {
-                if(first == 1)
-                {
-                    semTake(synch_sem, WAIT_FOREVER);
-                    first = 0;
-                }
-                void* buffer_ptr = (void *)pUrb->pTransferBuffer;
-                memcpy((void *)(image_buffer + offset), (const void *)(buffer_ptr + ((i * ISOCHRONOUS_BUFFER_SIZE) + HEADER_LENGTH)), (pIsochronous_Packet_Descriptor[i].uLength) - HEADER_LENGTH);
-                offset += pIsochronous_Packet_Descriptor[i].uLength - HEADER_LENGTH;
+                pInfo->uPts      = GET_LE32(&pData[HEADER_PTS_OFFSET]);
+                pInfo->bPtsValid = 1;
             }
-        }
-        if(pIsochronous_Packet_Descriptor[i].nStatus != USBHST_SUCCESS)
-        {
-            #ifdef DEBUG
             
-            logMsg("%s: The packet %d has status %d\n",__FUNCTION__, i, pIsochronous_Packet_Descriptor[i].nStatus,4,5,6);
+            bEof = ((pData[1] & HEADER_EOF_BIT) != 0);
             
-            #endif
+            memmove(pData, pData + uHeaderLength, uReceived - uHeaderLength);
+            uOffset += uReceived - uHeaderLength;
             
-            continue;
+            uPayloadReceived = uReceived;
+            bInPayload = 1;
+        }
+        else
+        {
+            uOffset += uReceived;
+            uPayloadReceived += uReceived;
+        }
+        
+        if(uOffset > pDevice->still_buffer_size)
+        {
+            return ERROR;                       /* Larger than the committed dwMaxVideoFrameSize */
+        }
+        
+        if((uReceived < uTransfer) || ((pDevice->still_probe.dwMaxPayloadTransferSize != 0) && (uPayloadReceived >= pDevice->still_probe.dwMaxPayloadTransferSize)))
+        {
+            bInPayload = 0;
+            
+            if(bEof == 1)
+            {
+                break;
+            }
         }
     }
     
-    /* Refill the URB and submit it */
-    for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
-    {
-        pIsochronous_Packet_Descriptor[i].uLength = ISOCHRONOUS_BUFFER_SIZE;
-        pIsochronous_Packet_Descriptor[i].uOffset = i*ISOCHRONOUS_BUFFER_SIZE;
-    }
-    if(!aborted)
-    {
-        usbHstURBSubmit(pUrb);
-    }
-
-    return USBHST_SUCCESS;
+    pInfo->uTicks = tickGet();
+    *pLength = uOffset;
+    
+    return OK;
 }
 
-/******************************************************************************************************************************************
- * Function:     USBHST_STATUS Isochronous_Transfer(UINT32 hDevice, UINT8 uEndpointAddress, UINT32 uTransferFlags, USBHST_STATUS nStatus) *
- * Description:  This function allocates memory for the URB structure and the isochronous packet descriptors based on the number of       *
- *               packets specified.                                                                                                       *
- *                                                                                                                                        *
- *               Then, it fills the isochronous packet descriptors based on the buffer size and also fills the offset filed of the        *
- *               descriptors.                                                                                                             *
- *                                                                                                                                        *
- *               It creates a URB for isochronous transfers and submits it.                                                               *
- *****************************************************************************************************************************************/
+/*********************************************************************************************
+ * Function:     USBHST_STATUS Still_Bulk_Transfer(pUVC_DEVICE pDevice, UCHAR *pBuffer,      *
+ *                                                 UINT32 uLength, UINT32 *pReceived)        *
+ * Description:  Reads up to uLength bytes from the still endpoint into pBuffer and returns  *
+ *               the number of bytes received in pReceived. The URB and the event of a       *
+ *               control context are borrowed for the transfer, so nothing is allocated for  *
+ *               it. A URB that has not completed after STILL_TIMEOUT ticks is cancelled.    *
+ ********************************************************************************************/
 
-USBHST_STATUS Isochronous_Transfer(UINT32 hDevice, UINT8 uEndpointAddress, UINT32 uTransferFlags, USBHST_STATUS nStatus)
+USBHST_STATUS Still_Bulk_Transfer(pUVC_DEVICE pDevice, UCHAR *pBuffer, UINT32 uLength, UINT32 *pReceived)
 {
-    UINT8 i = 0;
-
-    pUSBHST_URB pUrb;
+    USBHST_STATUS nStatus = USBHST_SUCCESS;
+    pCONTROL_CONTEXT pContext = Control_Context_Get();
     
-    OS_EVENT_ID Event_Id;
-        
-    pUrb = (USBHST_URB *)OSS_CALLOC(sizeof(USBHST_URB));
+    *pReceived = 0;
     
-    if(NULL == pUrb)
+    if(pContext == NULL)
     {
-        #ifdef DEBUG
-        
-        logMsg("%s: OSS_CALLOC for pUrb failed.\n",__FUNCTION__,2,3,4,5,6);
-        
-        #endif
+        return USBHST_FAILURE;
+    }
+    
+    memset(&pContext->urb, 0, sizeof(USBHST_URB));
+    
+    USBHST_FILL_BULK_URB(&pContext->urb, pDevice->hDevice, pDevice->still_endpoint, pBuffer, uLength, USBHST_SHORT_TRANSFER_OK, Control_Completion_Callback, pContext, USBHST_SUCCESS);
+    
+    nStatus = usbHstURBSubmit(&pContext->urb);
+    
+    if(nStatus == USBHST_SUCCESS)
+    {
+        if(OS_WAIT_FOR_EVENT(pContext->eventId, STILL_TIMEOUT) != OK)
+        {
+            usbHstURBCancel(&pContext->urb);
+            OS_WAIT_FOR_EVENT(pContext->eventId, OS_WAIT_INFINITE);     /* The cancelled URB completes before the context is reused */
+        }
         
-        shutDown();
+        nStatus = pContext->urb.nStatus;
         
-        return ERROR;
+        if(nStatus == USBHST_SUCCESS)
+        {
+            *pReceived = pContext->urb.uTransferLength;
+        }
     }
     
-    memset(pUrb, 0, sizeof(USBHST_URB));
-    
-    Event_Id = OS_CREATE_EVENT(OS_EVENT_NON_SIGNALED);
+    Control_Context_Put(pContext);
     
     #ifdef DEBUG
     
-    logMsg("%s: Event id is %d\n",__FUNCTION__,Event_Id,3,4,5,6);
+    logMsg("%s: Still URB of %d bytes: status %d, received %d\n",__FUNCTION__,uLength,nStatus,*pReceived,5,6);
     
     #endif
+    
+    return nStatus;
+}
 
-    pUSBHST_ISO_PACKET_DESC pIsochronous_Packet_Descriptor;
-    pIsochronous_Packet_Descriptor = OSS_CALLOC((UINT32)NUMBER_OF_ISOCHRONOUS_PACKETS*(sizeof(USBHST_ISO_PACKET_DESC)));
+/*********************************************************************************************
+ * Function:     VOID Still_Deliver(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength,      *
+ *                                  pFRAME_INFO pInfo)                                       *
+ * Description:  Gives a complete still to the still sink. An MJPEG still is checked and     *
+ *               completed like a recorded frame (see Mjpeg_Complete_Frame()); other stills  *
+ *               are given as they were received. Stills that arrive without a sink are      *
+ *               dropped.                                                                    *
+ ********************************************************************************************/
+
+VOID Still_Deliver(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength, pFRAME_INFO pInfo)
+{
+    pUVC_FORMAT pFormat = Uvc_Find_Format(pDevice, pDevice->still_probe.bFormatIndex);
     
-    if(pIsochronous_Packet_Descriptor == NULL)
+    semTake(pDevice->sink_mutex, WAIT_FOREVER);     /* The sink and its context are changed together under it */
+    
+    if(pDevice->still_sink == NULL)
     {
+        semGive(pDevice->sink_mutex);
+        
         #ifdef DEBUG
         
-        logMsg("%s: OSS_CALLOC for pIsochronous_Packet_Descriptor failed.\n",__FUNCTION__,2,3,4,5,6);
+        logMsg("%s: Still of %d bytes dropped, there is no still sink.\n",__FUNCTION__,uLength,3,4,5,6);
         
         #endif
         
-        shutDown();
-        
-        return USBHST_FAILURE;
+        return;
     }
     
-    for(i = 0; i < NUMBER_OF_ISOCHRONOUS_PACKETS; i++)
+    pInfo->bStill = 1;
+    pInfo->uWidth  = 0;
+    pInfo->uHeight = 0;
+    
+    if((pFormat != NULL) && (pDevice->still_probe.bFrameIndex >= 1) && (pDevice->still_probe.bFrameIndex <= pFormat->num_still_sizes))
     {
-        pIsochronous_Packet_Descriptor[i].uLength = ISOCHRONOUS_BUFFER_SIZE;
-        pIsochronous_Packet_Descriptor[i].uOffset = ISOCHRONOUS_BUFFER_SIZE*(UINT32)i;
-        pIsochronous_Packet_Descriptor[i].nStatus = USBHST_SUCCESS;
+        pInfo->uWidth  = pFormat->still_width[pDevice->still_probe.bFrameIndex - 1];
+        pInfo->uHeight = pFormat->still_height[pDevice->still_probe.bFrameIndex - 1];
     }
-        
-    USBHST_FILL_ISOCHRONOUS_URB(pUrb, hDevice, uEndpointAddress, isotrans_buffer, ISOCHRONOUS_TRANSFER_LENGTH, uTransferFlags, 1, NUMBER_OF_ISOCHRONOUS_PACKETS, pIsochronous_Packet_Descriptor, Isochronous_Completion_Callback, Event_Id, USBHST_SUCCESS);
     
-    #ifdef DEBUG
+    pInfo->bDhtInserted = 0;
     
-    logMsg("%s:After filling the isochronous urb.\n Endpoint Address = %x\n no of packets = %d\n  Total length = %d\n ",__FUNCTION__, pUrb->uEndPointAddress, pUrb->uNumberOfPackets, pUrb->uTransferLength,5,6);
+    if((pDevice->format_subtype == UVC_VS_FORMAT_MJPEG) && (Mjpeg_Complete_Frame(pFrame, &uLength, &pInfo->bDhtInserted) != OK))
+    {
+        pDevice->damaged_frames++;
+        
+        semGive(pDevice->sink_mutex);
+        
+        return;
+    }
     
-    #endif
+    pInfo->uSequence = pDevice->stills_captured++;
     
-    nStatus = usbHstURBSubmit(pUrb);
-    if(nStatus == USBHST_SUCCESS)
-    {
-        #ifdef DEBUG
-            
-        logMsg("%s: usbHstUrbSubmit was successful\n",__FUNCTION__,2,3,4,5,6);
-            
-        #endif
-            
-        OS_WAIT_FOR_EVENT(Event_Id, OS_WAIT_INFINITE);
-            
-        nStatus = pUrb->nStatus;
-    }   
-    /*OSS_FREE(pUrb);
-    OS_DESTROY_EVENT(Event_Id);*/
+    pDevice->still_sink(pDevice->hDevice, pFrame, uLength, pInfo, pDevice->still_sink_context);
     
-    return nStatus;
+    semGive(pDevice->sink_mutex);
 }
 
 /********************************************************************
- * Function:      VOID processImage(const void *p, UINT32 size)     *
+ * Function:      VOID processImage(pUVC_DEVICE pDevice,            *
+ *                                  const void *p, UINT32 size)     *
  * Description:   This function takes in a buffer and the size of   *
  *                data to be processed as an input.                 *
  *                                                                  *
@@ -933,28 +5951,74 @@ USBHST_STATUS Isochronous_Transfer(UINT32 hDevice, UINT8 uEndpointAddress, UINT3
  *                format and calls the YUV2RGB function to convert  *
  *                the data to RGB format and then calls the         *
  *                dump_ppm function to save the data as a PPM image.*
+ *                                                                  *
+ *                An MJPEG frame is decoded to RGB by Jpeg_Decode() *
+ *                instead. A frame that does not decode to the      *
+ *                committed frame size is dropped. In passthrough   *
+ *                mode, it is handed to Mjpeg_Record_Frame().       *
+ *                A still image goes to Still_Deliver().            *
  *******************************************************************/
 
-VOID processImage(const void *p, UINT32 size)
+VOID processImage(pUVC_DEVICE pDevice, const void *p, UINT32 size)
 {
     UINT32 i = 0, newi = 0;
     INT16 y_temp = 0, y2_temp = 0, u_temp = 0, v_temp = 0;
     UCHAR *pptr = (UCHAR *)p;
     
+    if(pDevice->frame_info.bStill == 1)
+    {
+        Still_Deliver(pDevice, pptr, size, &pDevice->frame_info);
+        semGive(pDevice->synch_sem);
+        
+        return;
+    }
+    
+    if((pDevice->format_subtype == UVC_VS_FORMAT_MJPEG) && (pDevice->passthrough == 1))
+    {
+        Mjpeg_Record_Frame(pDevice, pptr, size);
+        
+        return;
+    }
+    
+    if(pDevice->format_subtype == UVC_VS_FORMAT_MJPEG)
+    {
+        if((Stream_Alloc_Rgb_Buffer(pDevice) != OK) || (Jpeg_Decode(pDevice->jpeg_decoder, pptr, size, (UCHAR *)pDevice->bigBuffer, pDevice->rgb_buffer_size) != OK) ||
+           (pDevice->jpeg_decoder->width != pDevice->frame_width) || (pDevice->jpeg_decoder->height != pDevice->frame_height))
+        {
+            #ifdef DEBUG
+            
+            logMsg("%s: MJPEG frame of %d bytes dropped.\n",__FUNCTION__,size,3,4,5,6);
+            
+            #endif
+            
+            pDevice->damaged_frames++;
+            semGive(pDevice->synch_sem);        /* dump_ppm() will not run for this frame */
+            
+            return;
+        }
+        
+        dump_ppm(pDevice, pDevice->bigBuffer, (UINT32)pDevice->frame_width * pDevice->frame_height * 3, pDevice->frameCount);
+        
+        stop_timer(pDevice);
+        start_timer(pDevice);     /* For the next frame */
+        
+        return;
+    }
+    
     for(i = 0, newi = 0; i < size; i += 4, newi += 6)
     {
         y_temp  = (int)pptr[i];
         u_temp  = (int)pptr[i + 1];
         y2_temp = (int)pptr[i + 2];
         v_temp  = (int)pptr[i + 3];
-        YUV2RGB(y_temp, u_temp, v_temp, &bigBuffer[newi], &bigBuffer[newi + 1], &bigBuffer[newi + 2]);
-        YUV2RGB(y2_temp, u_temp, v_temp, &bigBuffer[newi + 3], &bigBuffer[newi + 4], &bigBuffer[newi + 5]);
+        YUV2RGB(y_temp, u_temp, v_temp, &pDevice->bigBuffer[newi], &pDevice->bigBuffer[newi + 1], &pDevice->bigBuffer[newi + 2]);
+        YUV2RGB(y2_temp, u_temp, v_temp, &pDevice->bigBuffer[newi + 3], &pDevice->bigBuffer[newi + 4], &pDevice->bigBuffer[newi + 5]);
     }   
     
-    dump_ppm(bigBuffer, (UINT32)((size*6)/4), frameCount);
+    dump_ppm(pDevice, pDevice->bigBuffer, (UINT32)((size*6)/4), pDevice->frameCount);
     
-    stop_timer();
-    start_timer();     /* For the next frame */
+    stop_timer(pDevice);
+    start_timer(pDevice);     /* For the next frame */
 }
 
 /*****************************************************************************
@@ -1017,20 +6081,24 @@ VOID YUV2RGB(int y, int u, int v, char *r, char *g, char *b)
 }
 
 /*************************************************************************
- * Function:    VOID dump_ppm(char *p, UINT32 size, UINT16 tag)          *
+ * Function:    VOID dump_ppm(pUVC_DEVICE pDevice, char *p, UINT32 size,  *
+ *                              UINT16 tag)                              *
  * Description: This function takes the RGB data as an input and creates *
- *              a ppm image file using that data.                        *
+ *              a ppm image file using that data. Files are named after  *
+ *              the camera index so several cameras can dump at once.    *
  ************************************************************************/
 
-VOID dump_ppm(char *p, UINT32 size, UINT16 tag)
+VOID dump_ppm(pUVC_DEVICE pDevice, char *p, UINT32 size, UINT16 tag)
 {
     UINT32 written = 0, total = 0, dumpfd = 0;
+    char ppm_dumpname[PPM_NAME_LENGTH];
+    char ppm_header[PPM_HEADER_LENGTH];
     
-    snprintf(&ppm_dumpname[12], 9, "%08d", tag);
-    strncat(&ppm_dumpname[20], ".ppm", 5);
+    snprintf(ppm_dumpname, sizeof(ppm_dumpname), "/tgtsvr/cam%d_%08d.ppm", pDevice->uIndex, tag);
     dumpfd = open(ppm_dumpname, O_CREAT | O_RDWR, 0666);
     
-    written = write(dumpfd, new_header, 21);
+    snprintf(ppm_header, sizeof(ppm_header), "P6\n#test\n%d %d\n255\n", pDevice->frame_width, pDevice->frame_height);
+    written = write(dumpfd, ppm_header, strlen(ppm_header));
     
     total = 0;
     
@@ -1040,9 +6108,124 @@ VOID dump_ppm(char *p, UINT32 size, UINT16 tag)
         total += written;
     }while(total < size);
     
-    semGive(synch_sem);
+    semGive(pDevice->synch_sem);
     
     close(dumpfd);
 
     return;
 }
+
+/*********************************************************************************************
+ * Function:     VOID Mjpeg_Record_Frame(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength) *
+ * Description:  Records an MJPEG frame as it is, once Mjpeg_Complete_Frame() has made it a  *
+ *               complete JPEG file. The frame is then given to the sink of the camera, or   *
+ *               written out by dump_jpeg(). pFrame is the buffer Stream_End_Frame() handed  *
+ *               to the image task, so it is trimmed and completed in place while the next   *
+ *               frame is assembled in the other buffer; it goes back to the stream with     *
+ *               synch_sem, after the sink has returned.                                     *
+ ********************************************************************************************/
+
+VOID Mjpeg_Record_Frame(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength)
+{
+    if(Mjpeg_Complete_Frame(pFrame, &uLength, &pDevice->frame_info.bDhtInserted) != OK)
+    {
+        #ifdef DEBUG
+        
+        logMsg("%s: MJPEG frame of %d bytes without SOI or EOI dropped.\n",__FUNCTION__,uLength,3,4,5,6);
+        
+        #endif
+        
+        pDevice->damaged_frames++;
+        semGive(pDevice->synch_sem);
+        
+        return;
+    }
+    
+    pDevice->frame_info.uSequence = pDevice->frames_recorded++;
+    pDevice->frame_info.uWidth    = pDevice->frame_width;
+    pDevice->frame_info.uHeight   = pDevice->frame_height;
+    
+    semTake(pDevice->sink_mutex, WAIT_FOREVER);     /* Stream_Set_Passthrough() changes the sink and its context together */
+    
+    if(pDevice->frame_sink != NULL)
+    {
+        pDevice->frame_sink(pDevice->hDevice, pFrame, uLength, &pDevice->frame_info, pDevice->frame_sink_context);
+    }
+    else
+    {
+        dump_jpeg(pDevice, pFrame, uLength, pDevice->frameCount);
+    }
+    
+    semGive(pDevice->sink_mutex);
+    
+    semGive(pDevice->synch_sem);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Mjpeg_Complete_Frame(UCHAR *pFrame, UINT32 *pLength,                 *
+ *                                           UINT8 *pDhtInserted)                            *
+ * Description:  Checks that an MJPEG frame starts with SOI and ends with EOI, and cuts off  *
+ *               padding after EOI. A frame without a DHT segment gets the standard tables   *
+ *               inserted before SOS, in the JPEG_DHT_SEGMENT_LENGTH bytes its buffer keeps  *
+ *               after the largest frame, so that it is a complete JPEG file. Returns ERROR  *
+ *               for a frame without SOI or EOI.                                             *
+ ********************************************************************************************/
+
+STATUS Mjpeg_Complete_Frame(UCHAR *pFrame, UINT32 *pLength, UINT8 *pDhtInserted)
+{
+    UINT32 uSosOffset = 0;
+    UINT8 bHasDht = 0;
+    
+    *pDhtInserted = 0;
+    
+    if(Jpeg_Check_Frame(pFrame, pLength, &uSosOffset, &bHasDht) != OK)
+    {
+        return ERROR;
+    }
+    
+    if(bHasDht == 0)
+    {
+        memmove(pFrame + uSosOffset + JPEG_DHT_SEGMENT_LENGTH, pFrame + uSosOffset, *pLength - uSosOffset);
+        *pLength += Jpeg_Build_Dht_Segment(pFrame + uSosOffset);
+        
+        *pDhtInserted = 1;
+    }
+    
+    return OK;
+}
+
+/*************************************************************************
+ * Function:    VOID dump_jpeg(pUVC_DEVICE pDevice, const UCHAR *p,      *
+ *                             UINT32 size, UINT16 tag)                  *
+ * Description: Writes a recorded MJPEG frame to a JPEG file, named like *
+ *              the files of dump_ppm().                                 *
+ ************************************************************************/
+
+VOID dump_jpeg(pUVC_DEVICE pDevice, const UCHAR *p, UINT32 size, UINT16 tag)
+{
+    int written = 0, dumpfd = 0;
+    UINT32 total = 0;
+    char jpeg_dumpname[JPEG_NAME_LENGTH];
+    
+    snprintf(jpeg_dumpname, sizeof(jpeg_dumpname), "/tgtsvr/cam%d_%08d.jpg", pDevice->uIndex, tag);
+    dumpfd = open(jpeg_dumpname, O_CREAT | O_RDWR, 0666);
+    
+    if(dumpfd < 0)
+    {
+        return;
+    }
+    
+    while(total < size)
+    {
+        written = write(dumpfd, (char *)(p + total), size - total);
+        
+        if(written <= 0)
+        {
+            break;
+        }
+        
+        total += written;
+    }
+    
+    close(dumpfd);
+}
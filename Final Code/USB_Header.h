@@ -20,45 +20,592 @@
 
 #define USB_DIRECTION_OUT                               0x21
 #define USB_DIRECTION_IN                                0xA1
+#define USB_DIRECTION_MASK                              0x80                /* Bit 7 of bmRequestType is set for device-to-host requests */
 #define USB_SET_CURRENT                                 0x01
 #define USB_GET_CURRENT                                 0x81
-#define USB_SETUP_PACKET_INDEX                          0x01
+#define USB_GET_MINIMUM                                 0x82
+#define USB_GET_MAXIMUM                                 0x83
+#define USB_GET_RESOLUTION                              0x84
+#define USB_GET_DEFAULT                                 0x87
 #define CONTROL_TRANSFER_ENDPOINT                       0x00
 #define UVC_VS_PROBE_CONTROL                            0x100   
 #define UVC_VS_COMMIT_CONTROL                           0x200
-#define dwFrameInterval                                 0x01
-#define UNCOMPRESSED_FRAMES                             0x00
-#define RESOLUTION                                      0x02                /* 0x02 - 160x120 resolution; 0x04 - 320x240 resolution */
+#define UVC_VS_STILL_PROBE_CONTROL                      0x300
+#define UVC_VS_STILL_COMMIT_CONTROL                     0x400
+#define UVC_VS_STILL_IMAGE_TRIGGER_CONTROL              0x500
 #define NO                                              0x00
+#define CONTROL_POOL_SIZE                               4                   /* Number of preallocated control contexts */
+#define CONTROL_BUFFER_SIZE                             64                  /* Large enough for the probe/commit structure of any UVC revision */
+#define CONTROL_TIMEOUT                                 2000                /* Ticks a control transfer may take before it is cancelled (2 s at the rate set in initialize_timer()) */
 
 /************ Isochronous Transfer related macros ***********/
 
-#define ISOCHRONOUS_TRANSFER_ENDPOINT_INTERFACE_1       0x81
-#define NUMBER_OF_ISOCHRONOUS_PACKETS                   12
-#define HEADER_LENGTH                                   12
-#define ISOCHRONOUS_BUFFER_SIZE                         944
-#define ISOCHRONOUS_TRANSFER_LENGTH                     11328               /*944*12 */
+#define NUMBER_OF_ISOCHRONOUS_PACKETS                   16                  /* A multiple of 8, so that a URB covers whole frames at high speed */
+#define HEADER_FID_BIT                                  0x01                /* bmHeaderInfo: frame ID, toggles at every new frame */
+#define HEADER_EOF_BIT                                  0x02                /* bmHeaderInfo: the payload ends a frame */
+#define HEADER_PTS_BIT                                  0x04                /* bmHeaderInfo: dwPresentationTime follows bmHeaderInfo */
+#define HEADER_PTS_OFFSET                               2
+#define HEADER_STI_BIT                                  0x20                /* bmHeaderInfo: the payload belongs to a still image */
+#define HEADER_ERR_BIT                                  0x40                /* bmHeaderInfo: the camera had an error with this payload */
+#define PAYLOAD_HEADER_MAX_LENGTH                       12                  /* Payload header with PTS and SCR */
+#define MAX_URB_RETRIES                                 3                   /* Consecutive failed completions of a URB before the stream is recovered */
+#define MAX_STREAM_RECOVERIES                           5                   /* Recoveries without a good frame in between before giving up */
+#define BULK_MAX_TRANSFER_SIZE                          0x8000              /* Largest bulk URB; larger payloads span several URBs */
+#define ISO_SCHEDULE_ASAP                               0                   /* Every URB is started as soon as possible by the host controller */
+#define ISO_SCHEDULE_EXPLICIT                           1                   /* Every URB starts in the frame right after the previous one */
+#define ISO_SCHEDULE_DEFAULT                            ISO_SCHEDULE_EXPLICIT
+#define ISO_SCHEDULE_MARGIN                             2                   /* Frames ahead of the current frame a stream (re)starts its schedule */
+#define FRAME_NUMBER_MASK                               0x7FF               /* Frame numbers are 11 bits wide and wrap around */
+#define MICROFRAMES_PER_FRAME                           8
 #define NO_OF_TRANSFERS                                 5
-#define HRES                                            160
+#define HRES                                            160                 /* Frame size used if the camera has no frame descriptors */
 #define VRES                                            120
+#define STREAM_EVENT_STARTED                            0x01                /* All URBs of the stream have been submitted */
+#define STREAM_EVENT_FIRST_FRAME                        0x02                /* The first complete frame has been received */
+#define STREAM_EVENT_STOPPED                            0x03                /* All URBs have completed and the stream resources are released */
+#define STREAM_EVENT_DEGRADED                           0x04                /* The stream was moved to a smaller alternate setting or lower frame rate */
+#define STREAM_EVENT_FAILED                             0x05                /* The stream could not be started at any setting */
+#define STREAM_EVENT_SUSPENDED                          0x06                /* The stream was parked for a bus suspend */
+#define STREAM_EVENT_RESUMED                            0x07                /* The parked stream was restarted after a resume */
+#define STREAM_EVENT_RECOVERED                          0x08                /* The stream was restarted after URB errors or a stall */
+#define STREAM_EVENT_NO_BANDWIDTH                       0x09                /* The bandwidth manager could not give the camera any alternate setting */
+#define STREAM_EVENT_MODE_CHANGED                       0x0A                /* Stream_Set_Mode() committed a new format, frame size or frame interval */
+#define STREAM_EVENT_READY                              0x0B                /* The bring-up of a newly attached camera has finished */
+#define STREAM_DRAIN_TIMEOUT                            500                 /* Ticks to wait for cancelled URBs (500 ms at the rate set in initialize_timer()) */
+
+/************ Descriptor related macros *******************/
+
+#define CONFIG_DESCRIPTOR_HEADER_LENGTH                 9
+#define DEVICE_DESCRIPTOR_LENGTH                        18
+#define STRING_DESCRIPTOR_MAX_LENGTH                    64
+#define LANGUAGE_ID_ENGLISH_US                          0x0409
+#define DESCRIPTOR_TYPE_INTERFACE                       0x04
+#define DESCRIPTOR_TYPE_ENDPOINT                        0x05
+#define DESCRIPTOR_TYPE_CS_INTERFACE                    0x24
+#define UVC_CLASS_VIDEO                                 0x0E
+#define UVC_SUBCLASS_VIDEOCONTROL                       0x01
+#define UVC_SUBCLASS_VIDEOSTREAMING                     0x02
+#define UVC_VC_HEADER                                   0x01                /* bDescriptorSubtype of the class specific VC interface header */
+#define UVC_VC_INPUT_TERMINAL                           0x02
+#define UVC_VC_PROCESSING_UNIT                          0x05
+#define UVC_ITT_CAMERA                                  0x0201              /* wTerminalType of the camera terminal */
+#define UVC_VERSION_1_1                                 0x0110              /* bcdUVC */
+#define UVC_VERSION_1_5                                 0x0150
+#define UVC_VS_INPUT_HEADER                             0x01                /* bDescriptorSubtype of the class specific VS interface descriptors */
+#define UVC_VS_STILL_IMAGE_FRAME                        0x03
+#define UVC_VS_FORMAT_UNCOMPRESSED                      0x04
+#define UVC_VS_FRAME_UNCOMPRESSED                       0x05
+#define UVC_VS_FORMAT_MJPEG                             0x06
+#define UVC_VS_FRAME_MJPEG                              0x07
+#define UVC_VS_FORMAT_FRAME_BASED                       0x10
+#define UVC_VS_FRAME_FRAME_BASED                        0x11
+#define UVC_GUID_LENGTH                                 16
+#define MAX_FORMATS                                     4                   /* Formats kept in the capability table of a camera */
+#define MAX_FRAMES_PER_FORMAT                           12                  /* Frame sizes kept per format */
+#define MAX_FRAME_INTERVALS                             8                   /* Discrete frame intervals kept per frame size */
+#define MAX_STILL_SIZES                                 8                   /* Still image sizes kept per format */
+#define ENDPOINT_TRANSFER_TYPE_MASK                     0x03
+#define ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS              0x01
+#define ENDPOINT_TRANSFER_TYPE_BULK                     0x02
+#define ENDPOINT_DIRECTION_IN                           0x80                /* Bit 7 of bEndpointAddress is set for IN endpoints */
+#define ENDPOINT_MAX_PACKET_SIZE_MASK                   0x07FF              /* Bits 10..0 of wMaxPacketSize */
+#define ENDPOINT_TRANSACTIONS_MASK                      0x1800              /* Bits 12..11 of wMaxPacketSize: additional transactions per microframe */
+#define ENDPOINT_TRANSACTIONS_SHIFT                     11
+#define MAX_ALT_SETTINGS                                16
+
+#define GET_LE16(p)                                     ((UINT16)((p)[0] | ((p)[1] << 8)))
+#define GET_LE32(p)                                     ((UINT32)((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((UINT32)(p)[3] << 24)))
+#define SET_LE16(p, v)                                  do { (p)[0] = (UCHAR)(v); (p)[1] = (UCHAR)((v) >> 8); } while(0)
+#define SET_LE32(p, v)                                  do { (p)[0] = (UCHAR)(v); (p)[1] = (UCHAR)((v) >> 8); (p)[2] = (UCHAR)((v) >> 16); (p)[3] = (UCHAR)((v) >> 24); } while(0)
+
+/************ Probe/commit related macros *******************/
+
+#define PROBE_LENGTH_UVC10                              26                  /* Length of the probe/commit structure for bcdUVC 1.0 */
+#define PROBE_LENGTH_UVC11                              34                  /* bcdUVC 1.1 adds the clock and framing fields */
+#define PROBE_LENGTH_UVC15                              48                  /* bcdUVC 1.5 adds the encoder fields (kept as the camera sends them) */
+#define PROBE_MAX_LENGTH                                PROBE_LENGTH_UVC15
+#define PROBE_HINT_FRAME_INTERVAL                       0x0001              /* bmHint: keep dwFrameInterval fixed */
+#define PROBE_HINT_OFFSET                               0                   /* Offsets of the fields in the probe/commit structure */
+#define PROBE_FORMAT_INDEX_OFFSET                       2
+#define PROBE_FRAME_INDEX_OFFSET                        3
+#define PROBE_FRAME_INTERVAL_OFFSET                     4
+#define PROBE_KEY_FRAME_RATE_OFFSET                     8
+#define PROBE_P_FRAME_RATE_OFFSET                       10
+#define PROBE_COMP_QUALITY_OFFSET                       12
+#define PROBE_COMP_WINDOW_SIZE_OFFSET                   14
+#define PROBE_DELAY_OFFSET                              16
+#define PROBE_MAX_VIDEO_FRAME_SIZE_OFFSET               18
+#define PROBE_MAX_PAYLOAD_TRANSFER_SIZE_OFFSET          22
+#define PROBE_CLOCK_FREQUENCY_OFFSET                    26                  /* UVC 1.1 and later */
+#define PROBE_FRAMING_INFO_OFFSET                       30
+#define PROBE_PREFERED_VERSION_OFFSET                   31
+#define PROBE_MIN_VERSION_OFFSET                        32
+#define PROBE_MAX_VERSION_OFFSET                        33
+
+/************ Still image related macros *******************/
+
+#define STILL_PROBE_LENGTH                              11                  /* Length of the still probe/commit structure */
+#define STILL_PROBE_FORMAT_INDEX_OFFSET                 0                   /* Offsets of the fields in the still probe/commit structure */
+#define STILL_PROBE_FRAME_INDEX_OFFSET                  1
+#define STILL_PROBE_COMPRESSION_INDEX_OFFSET            2
+#define STILL_PROBE_MAX_VIDEO_FRAME_SIZE_OFFSET         3
+#define STILL_PROBE_MAX_PAYLOAD_TRANSFER_SIZE_OFFSET    7
+#define STILL_METHOD_NONE                               0                   /* bStillCaptureMethod of the VS input header */
+#define STILL_METHOD_STREAM                             2                   /* Method 2: the still is sent on the video pipe, marked by HEADER_STI_BIT */
+#define STILL_METHOD_BULK                               3                   /* Method 3: the still is read from a bulk endpoint of its own */
+#define STILL_TRIGGER_NORMAL                            0                   /* VS_STILL_IMAGE_TRIGGER_CONTROL values */
+#define STILL_TRIGGER_TRANSMIT                          1
+#define STILL_TRIGGER_TRANSMIT_BULK                     2
+#define STILL_TRIGGER_ABORT                             3
+#define STILL_TIMEOUT                                   1000                /* Ticks to wait for each URB of a method 3 still (1 s at the rate set in initialize_timer()) */
+
+/************ Adaptive streaming related macros *************/
+
+#define ADAPTIVE_MODE_DEFAULT                           1                   /* 1 - step down instead of failing when bandwidth is short */
+#define MAX_FRAME_INTERVAL                              2000000             /* Longest frame interval the downshift will request (5 fps, in 100 ns units) */
+#define ERROR_RATE_WINDOW                               960                 /* Packets over which the packet error rate is measured */
+#define ERROR_RATE_THRESHOLD                            10                  /* Percentage of bad packets in a window that triggers a downshift */
+#define SERVICE_QUEUE_LENGTH                            8
+#define SERVICE_TASK_PRIORITY                           60
+#define SERVICE_TASK_STACK_SIZE                         8192
+#define SERVICE_DOWNSHIFT                               0x01                /* Service task command: step the stream down one level */
+#define SERVICE_RESUME                                  0x02                /* Service task command: restart the stream parked at suspend */
+#define SERVICE_RECOVER                                 0x03                /* Service task command: restart the stream after URB errors or a stall */
+#define SERVICE_ATTACH                                  0x04                /* Service task command: run the next step of the bring-up of a new camera */
+#define SERVICE_SUSPEND                                 0x05                /* Service task command: park the stream for a bus suspend */
+#define SERVICE_EXIT                                    0xFF                /* Service task command: the device is being destroyed */
+#define BATCH_MODE_DEFAULT                              0                   /* 1 - completed URBs are processed in batches by the batch task */
+#define BATCH_RING_SIZE                                 8                   /* Power of two, at least NO_OF_TRANSFERS */
+#define BATCH_TASK_PRIORITY                             55
+#define BATCH_TASK_STACK_SIZE                           8192
+
+/************ Attach related macros ***********************/
+
+#define ATTACH_STATE_CONFIGURE                          0                   /* Bring-up steps, run in this order by Attach_Step() */
+#define ATTACH_STATE_DESCRIPTORS                        1                   /* Read the descriptors and build the capability table */
+#define ATTACH_STATE_NEGOTIATE                          2                   /* Probe/commit, or the commit remembered in the reattach cache */
+#define ATTACH_STATE_START                              3                   /* Select the alternate setting, prepare the pipe and start the stream */
+#define ATTACH_STATE_READY                              4
+#define ATTACH_STATE_FAILED                             5
+#define ATTACH_STEP_RETRIES                             3                   /* Attempts of each step before the bring-up is given up */
+#define ATTACH_RETRY_DELAY                              100                 /* Ticks between two attempts of a step */
+
+/************ Camera control related macros ***************/
+
+#define UVC_ENTITY_CAMERA_TERMINAL                      0                   /* Entity a control request is addressed to */
+#define UVC_ENTITY_PROCESSING_UNIT                      1
+#define UVC_CT_AE_MODE                                  0x02                /* Camera terminal control selectors */
+#define UVC_CT_EXPOSURE_TIME_ABSOLUTE                   0x04
+#define UVC_CT_FOCUS_ABSOLUTE                           0x06
+#define UVC_CT_FOCUS_AUTO                               0x08
+#define UVC_PU_BRIGHTNESS                               0x02                /* Processing unit control selectors */
+#define UVC_PU_CONTRAST                                 0x03
+#define UVC_PU_GAIN                                     0x04
+#define UVC_PU_WHITE_BALANCE_TEMPERATURE                0x0A
+#define UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO           0x0B
+#define CONTROL_VALUE_MAX_LENGTH                        4                   /* Longest control value the queue carries (bytes) */
+#define CONTROL_QUEUE_LENGTH                            16                  /* Control requests waiting per camera */
+#define CONTROL_TASK_PRIORITY                           65                  /* Below the service task, so controls never hold up the stream */
+#define CONTROL_TASK_STACK_SIZE                         4096
+
+/************ Quirk related macros *************************/
+
+#define QUIRK_NONE                                      0x00000000
+#define QUIRK_PROBE_EXTRAFIELDS                         0x00000001          /* UVC 1.0 camera that wants the 34 byte UVC 1.1 probe/commit structure */
+#define QUIRK_FIX_BANDWIDTH                             0x00000002          /* dwMaxPayloadTransferSize is too large; compute it from the frame size and rate */
+#define QUIRK_FIX_FRAME_SIZE                            0x00000004          /* dwMaxVideoFrameSize is wrong; compute it from the frame size */
+#define QUIRK_STREAM_NO_FID                             0x00000008          /* FID does not toggle; frames end at the EOF bit instead */
+#define QUIRK_DEFAULT_BITS_PER_PIXEL                    16                  /* For FIX_BANDWIDTH/FIX_FRAME_SIZE when the format does not say */
+
+/************ Reattach cache related macros ****************/
+
+#define REATTACH_CACHE_SIZE                             8                   /* Cameras whose negotiated configuration is remembered */
+#define SERIAL_NUMBER_LENGTH                            32                  /* Serial number characters kept (ASCII, NUL terminated) */
+#define FNV_OFFSET_BASIS                                2166136261UL        /* 32 bit FNV-1a hash of the configuration descriptor */
+#define FNV_PRIME                                       16777619UL
+
+/************ Bandwidth manager related macros **************/
+
+/* The device handles of the host stack do not tell which host controller a device is on, so every camera is put on
+ * bus 0 and cameras on different host controllers share one budget; they get less bandwidth than they could. A BSP
+ * that knows how its handles map to controllers should replace USB_BUS_INDEX() with that mapping. */
+
+#define USB_BUS_INDEX(hDevice)                          0                   /* Host controller of a device (see above) */
+#define BANDWIDTH_HIGH_SPEED_BYTES                      7500                /* Bytes a microframe can carry at 480 Mbit/s */
+#define BANDWIDTH_FULL_SPEED_BYTES                      1500                /* Bytes a frame can carry at 12 Mbit/s */
+#define BANDWIDTH_BUDGET_PERMILLE                       750                 /* Share of the bus given to cameras: the 80% periodic limit less a reserve for hubs and HID devices */
+#define BANDWIDTH_PRIORITY_DEFAULT                      100                 /* Higher values are served first */
 
 /************************* Other Macros *********************/
 
-#define INTERFACE                                       1
-#define ALTERNATE_INTERFACE                             6
+#define INTERFACE                                       1                   /* Used if the configuration descriptor has no video streaming interface */
+#define MAX_CAMERAS                                     8                   /* Number of cameras that can be attached at the same time */
+#define TASK_NAME_LENGTH                                16
+#define PPM_NAME_LENGTH                                 32                  /* "/tgtsvr/camN_NNNNNNNN.ppm" */
+#define JPEG_NAME_LENGTH                                32                  /* "/tgtsvr/camN_NNNNNNNN.jpg", written for recorded MJPEG frames */
+#define PPM_HEADER_LENGTH                               32                  /* "P6\n#test\nWWWWW HHHHH\n255\n" */
+#define IMAGE_TASK_PRIORITY                             51
+#define IMAGE_TASK_STACK_SIZE                           6000
 #define FRAME_COUNT                                     500
-#define FPS_30_DATA_4                                   0b00010101          /* LSB */
-#define FPS_30_DATA_5                                   0b00010110          /* The value of the 3 byte integer equals (1/frame rate) in multiples of 100 ns */
-#define FPS_30_DATA_6                                   0b00000101          /* MSB */
-#define FPS_15_DATA_4                                   0b00101010
-#define FPS_15_DATA_5                                   0b00101100
-#define FPS_15_DATA_6                                   0b00001010
-#define FPS_10_DATA_4                                   0b01000000
-#define FPS_10_DATA_5                                   0b01000010
-#define FPS_10_DATA_6                                   0b00001111
-#define FPS_05_DATA_4                                   0b10000000
-#define FPS_05_DATA_5                                   0b10000100
-#define FPS_05_DATA_6                                   0b00011110
+#define FRAME_INTERVAL_UNITS_PER_SECOND                 10000000            /* dwFrameInterval is in multiples of 100 ns */
+#define FRAME_INTERVAL_30_FPS                           333333
+#define FRAME_INTERVAL_15_FPS                           666666
+#define FRAME_INTERVAL_10_FPS                           1000000
+#define FRAME_INTERVAL_5_FPS                            2000000
+#define DEFAULT_FRAME_INTERVAL                          FRAME_INTERVAL_15_FPS   /* Requested at attach time */
+
+/************************************************************
+ *                                                          *
+ *                          STRUCTURES                      *
+ *                                                          *
+ ***********************************************************/
+
+/* A control context holds everything a single control transfer needs. The contexts are allocated once in
+ * Control_Pool_Init() and handed out by Control_Context_Get(), so no memory or event is created per transfer. */
+
+typedef struct control_context
+{
+    USBHST_URB                  urb;                            /* URB reused for every transfer made through this context */
+    USBHST_SETUP_PACKET         setupPacket;                    /* Setup packet reused for every transfer */
+    OS_EVENT_ID                 eventId;                        /* Released by Control_Completion_Callback() */
+    UCHAR                       buffer[CONTROL_BUFFER_SIZE];    /* Data stage buffer */
+    struct control_context      *pNext;                         /* Link in the free list */
+} CONTROL_CONTEXT, *pCONTROL_CONTEXT;
+
+/* One frame size of a format, from a VS_FRAME_* descriptor. bFrameIntervalType is the number of discrete intervals
+ * in intervals[] (at most MAX_FRAME_INTERVALS are kept), or 0 if the camera supports a continuous range, in which case
+ * intervals[] holds the minimum, maximum and step. All intervals are in 100 ns units. */
+
+typedef struct uvc_frame
+{
+    UINT8                       bFrameIndex;
+    UINT16                      wWidth;
+    UINT16                      wHeight;
+    UINT32                      dwMaxVideoFrameBufferSize;      /* 0 for frame based formats, which do not report it */
+    UINT32                      dwDefaultFrameInterval;
+    UINT8                       bFrameIntervalType;
+    UINT8                       num_intervals;                  /* Entries used in intervals[] */
+    UINT32                      intervals[MAX_FRAME_INTERVALS];
+} UVC_FRAME, *pUVC_FRAME;
+
+/* One format of the video streaming interface, from a VS_FORMAT_* descriptor, with the frame sizes that follow it */
+
+typedef struct uvc_format
+{
+    UINT8                       bFormatIndex;
+    UINT8                       bDescriptorSubtype;             /* UVC_VS_FORMAT_UNCOMPRESSED, UVC_VS_FORMAT_MJPEG or UVC_VS_FORMAT_FRAME_BASED */
+    UCHAR                       guidFormat[UVC_GUID_LENGTH];    /* Zero for MJPEG */
+    UINT8                       bBitsPerPixel;                  /* Zero for MJPEG */
+    UINT8                       bDefaultFrameIndex;
+    UINT8                       num_frames;
+    UVC_FRAME                   frames[MAX_FRAMES_PER_FORMAT];
+    UINT8                       num_still_sizes;                /* From the VS_STILL_IMAGE_FRAME descriptor, 0 if the format has none */
+    UINT16                      still_width[MAX_STILL_SIZES];   /* Still size n is probed as bFrameIndex n + 1 */
+    UINT16                      still_height[MAX_STILL_SIZES];
+    UINT8                       num_still_compressions;         /* bNumCompressionPattern; a still is probed with compression 1 if there is any */
+} UVC_FORMAT, *pUVC_FORMAT;
+
+/* The probe/commit structure in host byte order. Probe_Serialize() and Probe_Parse() convert it to and from the
+ * little endian layout exchanged with the camera. The UVC 1.1 fields are zero for a UVC 1.0 camera. */
+
+typedef struct uvc_probe
+{
+    UINT16                      bmHint;                         /* PROBE_HINT_* bits: fields the camera must keep fixed */
+    UINT8                       bFormatIndex;
+    UINT8                       bFrameIndex;
+    UINT32                      dwFrameInterval;                /* In 100 ns units */
+    UINT16                      wKeyFrameRate;
+    UINT16                      wPFrameRate;
+    UINT16                      wCompQuality;
+    UINT16                      wCompWindowSize;
+    UINT16                      wDelay;                         /* Latency of the camera in ms */
+    UINT32                      dwMaxVideoFrameSize;            /* Bytes of the largest frame; sizes image_buffer */
+    UINT32                      dwMaxPayloadTransferSize;       /* Bytes of the largest payload; selects the alternate setting */
+    UINT32                      dwClockFrequency;               /* UVC 1.1: frequency of the timestamps in the payload headers */
+    UINT8                       bmFramingInfo;
+    UINT8                       bPreferedVersion;
+    UINT8                       bMinVersion;
+    UINT8                       bMaxVersion;
+} UVC_PROBE, *pUVC_PROBE;
+
+/* The still probe/commit structure in host byte order */
+
+typedef struct uvc_still_probe
+{
+    UINT8                       bFormatIndex;                   /* Always the format of the video stream */
+    UINT8                       bFrameIndex;                    /* Still size of the format, starting at 1 */
+    UINT8                       bCompressionIndex;
+    UINT32                      dwMaxVideoFrameSize;            /* Bytes of the largest still */
+    UINT32                      dwMaxPayloadTransferSize;
+} UVC_STILL_PROBE, *pUVC_STILL_PROBE;
+
+/* One transfer of the stream. Every transfer owns its URB, packet descriptors and data buffer, so all NO_OF_TRANSFERS
+ * URBs can be in flight at the same time without overwriting each other's data. Bulk transfers have no packet
+ * descriptors. */
+
+typedef struct iso_transfer
+{
+    USBHST_URB                  urb;                            /* URB resubmitted by the completion callback */
+    pUSBHST_ISO_PACKET_DESC     pPacketDesc;                    /* NUMBER_OF_ISOCHRONOUS_PACKETS packet descriptors (isochronous only) */
+    UCHAR                       *pBuffer;                       /* NUMBER_OF_ISOCHRONOUS_PACKETS packets of iso_packet_size bytes, or bulk_transfer_size bytes */
+    UINT8                       bSubmitted;                     /* Set while the URB is owned by the host stack */
+    UINT8                       uRetries;                       /* Consecutive failed completions of the URB */
+    struct uvc_device           *pDevice;                       /* Camera the transfer belongs to */
+} ISO_TRANSFER, *pISO_TRANSFER;
+
+/* One alternate setting of the video streaming interface with a streaming endpoint, as found in the configuration
+ * descriptor. A camera streaming over bulk has a single entry for the bulk endpoint of alternate setting 0. */
+
+typedef struct alt_setting
+{
+    UINT8                       bAlternateSetting;
+    UINT8                       bEndpointAddress;
+    UINT16                      wMaxPacketSize;                 /* Bytes per transaction (bits 10..0 of the descriptor field) */
+    UINT8                       bTransactions;                  /* Transactions per microframe: 1, or 2..3 for high-bandwidth endpoints */
+    UINT32                      uBytesPerInterval;              /* wMaxPacketSize * bTransactions; the size of one isochronous packet */
+    UINT8                       bInterval;
+    UINT8                       bTransferType;                  /* ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS or ENDPOINT_TRANSFER_TYPE_BULK */
+} ALT_SETTING, *pALT_SETTING;
+
+/* Message sent to Stream_Service_Task() by code that runs in the USB completion context and cannot issue control
+ * transfers itself. */
+
+typedef struct service_msg
+{
+    UINT32                      uCommand;                       /* One of the SERVICE_* values */
+    UINT32                      uParam;
+} SERVICE_MSG;
+
+/* Overrides for one camera model that deviates from the UVC specification or needs a particular mode. The
+ * bFormatIndex, bFrameIndex and dwFrameInterval fields replace the mode chosen from the capability table when they are
+ * not zero. Cameras without an entry run on the generic path. */
+
+typedef struct uvc_quirk
+{
+    UINT16                      idVendor;
+    UINT16                      idProduct;
+    UINT32                      uFlags;                         /* QUIRK_* bits */
+    UINT8                       bFormatIndex;
+    UINT8                       bFrameIndex;
+    UINT32                      dwFrameInterval;
+} UVC_QUIRK;
+
+/* The configuration committed with one camera, remembered across detach and attach. A camera that attaches again with
+ * the same VID/PID, serial number and configuration descriptor gets the committed structure back with a single
+ * VS_COMMIT_CONTROL SET_CUR instead of a full probe/commit. */
+
+typedef struct reattach_entry
+{
+    UINT8                       bValid;
+    UINT16                      idVendor;
+    UINT16                      idProduct;
+    char                        serial[SERIAL_NUMBER_LENGTH];
+    UINT32                      descriptor_hash;                /* FNV-1a of the complete configuration descriptor */
+    UINT16                      probe_length;
+    UCHAR                       data[PROBE_MAX_LENGTH];         /* Probe/commit structure as last committed */
+    UINT32                      uLastUsed;                      /* For replacing the least recently used entry */
+} REATTACH_ENTRY, *pREATTACH_ENTRY;
+
+/* Called by the control task when a queued request has completed. nStatus is USBHST_TRANSFER_CANCELLED if the request
+ * was replaced by a newer write of the same control or dropped when the camera was removed. uValue is the value read
+ * by a GET request. */
+
+typedef VOID (*CONTROL_CALLBACK)(UINT32 hDevice, UINT8 uEntity, UINT8 uSelector, USBHST_STATUS nStatus, UINT32 uValue, void *pContext);
+
+/* A camera or processing unit control request waiting in the control queue of a camera */
+
+typedef struct uvc_control_request
+{
+    UINT8                       uEntity;                        /* UVC_ENTITY_CAMERA_TERMINAL or UVC_ENTITY_PROCESSING_UNIT */
+    UINT8                       uSelector;                      /* UVC_CT_* or UVC_PU_* */
+    UINT8                       uRequest;                       /* USB_SET_CURRENT or one of the USB_GET_* requests */
+    UINT8                       uLength;                        /* Length of the control value, 1 to CONTROL_VALUE_MAX_LENGTH */
+    UINT8                       bCoalesce;                      /* A later write of the same control may replace this one */
+    UINT32                      uValue;                         /* Value written by a SET request */
+    CONTROL_CALLBACK            pCallback;                      /* May be NULL */
+    void                        *pContext;
+} UVC_CONTROL_REQUEST, *pUVC_CONTROL_REQUEST;
+
+/* Describes a frame recorded in MJPEG passthrough mode */
+
+typedef struct frame_info
+{
+    UINT32                      uSequence;                      /* Frames recorded by the camera so far */
+    ULONG                       uTicks;                         /* tickGet() when the frame was complete */
+    UINT32                      uPts;                           /* Presentation time stamp of the camera, in dwClockFrequency units */
+    UINT8                       bPtsValid;                      /* The payload headers of the frame carried a PTS */
+    UINT8                       bDhtInserted;                   /* The standard Huffman tables were added to the frame */
+    UINT8                       bStill;                         /* The frame is a still image */
+    UINT16                      uWidth;                         /* Size of the frame, or of the still image */
+    UINT16                      uHeight;
+} FRAME_INFO, *pFRAME_INFO;
+
+/* Gets every frame recorded in MJPEG passthrough mode, or every still image. It is called from the image task, or for
+ * a method 3 still from the task that called Still_Capture(); pFrame is only valid during the call, so a sink that
+ * queues frames must copy them. The next frame is not assembled until it returns. */
+
+typedef VOID (*FRAME_SINK_CALLBACK)(UINT32 hDevice, const UCHAR *pFrame, UINT32 uLength, const FRAME_INFO *pInfo, void *pContext);
+
+/* Everything that belongs to one attached camera. The context is allocated in Add_Device_Callback(), handed to the
+ * host stack as pDriverData and reached from the URBs through ISO_TRANSFER.pDevice, so every camera has its own
+ * buffers, counters and tasks. */
+
+typedef struct uvc_device
+{
+    UINT32                      hDevice;                        /* Handle given by the host stack */
+    UINT8                       uIndex;                         /* Slot in uvc_devices[]; used in task and file names */
+    UINT8                       uSpeed;
+    UINT16                      idVendor;                       /* From the device descriptor */
+    UINT16                      idProduct;
+    char                        serial[SERIAL_NUMBER_LENGTH];   /* iSerialNumber string, empty if the camera has none */
+    UINT32                      descriptor_hash;                /* FNV-1a of config_descriptor */
+    UINT8                       attach_state;                   /* ATTACH_STATE_* step the bring-up has reached */
+    UINT8                       attach_retries;                 /* Failed attempts of the current step */
+    SEM_ID                      ready_sem;                      /* Given when the bring-up is READY or FAILED */
+    const UVC_QUIRK             *pQuirk;                        /* Entry of the camera in uvc_quirks[], NULL if there is none */
+    UINT32                      quirks;                         /* QUIRK_* bits of that entry */
+    
+    UCHAR                       data[PROBE_MAX_LENGTH];         /* Probe/commit structure exchanged with the camera */
+    UINT16                      probe_length;                   /* Length of the structure for the camera's UVC revision */
+    UINT16                      bcdUVC;                         /* UVC revision from the video control interface header */
+    UVC_PROBE                   probe;                          /* Values requested, then the values committed by Negotiate_Stream() */
+    UINT8                       probe_committed;                /* probe holds what the camera has committed */
+    UINT16                      frame_width;                    /* Size of the committed frame, from the capability table */
+    UINT16                      frame_height;
+    
+    UCHAR                       *config_descriptor;             /* Complete configuration descriptor read at attach time */
+    UINT32                      config_descriptor_length;
+    ALT_SETTING                 alt_settings[MAX_ALT_SETTINGS]; /* Isochronous alternate settings of the video streaming interface */
+    UINT8                       num_alt_settings;
+    UINT8                       streaming_interface;            /* Interface number of the video streaming interface */
+    pALT_SETTING                selected_alt;                   /* Alternate setting used by Stream_Open_Pipe() */
+    UVC_FORMAT                  formats[MAX_FORMATS];           /* Capability table: formats, frame sizes and frame intervals */
+    UINT8                       num_formats;
+    UINT8                       video_endpoint;                 /* bEndpointAddress of the VS input header, 0 if there is none */
+    UINT8                       still_method;                   /* bStillCaptureMethod of the VS input header */
+    UINT8                       still_endpoint;                 /* Bulk endpoint of a method 3 still, from the VS_STILL_IMAGE_FRAME descriptor */
+    UVC_STILL_PROBE             still_probe;                    /* Values committed by Still_Negotiate() */
+    UINT8                       still_committed;
+    FRAME_SINK_CALLBACK         still_sink;                     /* Gets the still images; set by Still_Capture() */
+    void                        *still_sink_context;
+    UCHAR                       *still_buffer;                  /* Method 3: the still read from still_endpoint */
+    UINT32                      still_buffer_size;
+    SEM_ID                      still_mutex;                    /* Serialises the method 3 still reads; owns still_buffer */
+    SEM_ID                      sink_mutex;                     /* Held while a sink is called or changed with its context */
+    UINT32                      stills_captured;
+    UINT8                       control_interface;              /* Interface number of the video control interface */
+    UINT8                       camera_terminal_id;             /* bTerminalID of the camera terminal, 0 if there is none */
+    UINT8                       processing_unit_id;             /* bUnitID of the processing unit, 0 if there is none */
+    UINT32                      iso_packet_size;                /* Size of one isochronous packet of the selected alternate setting */
+    UINT8                       bulk_mode;                      /* The selected setting streams over a bulk endpoint */
+    UINT32                      bulk_transfer_size;             /* Length of one bulk URB */
+    UINT32                      bulk_payload_size;              /* dwMaxPayloadTransferSize; a bulk payload ends with a short packet or at this size */
+    UINT32                      bulk_payload_received;          /* Bytes received so far of the current bulk payload */
+    UINT8                       bulk_in_payload;                /* The next bulk URB continues a payload and starts without a header */
+    
+    UINT8                       schedule_mode;                  /* ISO_SCHEDULE_ASAP or ISO_SCHEDULE_EXPLICIT */
+    UINT8                       schedule_valid;                 /* next_start_frame holds the end of the schedule */
+    UINT16                      next_start_frame;               /* Frame in which the next URB submitted must start */
+    UINT16                      frames_per_urb;                 /* Frames covered by one URB of the selected alternate setting */
+    UINT32                      schedule_gaps;                  /* Times a URB could not continue the schedule */
+    UINT32                      lost_frames;                    /* Frames the schedule skipped because of those gaps */
+    
+    UINT8                       bus_index;                      /* Host controller the camera is attached to */
+    UINT8                       priority;                       /* Order in which the bandwidth manager serves the cameras */
+    UINT8                       bw_registered;                  /* The camera takes part in the bandwidth budget of its bus */
+    UINT32                      requested_payload;              /* dwMaxPayloadTransferSize negotiated at attach time */
+    UINT32                      requested_interval;             /* dwFrameInterval negotiated at attach time */
+    UINT8                       requested_frame;                /* bFrameIndex negotiated at attach time */
+    pALT_SETTING                bw_target;                      /* Alternate setting assigned by the bandwidth manager, NULL if none */
+    UINT32                      bw_cost;                        /* Share of the bus (per mille) reserved for the camera */
+    UINT8                       bw_deferred;                    /* bw_target changed while suspended; applied by Stream_Resume() */
+    SEM_ID                      stream_mutex;                   /* Serialises the stream operations of the service task and the bandwidth manager */
+    
+    UINT8                       batch_mode;                     /* Completed URBs are queued for Stream_Batch_Task() */
+    pISO_TRANSFER               batch_ring[BATCH_RING_SIZE];    /* Completed URBs waiting for the batch task */
+    atomic_t                    batch_head;                     /* Next slot written by the completion callback */
+    atomic_t                    batch_tail;                     /* Next slot read by the batch task */
+    atomic_t                    batch_signalled;                /* Set while batch_sem has been given and the task has not run yet */
+    SEM_ID                      batch_sem;                      /* Wakes up the batch task */
+    UINT8                       batch_task_started;
+    UINT8                       batch_exit;                     /* Set by Device_Destroy() to end the batch task */
+    SEM_ID                      batch_exit_sem;                 /* Given by the batch task when it exits */
+    UINT32                      batch_wakeups;                  /* Times the batch task ran */
+    UINT32                      batch_urbs;                     /* URBs it resubmitted */
+    
+    UVC_CONTROL_REQUEST         control_queue[CONTROL_QUEUE_LENGTH];    /* Control requests in the order they were queued */
+    UINT8                       control_head;                   /* Oldest request in control_queue[] */
+    UINT8                       control_count;                  /* Requests in control_queue[] */
+    SEM_ID                      control_mutex;                  /* Protects the control queue */
+    SEM_ID                      control_sem;                    /* Counts the requests for the control task */
+    UINT8                       control_task_started;
+    UINT8                       control_exit;                   /* Set by Device_Destroy() to end the control task */
+    SEM_ID                      control_exit_sem;               /* Given by the control task when it exits */
+    UINT32                      controls_coalesced;             /* Writes that replaced a queued write of the same control */
+    
+    ISO_TRANSFER                isoTransfers[NO_OF_TRANSFERS];  /* URBs, packet descriptors and buffers of the stream */
+    atomic_t                    urbs_in_flight;                 /* Number of URBs currently owned by the host stack */
+    UINT8                       stream_stopping;                /* Set by Stream_Stop() so that completed URBs are not resubmitted */
+    UINT8                       pipe_open;                      /* Set while the streaming alternate setting is selected and the pipe is prepared */
+    UINT8                       suspended;                      /* Set by Stream_Suspend(), cleared by Stream_Resume() */
+    UINT8                       suspend_requested;              /* Set by the suspend callback, cleared by the resume callback */
+    UINT8                       resume_streaming;               /* The stream was running when it was suspended */
+    UINT8                       stream_started;                 /* Set by Stream_Start(), cleared by Stream_Stop() */
+    
+    UCHAR                       *image_buffer;                  /* Buffer where the image data will be copied for further processing */
+    UCHAR                       *spare_buffer;                  /* The other frame buffer; owned by the image task while it has a frame */
+    UINT32                      image_buffer_size;              /* dwMaxVideoFrameSize of the committed stream, or of a larger method 2 still */
+    UINT32                      video_frame_size;               /* dwMaxVideoFrameSize of the committed stream, at least a whole YUYV frame */
+    char                        *bigBuffer;                     /* Buffer to store the data after YUV to RGB conversion is performed */
+    UINT32                      rgb_buffer_size;                /* 3 bytes for every pixel of the committed frame size */
+    UINT8                       format_subtype;                 /* bDescriptorSubtype of the committed format */
+    pJPEG_DECODER               jpeg_decoder;                   /* Decodes the frames of an MJPEG stream in processImage() */
+    UINT8                       passthrough;                    /* MJPEG frames are recorded as they are, without decoding */
+    FRAME_SINK_CALLBACK         frame_sink;                     /* Gets the recorded frames; NULL writes them to /tgtsvr */
+    void                        *frame_sink_context;
+    FRAME_INFO                  frame_info;                     /* Time stamps of the frame handed to the image task */
+    UINT32                      frame_pts;                      /* PTS of the frame being assembled */
+    UINT8                       frame_pts_valid;
+    UINT8                       frame_still;                    /* A payload of the frame being assembled had HEADER_STI_BIT set */
+    UINT32                      frames_recorded;
+    UINT32                      transfer_size;                  /* Size of the buffer of each transfer in isoTransfers[] */
+    UINT32                      offset;                         /* Where the next payload goes in image_buffer */
+    UINT16                      frameCount;                     /* To maintain the count of total frames processed */
+    UINT8                       mem_h;                          /* Used to maintain and check the value of FID bit in the stream header */
+    UINT8                       eof_seen;                       /* QUIRK_STREAM_NO_FID: the last payload had the EOF bit set */
+    UINT8                       end_of_image;
+    UINT8                       aborted;
+    UINT8                       first;
+    UINT8                       frame_synced;                   /* Set once the first FID change has been seen; frames before it are partial */
+    UINT8                       first_frame_sent;               /* Set once the first frame notification has been given */
+    UINT8                       frame_damaged;                  /* Part of the frame being assembled is missing or bad */
+    UINT32                      damaged_frames;                 /* Frames dropped because they were damaged */
+    UINT32                      busy_frames;                    /* Frames dropped because the image task still had the previous one */
+    UINT32                      urb_errors;                     /* URBs that completed with an error status */
+    UINT8                       endpoint_halted;                /* The streaming endpoint stalled; cleared by Stream_Recover() */
+    UINT8                       recovery_pending;               /* Set while a SERVICE_RECOVER request is queued */
+    UINT8                       recoveries;                     /* Recoveries since the last good frame */
+    
+    UINT8                       adaptive_mode;                  /* Step down instead of failing when bandwidth is short */
+    UINT8                       degrade_level;                  /* Number of downshifts since the stream was negotiated */
+    UINT8                       downshift_pending;              /* Set while a SERVICE_DOWNSHIFT request is queued or running */
+    UINT32                      window_packets;                 /* Packets seen in the current error rate window */
+    UINT32                      window_errors;                  /* Packets with an error status in the current window */
+    
+    SEM_ID                      synch_sem;                      /* Given by the image task when it no longer needs spare_buffer */
+    SEM_ID                      first_frame_sem;                /* Given when the first complete frame has been received */
+    SEM_ID                      drain_sem;                      /* Given when the last URB in flight has completed */
+    SEM_ID                      exit_sem;                       /* Given by the service task when it exits */
+    MSG_Q_ID                    service_queue;                  /* Requests for Stream_Service_Task() */
+    
+    long double                 last_ticks;                     /* Time stamp of the previous frame, see start_timer() */
+    long double                 last_jiffies;
+} UVC_DEVICE, *pUVC_DEVICE;
+
+/* Called with the device handle and one of the STREAM_EVENT_* values. It is called from the USB completion context,
+ * so it must not block. */
+
+typedef VOID (*STREAM_EVENT_CALLBACK)(UINT32 hDevice, UINT32 uEvent);
 
 /************************************************************
  *                                                          *
@@ -69,28 +616,135 @@
 /***************** Camera related functions ****************/
 
 VOID camInit(void);
-VOID fill_global(void);
+VOID fill_defaults(pUVC_DEVICE pDevice);
+pUVC_DEVICE Device_Create(UINT32 hDevice, UINT8 uSpeed);
+VOID Device_Destroy(pUVC_DEVICE pDevice);
+pUVC_DEVICE Uvc_Get_Device(UINT8 uIndex);
+pUVC_DEVICE Uvc_Find_Device(UINT32 hDevice);
 VOID Remove_Device_Callback(UINT32 hDevice, void *pDriverData);
 VOID Suspend_Device_Callback(UINT32 hDevice, void *pDriverData);
 VOID Resume_Device_Callback(UINT32 hDevice, void *pDriverData);
 USBHST_STATUS Add_Device_Callback(UINT32 hDevice, UINT8 uInterfaceNumber, UINT8 uSpeed, void **pDriverData);
+USBHST_STATUS Attach_Run_Step(pUVC_DEVICE pDevice);
+VOID Attach_Step(pUVC_DEVICE pDevice);
+VOID Attach_Finish(pUVC_DEVICE pDevice, UINT8 uState);
+STATUS Uvc_Wait_Ready(pUVC_DEVICE pDevice, int timeout);
 VOID shutDown(void);
 
+/*************** Descriptor related functions **************/
+
+USBHST_STATUS Read_Configuration_Descriptor(pUVC_DEVICE pDevice);
+UINT8 Parse_Streaming_Alt_Settings(pUVC_DEVICE pDevice);
+UINT8 Parse_Streaming_Formats(pUVC_DEVICE pDevice);
+USBHST_STATUS Read_Device_Identity(pUVC_DEVICE pDevice);
+UINT8 Uvc_Get_Format_Count(pUVC_DEVICE pDevice);
+pUVC_FORMAT Uvc_Get_Format(pUVC_DEVICE pDevice, UINT8 uPosition);
+pUVC_FORMAT Uvc_Find_Format(pUVC_DEVICE pDevice, UINT8 bFormatIndex);
+pUVC_FRAME Uvc_Find_Frame(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex);
+pUVC_FRAME Uvc_Find_Smaller_Frame(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex);
+UINT8 Uvc_Frame_Supports_Interval(pUVC_FRAME pFrame, UINT32 uInterval);
+UINT32 Uvc_Nearest_Frame_Interval(pUVC_FRAME pFrame, UINT32 uInterval);
+VOID Uvc_Select_Default_Mode(pUVC_DEVICE pDevice);
+VOID Uvc_Apply_Quirks(pUVC_DEVICE pDevice);
+pALT_SETTING Select_Alt_Setting(pUVC_DEVICE pDevice, UINT32 uPayloadSize);
+
 /**************** Transfer related functions ***************/
 
-USBHST_STATUS Control_Transfer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex);
-USBHST_STATUS Isochronous_Transfer(UINT32 hDevice, UINT8 uEndpointAddress, UINT32 uTransferFlags, USBHST_STATUS nStatus);
+STATUS Control_Pool_Init(void);
+pCONTROL_CONTEXT Control_Context_Get(void);
+VOID Control_Context_Put(pCONTROL_CONTEXT pContext);
+USBHST_STATUS Control_Transfer(pUVC_DEVICE pDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex);
+USBHST_STATUS Control_Transfer_Buffer(UINT32 hDevice, UINT8 uRequestType, UINT8 uRequest, UINT16 uValue, UINT16 uIndex, UCHAR *pBuffer, UINT16 uLength);
+USBHST_STATUS Isochronous_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer, UINT32 uTransferFlags);
 USBHST_STATUS Control_Completion_Callback(pUSBHST_URB pUrb);
 USBHST_STATUS Isochronous_Completion_Callback(pUSBHST_URB pUrb);
+UINT8 Isochronous_Process(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer);
+VOID Isochronous_Resubmit(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer);
+VOID Stream_Batch_Task(pUVC_DEVICE pDevice);
+STATUS Stream_Set_Batching(pUVC_DEVICE pDevice, UINT8 enable);
+
+/**************** Stream related functions *****************/
+
+USBHST_STATUS Negotiate_Stream(pUVC_DEVICE pDevice);
+VOID Probe_Parse(const UCHAR *pData, UINT16 uLength, pUVC_PROBE pProbe);
+VOID Probe_Serialize(const UVC_PROBE *pProbe, UCHAR *pData, UINT16 uLength);
+VOID Probe_Update_Frame_Size(pUVC_DEVICE pDevice);
+VOID Probe_Fix_Sizes(pUVC_DEVICE pDevice);
+USBHST_STATUS Negotiate_From_Cache(pUVC_DEVICE pDevice);
+VOID Reattach_Cache_Store(pUVC_DEVICE pDevice);
+VOID Reattach_Cache_Clear(void);
+USBHST_STATUS Stream_Open_Pipe(pUVC_DEVICE pDevice);
+USBHST_STATUS Stream_Start(pUVC_DEVICE pDevice);
+STATUS Stream_Quiesce(pUVC_DEVICE pDevice);
+STATUS Stream_Stop(pUVC_DEVICE pDevice);
+STATUS Stream_Suspend(pUVC_DEVICE pDevice);
+USBHST_STATUS Stream_Resume(pUVC_DEVICE pDevice);
+USBHST_STATUS Stream_Recover(pUVC_DEVICE pDevice);
+VOID Stream_End_Frame(pUVC_DEVICE pDevice);
+VOID Stream_Assemble_Payload(pUVC_DEVICE pDevice, const UCHAR *pPayload, UINT32 uLength);
+VOID Stream_Append_Data(pUVC_DEVICE pDevice, const UCHAR *pData, UINT32 uLength);
+USBHST_STATUS Bulk_Transfer(pUVC_DEVICE pDevice, pISO_TRANSFER pTransfer);
+USBHST_STATUS Bulk_Completion_Callback(pUSBHST_URB pUrb);
+VOID Stream_Request_Recovery(pUVC_DEVICE pDevice);
+VOID Stream_Urb_Done(pISO_TRANSFER pTransfer);
+VOID Stream_Free_Transfers(pUVC_DEVICE pDevice);
+STATUS Stream_Alloc_Frame_Buffers(pUVC_DEVICE pDevice);
+STATUS Stream_Alloc_Rgb_Buffer(pUVC_DEVICE pDevice);
+STATUS Stream_Free_Frame_Buffers(pUVC_DEVICE pDevice);
+STATUS Stream_Wait_Image_Task(pUVC_DEVICE pDevice, int timeout);
+STATUS Stream_Set_Mode(pUVC_DEVICE pDevice, UINT8 bFormatIndex, UINT8 bFrameIndex, UINT32 dwFrameInterval);
+STATUS Stream_Set_Frame_Interval(pUVC_DEVICE pDevice, UINT32 dwFrameInterval, UINT32 *pCommitted);
+STATUS Stream_Set_Frame_Rate(pUVC_DEVICE pDevice, UINT32 uNumerator, UINT32 uDenominator, UINT32 *pCommitted);
+STATUS Stream_Wait_First_Frame(pUVC_DEVICE pDevice, int timeout);
+VOID Stream_Set_Event_Callback(STREAM_EVENT_CALLBACK pCallback);
+VOID Stream_Set_Passthrough(pUVC_DEVICE pDevice, UINT8 enable, FRAME_SINK_CALLBACK pSink, void *pContext);
+USBHST_STATUS Stream_Start_Adaptive(pUVC_DEVICE pDevice);
+STATUS Stream_Downshift(pUVC_DEVICE pDevice);
+VOID Stream_Set_Adaptive(pUVC_DEVICE pDevice, UINT8 enable);
+VOID Stream_Get_Degradation(pUVC_DEVICE pDevice, UINT8 *pLevel, UINT8 *pAlternateSetting, UINT32 *pFrameInterval);
+STATUS Stream_Schedule_Next(pUVC_DEVICE pDevice, UINT16 *pStartFrame);
+UINT16 Stream_Schedule_Restart(pUVC_DEVICE pDevice, UINT16 uRejectedFrame);
+STATUS Stream_Set_Scheduling(pUVC_DEVICE pDevice, UINT8 uMode);
+VOID Stream_Get_Schedule_Stats(pUVC_DEVICE pDevice, UINT32 *pGaps, UINT32 *pLostFrames);
+STATUS Stream_Fit_Payload(pUVC_DEVICE pDevice, pALT_SETTING pAlt);
+UINT32 Bandwidth_Cost(pUVC_DEVICE pDevice, pALT_SETTING pAlt);
+USBHST_STATUS Bandwidth_Attach(pUVC_DEVICE pDevice);
+VOID Bandwidth_Detach(pUVC_DEVICE pDevice);
+VOID Bandwidth_Rebalance(UINT8 uBus);
+STATUS Bandwidth_Apply(pUVC_DEVICE pDevice, pALT_SETTING pTarget);
+STATUS Bandwidth_Reconfigure(pUVC_DEVICE pDevice, pALT_SETTING pTarget);
+VOID Bandwidth_Set_Priority(pUVC_DEVICE pDevice, UINT8 uPriority);
+UINT32 Bandwidth_Get_Reserved(UINT8 uBus);
+VOID Stream_Service_Task(pUVC_DEVICE pDevice);
+UINT32 Stream_Payload_Size(pUVC_DEVICE pDevice);
+
+/**************** Camera control functions *****************/
+
+STATUS Uvc_Control_Set_Async(pUVC_DEVICE pDevice, UINT8 uEntity, UINT8 uSelector, UINT32 uValue, UINT8 uLength, UINT8 bCoalesce, CONTROL_CALLBACK pCallback, void *pContext);
+STATUS Uvc_Control_Get_Async(pUVC_DEVICE pDevice, UINT8 uEntity, UINT8 uSelector, UINT8 uRequest, UINT8 uLength, CONTROL_CALLBACK pCallback, void *pContext);
+STATUS Control_Queue_Put(pUVC_DEVICE pDevice, pUVC_CONTROL_REQUEST pRequest);
+VOID Control_Queue_Flush(pUVC_DEVICE pDevice);
+VOID Control_Task(pUVC_DEVICE pDevice);
+
+/**************** Still image functions *******************/
+
+USBHST_STATUS Still_Negotiate(pUVC_DEVICE pDevice, UINT8 bFrameIndex);
+STATUS Still_Capture(pUVC_DEVICE pDevice, FRAME_SINK_CALLBACK pSink, void *pContext);
+STATUS Still_Read_Bulk(pUVC_DEVICE pDevice, pFRAME_INFO pInfo, UINT32 *pLength);
+USBHST_STATUS Still_Bulk_Transfer(pUVC_DEVICE pDevice, UCHAR *pBuffer, UINT32 uLength, UINT32 *pReceived);
+VOID Still_Deliver(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength, pFRAME_INFO pInfo);
 
 /*************** Image processing functions ****************/
 
-VOID processImage(const void *p, UINT32 size);
+VOID processImage(pUVC_DEVICE pDevice, const void *p, UINT32 size);
 VOID YUV2RGB(int y, int u, int v, char *r, char *g, char *b);
-VOID dump_ppm(char *p, UINT32 size, UINT16 tag);
+VOID dump_ppm(pUVC_DEVICE pDevice, char *p, UINT32 size, UINT16 tag);
+VOID Mjpeg_Record_Frame(pUVC_DEVICE pDevice, UCHAR *pFrame, UINT32 uLength);
+STATUS Mjpeg_Complete_Frame(UCHAR *pFrame, UINT32 *pLength, UINT8 *pDhtInserted);
+VOID dump_jpeg(pUVC_DEVICE pDevice, const UCHAR *p, UINT32 size, UINT16 tag);
 
 /************** Timer related functions ********************/
 
 VOID initialize_timer(void);
-VOID start_timer(void);
-VOID stop_timer(void);
+VOID start_timer(pUVC_DEVICE pDevice);
+VOID stop_timer(pUVC_DEVICE pDevice);
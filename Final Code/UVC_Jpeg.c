@@ -0,0 +1,1347 @@
+/***********************************************************************************************
+ * Name:         UVC_Jpeg.c                                                                    *
+ * Author:       Neel Desai, University of Colorado - Boulder                                  *
+ * Date:         04/19/2014                                                                    *
+ * Description:  -> A baseline JPEG decoder for the frames of an MJPEG stream. processImage()  *
+ *                  hands it a complete frame from image_buffer and gets back packed RGB data  *
+ *                  in bigBuffer, the same output the YUYV path produces, so dump_ppm() does   *
+ *                  not need to know which format the camera is streaming.                     *
+ *               -> Baseline (SOF0) and extended sequential (SOF1) frames with 8 bit samples,  *
+ *                  one (grey) or three (YCbCr) components and 4:4:4, 4:2:2, 4:4:0 or 4:2:0    *
+ *                  sampling are decoded, with or without restart markers. Progressive and     *
+ *                  arithmetic coded frames are rejected. Most UVC cameras leave the DHT       *
+ *                  segment out of their MJPEG frames; the standard tables of Annex K of the   *
+ *                  JPEG specification are used until a frame brings its own.                  *
+ *               -> The frame is decoded one MCU at a time: the blocks are Huffman decoded,    *
+ *                  dequantized, transformed with an integer IDCT into the planes of the       *
+ *                  decoder and converted to RGB straight into the output buffer. Blocks with  *
+ *                  nothing but a DC coefficient, which are most of the blocks of a camera     *
+ *                  image, are filled without the IDCT. Chroma is upsampled by replication.    *
+ *               -> When the compiler targets SSE2, the IDCT and the colour conversion work on *
+ *                  eight samples at a time. Both paths use the same fixed point constants and *
+ *                  give the same result. Define JPEG_NO_SIMD to build the portable code only. *
+ *               -> For recording without decoding, Jpeg_Check_Frame() validates the markers   *
+ *                  of a frame and Jpeg_Build_Dht_Segment() supplies the tables to insert into *
+ *                  frames that have none, so that they can be read by any JPEG decoder.       *
+ *                                                                                             *
+ * References:  -> ITU-T T.81 | ISO/IEC 10918-1, Annex F (decoding) and Annex K (tables)       *
+ *              -> The "islow" IDCT of the Independent JPEG Group's libjpeg (Loeffler,         *
+ *                 Ligtenberg and Moschytz)                                                    *
+ **********************************************************************************************/
+
+#include <vxWorks.h>
+#include <string.h>
+#include <logLib.h>
+
+#include "UVC_Jpeg.h"
+
+#if defined(__SSE2__) && !defined(JPEG_NO_SIMD)
+#define JPEG_SSE2
+#include <emmintrin.h>
+#endif
+
+/*#define DEBUG*/             /* To enable the logMsgs */
+
+/* Fixed point constants of the IDCT, scaled by 2^12. The rotations are written as a*x + b*y so that the SSE2 code can
+ * compute them with pmaddwd; the scalar code uses the same sums, which keeps both paths bit exact. */
+
+#define JPEG_FIX(x)                                     ((INT32)((x) * 4096.0 + 0.5))
+#define JPEG_FIX_EVEN_A                                 JPEG_FIX(0.541196100)                   /* t2 = s2 * A + s6 * B */
+#define JPEG_FIX_EVEN_B                                 JPEG_FIX(0.541196100 - 1.847759065)
+#define JPEG_FIX_EVEN_C                                 JPEG_FIX(0.541196100 + 0.765366865)     /* t3 = s2 * C + s6 * A */
+#define JPEG_FIX_ODD_P5                                 JPEG_FIX(1.175875602)
+#define JPEG_FIX_ODD_P3                                 JPEG_FIX(1.175875602 - 1.961570560)
+#define JPEG_FIX_ODD_P4                                 JPEG_FIX(1.175875602 - 0.390180644)
+#define JPEG_FIX_ODD_P1                                 JPEG_FIX(-0.899976223)
+#define JPEG_FIX_ODD_P2                                 JPEG_FIX(-2.562915447)
+#define JPEG_FIX_ODD_T0                                 JPEG_FIX(0.298631336 - 0.899976223)
+#define JPEG_FIX_ODD_T1                                 JPEG_FIX(2.053119869 - 2.562915447)
+#define JPEG_FIX_ODD_T2                                 JPEG_FIX(3.072711026 - 2.562915447)
+#define JPEG_FIX_ODD_T3                                 JPEG_FIX(1.501321110 - 0.899976223)
+#define JPEG_PASS1_SHIFT                                10
+#define JPEG_PASS1_BIAS                                 (1 << (JPEG_PASS1_SHIFT - 1))
+#define JPEG_PASS2_SHIFT                                17
+#define JPEG_PASS2_BIAS                                 ((1 << (JPEG_PASS2_SHIFT - 1)) + (128 << JPEG_PASS2_SHIFT))   /* Rounding and the level shift */
+#define JPEG_SATURATE_16(x)                             (((x) < -32768) ? -32768 : (((x) > 32767) ? 32767 : (x)))
+
+/* Colour conversion constants of JFIF, scaled by 2^14 and applied to (chroma - 128) * 4, so that the rounded high
+ * half of a 16 bit product is the result */
+
+#define JPEG_CR_TO_R                                    22970               /* 1.402    */
+#define JPEG_CB_TO_G                                    5638                /* 0.344136 */
+#define JPEG_CR_TO_G                                    11700               /* 0.714136 */
+#define JPEG_CB_TO_B                                    29032               /* 1.772    */
+
+/************************************************************
+ *                                                          *
+ *                          GLOBALS                         *
+ *                                                          *
+ ***********************************************************/
+
+/* Position in the block of each coefficient, in the zigzag order they are coded in */
+
+static const UCHAR jpeg_natural_order[JPEG_BLOCK_SIZE] =
+{
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* Standard Huffman tables of Annex K.3: code counts for each length from 1 to 16 bits, then the symbols */
+
+static const UCHAR jpeg_dc_luminance_counts[JPEG_MAX_CODE_LENGTH] =
+{
+    0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static const UCHAR jpeg_dc_luminance_values[12] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+};
+
+static const UCHAR jpeg_dc_chrominance_counts[JPEG_MAX_CODE_LENGTH] =
+{
+    0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static const UCHAR jpeg_dc_chrominance_values[12] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+};
+
+static const UCHAR jpeg_ac_luminance_counts[JPEG_MAX_CODE_LENGTH] =
+{
+    0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D
+};
+
+static const UCHAR jpeg_ac_luminance_values[162] =
+{
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA
+};
+
+static const UCHAR jpeg_ac_chrominance_counts[JPEG_MAX_CODE_LENGTH] =
+{
+    0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77
+};
+
+static const UCHAR jpeg_ac_chrominance_values[162] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA
+};
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Decoder_Init(pJPEG_DECODER pDecoder)                              *
+ * Description:  Clears a decoder and loads the standard Huffman tables. Must be called once *
+ *               before the decoder is used; it then keeps its tables from frame to frame.   *
+ ********************************************************************************************/
+
+VOID Jpeg_Decoder_Init(pJPEG_DECODER pDecoder)
+{
+    memset(pDecoder, 0, sizeof(JPEG_DECODER));
+
+    Jpeg_Load_Default_Tables(pDecoder);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Load_Default_Tables(pJPEG_DECODER pDecoder)                       *
+ * Description:  Builds the standard tables of Annex K.3 into the Huffman tables a previous  *
+ *               frame replaced with a DHT segment of its own. Table 0 of each class is the  *
+ *               luminance table and table 1 the chrominance table, which is how cameras     *
+ *               that leave DHT out of their frames expect them to be numbered.              *
+ ********************************************************************************************/
+
+VOID Jpeg_Load_Default_Tables(pJPEG_DECODER pDecoder)
+{
+    if((pDecoder->default_tables & 0x01) == 0)
+    {
+        Jpeg_Build_Huffman(&pDecoder->dc_tables[0], jpeg_dc_luminance_counts, jpeg_dc_luminance_values);
+    }
+
+    if((pDecoder->default_tables & 0x02) == 0)
+    {
+        Jpeg_Build_Huffman(&pDecoder->dc_tables[1], jpeg_dc_chrominance_counts, jpeg_dc_chrominance_values);
+    }
+
+    if((pDecoder->default_tables & 0x04) == 0)
+    {
+        Jpeg_Build_Huffman(&pDecoder->ac_tables[0], jpeg_ac_luminance_counts, jpeg_ac_luminance_values);
+    }
+
+    if((pDecoder->default_tables & 0x08) == 0)
+    {
+        Jpeg_Build_Huffman(&pDecoder->ac_tables[1], jpeg_ac_chrominance_counts, jpeg_ac_chrominance_values);
+    }
+
+    pDecoder->default_tables = JPEG_TABLES_DEFAULT;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Jpeg_Build_Huffman(pJPEG_HUFFMAN pTable, const UCHAR *pCounts,       *
+ *                                         const UCHAR *pValues)                             *
+ * Description:  Builds a Huffman table from the 16 code counts and the symbols of a DHT     *
+ *               segment. The canonical codes are assigned in the order of Annex C; codes of *
+ *               up to JPEG_HUFFMAN_LOOKUP_BITS bits get every lookup[] entry they prefix.   *
+ *               Returns ERROR if the counts do not describe a valid code.                   *
+ ********************************************************************************************/
+
+STATUS Jpeg_Build_Huffman(pJPEG_HUFFMAN pTable, const UCHAR *pCounts, const UCHAR *pValues)
+{
+    UINT32 uLength = 0, i = 0, j = 0, uSymbol = 0, uCode = 0, uShift = 0;
+
+    memset(pTable->lookup, 0, sizeof(pTable->lookup));
+
+    for(uLength = 1; uLength <= JPEG_MAX_CODE_LENGTH; uLength++)
+    {
+        pTable->valoffset[uLength] = (INT32)uSymbol - (INT32)uCode;
+
+        if((uSymbol + pCounts[uLength - 1]) > sizeof(pTable->values))
+        {
+            return ERROR;
+        }
+
+        for(i = 0; i < pCounts[uLength - 1]; i++)
+        {
+            pTable->values[uSymbol] = pValues[uSymbol];
+
+            if(uLength <= JPEG_HUFFMAN_LOOKUP_BITS)
+            {
+                uShift = JPEG_HUFFMAN_LOOKUP_BITS - uLength;
+
+                for(j = 0; j < (1U << uShift); j++)
+                {
+                    pTable->lookup[(uCode << uShift) | j] = (UINT16)((uLength << 8) | pValues[uSymbol]);
+                }
+            }
+
+            uCode++;
+            uSymbol++;
+        }
+
+        if(uCode > (1U << uLength))
+        {
+            return ERROR;                       /* More codes than fit in this length */
+        }
+
+        pTable->maxcode[uLength] = (pCounts[uLength - 1] != 0) ? (INT32)uCode - 1 : -1;
+
+        uCode <<= 1;
+    }
+
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Jpeg_Decode(pJPEG_DECODER pDecoder, const UCHAR *pJpeg,              *
+ *                                  UINT32 uLength, UCHAR *pRgb, UINT32 uRgbSize)            *
+ * Description:  Decodes the JPEG image of uLength bytes at pJpeg into pRgb as packed RGB,   *
+ *               3 bytes per pixel and width * 3 bytes per line. The size of the image is   *
+ *               left in pDecoder->width and pDecoder->height. Returns ERROR if the image is *
+ *               not a baseline JPEG image this decoder supports, if it is damaged or if it  *
+ *               does not fit in uRgbSize bytes.                                             *
+ ********************************************************************************************/
+
+STATUS Jpeg_Decode(pJPEG_DECODER pDecoder, const UCHAR *pJpeg, UINT32 uLength, UCHAR *pRgb, UINT32 uRgbSize)
+{
+    const UCHAR *pScan = NULL;
+
+    if(pDecoder->default_tables != JPEG_TABLES_DEFAULT)
+    {
+        Jpeg_Load_Default_Tables(pDecoder);     /* The previous frame brought tables of its own */
+    }
+
+    if(Jpeg_Read_Headers(pDecoder, pJpeg, uLength, &pScan) != OK)
+    {
+        return ERROR;
+    }
+
+    if(((UINT32)pDecoder->width * pDecoder->height * 3) > uRgbSize)
+    {
+        #ifdef DEBUG
+
+        logMsg("%s: A %dx%d image does not fit in %d bytes.\n",__FUNCTION__,pDecoder->width,pDecoder->height,uRgbSize,5,6);
+
+        #endif
+
+        return ERROR;
+    }
+
+    pDecoder->pData      = pScan;
+    pDecoder->pEnd       = pJpeg + uLength;
+    pDecoder->bits       = 0;
+    pDecoder->bit_count  = 0;
+    pDecoder->marker_hit = 0;
+
+    return Jpeg_Decode_Scan(pDecoder, pRgb);
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Jpeg_Read_Headers(pJPEG_DECODER pDecoder, const UCHAR *pJpeg,        *
+ *                                        UINT32 uLength, const UCHAR **ppScan)              *
+ * Description:  Reads the segments from SOI up to and including the first SOS and leaves   *
+ *               the tables, the frame and the scan in the decoder. *ppScan is set to the    *
+ *               entropy coded data that follows SOS. Only a scan with all the components of *
+ *               the frame, as in every sequential frame of an MJPEG stream, is accepted.    *
+ ********************************************************************************************/
+
+STATUS Jpeg_Read_Headers(pJPEG_DECODER pDecoder, const UCHAR *pJpeg, UINT32 uLength, const UCHAR **ppScan)
+{
+    const UCHAR *p = pJpeg + 2;
+    const UCHAR *pEnd = pJpeg + uLength;
+    const UCHAR *pSegment = NULL;
+    UINT32 uSegmentLength = 0, uMarker = 0, uClass = 0, uTable = 0, uTotal = 0, i = 0, j = 0;
+    UINT8 bFrameSeen = 0;
+    pJPEG_COMPONENT pComponent = NULL;
+
+    if((uLength < 4) || (pJpeg[0] != JPEG_MARKER_PREFIX) || (pJpeg[1] != JPEG_MARKER_SOI))
+    {
+        return ERROR;
+    }
+
+    pDecoder->restart_interval = 0;
+
+    while(p < pEnd)
+    {
+        if(*p++ != JPEG_MARKER_PREFIX)
+        {
+            continue;                           /* Not a marker; some cameras pad the segments */
+        }
+
+        while((p < pEnd) && (*p == JPEG_MARKER_PREFIX))
+        {
+            p++;                                /* Fill bytes */
+        }
+
+        if(p >= pEnd)
+        {
+            break;
+        }
+
+        uMarker = *p++;
+
+        if((uMarker == JPEG_MARKER_TEM) || ((uMarker >= JPEG_MARKER_RST0) && (uMarker <= JPEG_MARKER_RST7)))
+        {
+            continue;                           /* No length follows */
+        }
+
+        if((uMarker == JPEG_MARKER_EOI) || ((p + 2) > pEnd))
+        {
+            break;
+        }
+
+        uSegmentLength = ((UINT32)p[0] << 8) | p[1];
+        pSegment = p + 2;
+
+        if((uSegmentLength < 2) || ((p + uSegmentLength) > pEnd))
+        {
+            return ERROR;
+        }
+
+        uSegmentLength -= 2;
+        p += uSegmentLength + 2;
+
+        switch(uMarker)
+        {
+            case JPEG_MARKER_DQT:
+
+                for(i = 0; i < uSegmentLength; )
+                {
+                    uTable = pSegment[i] & 0x0F;
+
+                    if((uTable >= JPEG_MAX_QUANT_TABLES) || ((i + 1 + (JPEG_BLOCK_SIZE << (pSegment[i] >> 4))) > uSegmentLength))
+                    {
+                        return ERROR;
+                    }
+
+                    for(j = 0; j < JPEG_BLOCK_SIZE; j++)
+                    {
+                        if(pSegment[i] >> 4)
+                        {
+                            pDecoder->quant[uTable][j] = (UINT16)((pSegment[i + 1 + 2*j] << 8) | pSegment[i + 2 + 2*j]);
+                        }
+                        else
+                        {
+                            pDecoder->quant[uTable][j] = pSegment[i + 1 + j];
+                        }
+                    }
+
+                    pDecoder->quant_defined |= (UINT8)(1 << uTable);
+                    i += 1 + (JPEG_BLOCK_SIZE << (pSegment[i] >> 4));
+                }
+
+                break;
+
+            case JPEG_MARKER_DHT:
+
+                for(i = 0; i < uSegmentLength; )
+                {
+                    uClass = pSegment[i] >> 4;
+                    uTable = pSegment[i] & 0x0F;
+
+                    if((uClass > 1) || (uTable >= JPEG_MAX_HUFFMAN_TABLES) || ((i + 17) > uSegmentLength))
+                    {
+                        return ERROR;
+                    }
+
+                    for(j = 0, uTotal = 0; j < JPEG_MAX_CODE_LENGTH; j++)
+                    {
+                        uTotal += pSegment[i + 1 + j];
+                    }
+
+                    if((i + 17 + uTotal) > uSegmentLength)
+                    {
+                        return ERROR;
+                    }
+
+                    /* Cleared first: a table that fails to build is left half overwritten, and must be reloaded
+                     * before a frame without a DHT segment uses it */
+
+                    pDecoder->default_tables &= (UINT8)~(1 << (uTable + 2*uClass));
+
+                    if(Jpeg_Build_Huffman((uClass == 0) ? &pDecoder->dc_tables[uTable] : &pDecoder->ac_tables[uTable], &pSegment[i + 1], &pSegment[i + 17]) != OK)
+                    {
+                        return ERROR;
+                    }
+
+                    i += 17 + uTotal;
+                }
+
+                break;
+
+            case JPEG_MARKER_SOF0:
+            case JPEG_MARKER_SOF1:
+
+                if((uSegmentLength < 6) || (pSegment[0] != 8))
+                {
+                    return ERROR;                   /* Only 8 bit samples */
+                }
+
+                pDecoder->height         = (UINT16)((pSegment[1] << 8) | pSegment[2]);
+                pDecoder->width          = (UINT16)((pSegment[3] << 8) | pSegment[4]);
+                pDecoder->num_components = pSegment[5];
+
+                if((pDecoder->width == 0) || (pDecoder->height == 0) || ((pDecoder->num_components != 1) && (pDecoder->num_components != JPEG_MAX_COMPONENTS)) ||
+                   (uSegmentLength < (6 + 3*(UINT32)pDecoder->num_components)))
+                {
+                    return ERROR;                   /* A height defined by DNL is not supported either */
+                }
+
+                for(i = 0; i < pDecoder->num_components; i++)
+                {
+                    pComponent = &pDecoder->components[i];
+
+                    pComponent->id = pSegment[6 + 3*i];
+                    pComponent->h  = pSegment[7 + 3*i] >> 4;
+                    pComponent->v  = pSegment[7 + 3*i] & 0x0F;
+                    pComponent->tq = pSegment[8 + 3*i];
+
+                    if((pComponent->tq >= JPEG_MAX_QUANT_TABLES) || ((pDecoder->quant_defined & (1 << pComponent->tq)) == 0))
+                    {
+                        return ERROR;
+                    }
+                }
+
+                /* A grey image is coded one block at a time, whatever its sampling factors say. In a colour image the
+                 * luma component may be sampled twice as often as the chroma components in either direction. */
+
+                if(pDecoder->num_components == 1)
+                {
+                    pDecoder->components[0].h = 1;
+                    pDecoder->components[0].v = 1;
+                }
+                else if((pDecoder->components[0].h < 1) || (pDecoder->components[0].h > JPEG_MAX_SAMPLING) ||
+                        (pDecoder->components[0].v < 1) || (pDecoder->components[0].v > JPEG_MAX_SAMPLING) ||
+                        (pDecoder->components[1].h != 1) || (pDecoder->components[1].v != 1) ||
+                        (pDecoder->components[2].h != 1) || (pDecoder->components[2].v != 1))
+                {
+                    #ifdef DEBUG
+
+                    logMsg("%s: Sampling %dx%d is not supported.\n",__FUNCTION__,pDecoder->components[0].h,pDecoder->components[0].v,4,5,6);
+
+                    #endif
+
+                    return ERROR;
+                }
+
+                pDecoder->hmax = pDecoder->components[0].h;
+                pDecoder->vmax = pDecoder->components[0].v;
+
+                bFrameSeen = 1;
+
+                break;
+
+            case JPEG_MARKER_DRI:
+
+                if(uSegmentLength < 2)
+                {
+                    return ERROR;
+                }
+
+                pDecoder->restart_interval = (UINT16)((pSegment[0] << 8) | pSegment[1]);
+
+                break;
+
+            case JPEG_MARKER_SOS:
+
+                if((bFrameSeen == 0) || (uSegmentLength < 1) || (pSegment[0] != pDecoder->num_components) ||
+                   (uSegmentLength < (1 + 2*(UINT32)pSegment[0] + 3)))
+                {
+                    return ERROR;
+                }
+
+                for(i = 0; i < pDecoder->num_components; i++)
+                {
+                    pComponent = &pDecoder->components[i];
+
+                    if(pComponent->id != pSegment[1 + 2*i])
+                    {
+                        return ERROR;               /* Components in another order than in the frame */
+                    }
+
+                    pComponent->td      = pSegment[2 + 2*i] >> 4;
+                    pComponent->ta      = pSegment[2 + 2*i] & 0x0F;
+                    pComponent->dc_pred = 0;
+
+                    if((pComponent->td >= JPEG_MAX_HUFFMAN_TABLES) || (pComponent->ta >= JPEG_MAX_HUFFMAN_TABLES))
+                    {
+                        return ERROR;
+                    }
+                }
+
+                *ppScan = p;
+
+                return OK;
+
+            default:
+
+                if((uMarker > JPEG_MARKER_SOF1) && (uMarker <= JPEG_MARKER_SOF15) &&
+                   (uMarker != JPEG_MARKER_DHT) && (uMarker != JPEG_MARKER_JPG) && (uMarker != JPEG_MARKER_DAC))
+                {
+                    #ifdef DEBUG
+
+                    logMsg("%s: SOF marker 0x%x (progressive, lossless or arithmetic coding) is not supported.\n",__FUNCTION__,uMarker,3,4,5,6);
+
+                    #endif
+
+                    return ERROR;
+                }
+
+                break;                              /* APPn, COM and the like */
+        }
+    }
+
+    return ERROR;                                   /* No SOS */
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Jpeg_Decode_Scan(pJPEG_DECODER pDecoder, UCHAR *pRgb)                *
+ * Description:  Decodes the MCUs of the scan in raster order. The blocks of each component *
+ *               go to the planes of the decoder; the MCU is then converted into pRgb. After *
+ *               every restart_interval MCUs the bit buffer and the DC predictions are reset *
+ *               at the RSTn marker.                                                         *
+ ********************************************************************************************/
+
+STATUS Jpeg_Decode_Scan(pJPEG_DECODER pDecoder, UCHAR *pRgb)
+{
+    UINT32 uMcuWidth  = 8 * (UINT32)pDecoder->hmax;
+    UINT32 uMcuHeight = 8 * (UINT32)pDecoder->vmax;
+    UINT32 uMcusX = ((UINT32)pDecoder->width  + uMcuWidth  - 1) / uMcuWidth;
+    UINT32 uMcusY = ((UINT32)pDecoder->height + uMcuHeight - 1) / uMcuHeight;
+    UINT32 uMcu = 0, uTotal = uMcusX * uMcusY, c = 0, bx = 0, by = 0, uStride = 0;
+    INT32 nEnd = 0;
+    pJPEG_COMPONENT pComponent = NULL;
+    UCHAR *pOut = NULL;
+
+    for(uMcu = 0; uMcu < uTotal; uMcu++)
+    {
+        if((pDecoder->restart_interval != 0) && (uMcu != 0) && ((uMcu % pDecoder->restart_interval) == 0))
+        {
+            Jpeg_Restart(pDecoder);
+        }
+
+        for(c = 0; c < pDecoder->num_components; c++)
+        {
+            pComponent = &pDecoder->components[c];
+            uStride = 8 * (UINT32)pComponent->h;
+
+            for(by = 0; by < pComponent->v; by++)
+            {
+                for(bx = 0; bx < pComponent->h; bx++)
+                {
+                    nEnd = Jpeg_Decode_Block(pDecoder, pComponent);
+
+                    if(nEnd < 0)
+                    {
+                        #ifdef DEBUG
+
+                        logMsg("%s: Corrupt data in MCU %d.\n",__FUNCTION__,uMcu,3,4,5,6);
+
+                        #endif
+
+                        return ERROR;
+                    }
+
+                    pOut = &pDecoder->planes[c][(8*by*uStride) + (8*bx)];
+
+                    if(nEnd == 1)
+                    {
+                        Jpeg_Fill_Block(pDecoder->coef[0], pOut, uStride);
+                    }
+                    else
+                    {
+                        Jpeg_Idct(pDecoder->coef, pOut, uStride);
+                    }
+                }
+            }
+        }
+
+        Jpeg_Store_Mcu(pDecoder, pRgb, (uMcu % uMcusX) * uMcuWidth, (uMcu / uMcusX) * uMcuHeight);
+    }
+
+    return OK;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Restart(pJPEG_DECODER pDecoder)                                   *
+ * Description:  Skips to the data after the next RSTn marker and starts a new restart       *
+ *               interval. If the marker is missing the data is resynchronised at the next  *
+ *               one, so a damaged interval costs only its own MCUs.                        *
+ ********************************************************************************************/
+
+VOID Jpeg_Restart(pJPEG_DECODER pDecoder)
+{
+    UINT32 c = 0;
+
+    while((pDecoder->pData + 1) < pDecoder->pEnd)
+    {
+        if((pDecoder->pData[0] == JPEG_MARKER_PREFIX) && (pDecoder->pData[1] >= JPEG_MARKER_RST0) && (pDecoder->pData[1] <= JPEG_MARKER_RST7))
+        {
+            pDecoder->pData += 2;
+            break;
+        }
+
+        pDecoder->pData++;
+    }
+
+    pDecoder->bits       = 0;
+    pDecoder->bit_count  = 0;
+    pDecoder->marker_hit = 0;
+
+    for(c = 0; c < pDecoder->num_components; c++)
+    {
+        pDecoder->components[c].dc_pred = 0;
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Fill_Bits(pJPEG_DECODER pDecoder)                                 *
+ * Description:  Tops the bit buffer up to at least 25 bits, so that a Huffman code and the  *
+ *               bits of its value can be read without checking again. A stuffed 0xFF00 is  *
+ *               read as 0xFF; at a marker or at the end of the data zeros are read, and the *
+ *               marker is left for Jpeg_Restart().                                          *
+ ********************************************************************************************/
+
+VOID Jpeg_Fill_Bits(pJPEG_DECODER pDecoder)
+{
+    UINT32 uByte = 0;
+
+    while(pDecoder->bit_count <= 24)
+    {
+        uByte = 0;
+
+        if((pDecoder->marker_hit == 0) && (pDecoder->pData < pDecoder->pEnd))
+        {
+            uByte = *pDecoder->pData;
+
+            if(uByte != JPEG_MARKER_PREFIX)
+            {
+                pDecoder->pData++;
+            }
+            else if(((pDecoder->pData + 1) < pDecoder->pEnd) && (pDecoder->pData[1] == 0x00))
+            {
+                pDecoder->pData += 2;
+            }
+            else
+            {
+                pDecoder->marker_hit = 1;
+                uByte = 0;
+            }
+        }
+
+        pDecoder->bits |= uByte << (24 - pDecoder->bit_count);
+        pDecoder->bit_count += 8;
+    }
+}
+
+/*********************************************************************************************
+ * Function:     INT32 Jpeg_Decode_Huffman(pJPEG_DECODER pDecoder, pJPEG_HUFFMAN pTable)     *
+ * Description:  Reads one Huffman code and returns its symbol, or -1 if the bits are not a  *
+ *               code of the table.                                                          *
+ ********************************************************************************************/
+
+INT32 Jpeg_Decode_Huffman(pJPEG_DECODER pDecoder, pJPEG_HUFFMAN pTable)
+{
+    UINT32 uEntry = 0, uLength = 0, uCode = 0;
+
+    if(pDecoder->bit_count < JPEG_MAX_CODE_LENGTH)
+    {
+        Jpeg_Fill_Bits(pDecoder);
+    }
+
+    uEntry = pTable->lookup[pDecoder->bits >> (32 - JPEG_HUFFMAN_LOOKUP_BITS)];
+
+    if(uEntry != 0)
+    {
+        uLength = uEntry >> 8;
+        pDecoder->bits <<= uLength;
+        pDecoder->bit_count -= uLength;
+
+        return (INT32)(uEntry & 0xFF);
+    }
+
+    for(uLength = JPEG_HUFFMAN_LOOKUP_BITS + 1; uLength <= JPEG_MAX_CODE_LENGTH; uLength++)
+    {
+        uCode = pDecoder->bits >> (32 - uLength);
+
+        if((INT32)uCode <= pTable->maxcode[uLength])
+        {
+            pDecoder->bits <<= uLength;
+            pDecoder->bit_count -= uLength;
+
+            return pTable->values[(INT32)uCode + pTable->valoffset[uLength]];
+        }
+    }
+
+    return -1;
+}
+
+/*********************************************************************************************
+ * Function:     INT32 Jpeg_Receive_Extend(pJPEG_DECODER pDecoder, UINT32 uSize)             *
+ * Description:  Reads the uSize bits of a coefficient and returns its signed value (RECEIVE *
+ *               and EXTEND of Annex F).                                                     *
+ ********************************************************************************************/
+
+INT32 Jpeg_Receive_Extend(pJPEG_DECODER pDecoder, UINT32 uSize)
+{
+    INT32 nValue = 0;
+
+    if(uSize == 0)
+    {
+        return 0;
+    }
+
+    if(pDecoder->bit_count < (INT32)uSize)
+    {
+        Jpeg_Fill_Bits(pDecoder);
+    }
+
+    nValue = (INT32)(pDecoder->bits >> (32 - uSize));
+    pDecoder->bits <<= uSize;
+    pDecoder->bit_count -= uSize;
+
+    if(nValue < (1 << (uSize - 1)))
+    {
+        nValue -= (1 << uSize) - 1;
+    }
+
+    return nValue;
+}
+
+/*********************************************************************************************
+ * Function:     INT16 Jpeg_Dequantize(INT32 nValue, UINT16 uQuant)                          *
+ * Description:  Returns nValue * uQuant saturated to 16 bits. Corrupt data can code values  *
+ *               whose product does not fit, and the IDCT relies on 16 bit coefficients.     *
+ ********************************************************************************************/
+
+INT16 Jpeg_Dequantize(INT32 nValue, UINT16 uQuant)
+{
+    if((uQuant != 0) && (nValue > (32767 / (INT32)uQuant)))
+    {
+        return 32767;
+    }
+
+    if((uQuant != 0) && (nValue < (-32768 / (INT32)uQuant)))
+    {
+        return -32768;
+    }
+
+    return (INT16)(nValue * (INT32)uQuant);
+}
+
+/*********************************************************************************************
+ * Function:     INT32 Jpeg_Decode_Block(pJPEG_DECODER pDecoder, pJPEG_COMPONENT pComponent) *
+ * Description:  Decodes and dequantizes one block of the component into pDecoder->coef.     *
+ *               Returns one more than the zigzag position of the last coefficient, so 1     *
+ *               means only the DC coefficient is set, or -1 if the data is corrupt.         *
+ ********************************************************************************************/
+
+INT32 Jpeg_Decode_Block(pJPEG_DECODER pDecoder, pJPEG_COMPONENT pComponent)
+{
+    const UINT16 *pQuant = pDecoder->quant[pComponent->tq];
+    pJPEG_HUFFMAN pAc = &pDecoder->ac_tables[pComponent->ta];
+    INT32 nSymbol = 0, nEnd = 1;
+    UINT32 k = 1, uRun = 0, uSize = 0;
+
+    memset(pDecoder->coef, 0, sizeof(pDecoder->coef));
+
+    nSymbol = Jpeg_Decode_Huffman(pDecoder, &pDecoder->dc_tables[pComponent->td]);
+
+    if((nSymbol < 0) || (nSymbol > 11))
+    {
+        return -1;
+    }
+
+    pComponent->dc_pred = JPEG_SATURATE_16(pComponent->dc_pred + Jpeg_Receive_Extend(pDecoder, (UINT32)nSymbol));
+    pDecoder->coef[0] = Jpeg_Dequantize(pComponent->dc_pred, pQuant[0]);
+
+    while(k < JPEG_BLOCK_SIZE)
+    {
+        nSymbol = Jpeg_Decode_Huffman(pDecoder, pAc);
+
+        if(nSymbol < 0)
+        {
+            return -1;
+        }
+
+        uRun  = (UINT32)nSymbol >> 4;
+        uSize = (UINT32)nSymbol & 0x0F;
+
+        if(uSize == 0)
+        {
+            if(uRun != 15)
+            {
+                break;                          /* End of block */
+            }
+
+            k += 16;                            /* Sixteen zeros */
+            continue;
+        }
+
+        k += uRun;
+
+        if(k >= JPEG_BLOCK_SIZE)
+        {
+            return -1;
+        }
+
+        pDecoder->coef[jpeg_natural_order[k]] = Jpeg_Dequantize(Jpeg_Receive_Extend(pDecoder, uSize), pQuant[k]);
+
+        k++;
+        nEnd = (INT32)k;
+    }
+
+    return nEnd;
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Fill_Block(INT32 dc, UCHAR *pOut, UINT32 uStride)                 *
+ * Description:  Output of the IDCT for a block with only a DC coefficient: 64 equal samples.*
+ ********************************************************************************************/
+
+VOID Jpeg_Fill_Block(INT32 dc, UCHAR *pOut, UINT32 uStride)
+{
+    UINT32 y = 0;
+    INT32 nValue = ((dc + 4) >> 3) + 128;
+
+    if(nValue < 0)
+    {
+        nValue = 0;
+    }
+
+    if(nValue > 255)
+    {
+        nValue = 255;
+    }
+
+    for(y = 0; y < 8; y++)
+    {
+        memset(pOut + y*uStride, nValue, 8);
+    }
+}
+
+#ifdef JPEG_SSE2
+
+/* One pass of the IDCT over eight vectors of eight 16 bit values: rows[i] is input i of eight 1-D transforms. The
+ * rotations are done in 32 bits with pmaddwd on interleaved pairs, the results are rounded, shifted and packed back. */
+
+#define JPEG_ROTATE(out0, out1, x, y, k0, k1)                                   \
+    {                                                                           \
+        __m128i lo = _mm_unpacklo_epi16((x), (y));                              \
+        __m128i hi = _mm_unpackhi_epi16((x), (y));                              \
+        out0##_l = _mm_madd_epi16(lo, (k0));                                    \
+        out0##_h = _mm_madd_epi16(hi, (k0));                                    \
+        out1##_l = _mm_madd_epi16(lo, (k1));                                    \
+        out1##_h = _mm_madd_epi16(hi, (k1));                                    \
+    }
+
+#define JPEG_WIDEN(out, x)                                                      \
+    {                                                                           \
+        out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (x)), 4);    \
+        out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (x)), 4);    \
+    }
+
+#define JPEG_BUTTERFLY(dst0, dst1, a, b, shift)                                 \
+    {                                                                           \
+        dst0 = _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(a##_l, b##_l), shift), _mm_sra_epi32(_mm_add_epi32(a##_h, b##_h), shift));  \
+        dst1 = _mm_packs_epi32(_mm_sra_epi32(_mm_sub_epi32(a##_l, b##_l), shift), _mm_sra_epi32(_mm_sub_epi32(a##_h, b##_h), shift));  \
+    }
+
+#define JPEG_SUM(out, a, b, op)                                                 \
+    {                                                                           \
+        out##_l = op(a##_l, b##_l);                                             \
+        out##_h = op(a##_h, b##_h);                                             \
+    }
+
+#define JPEG_CONST(a, b)                _mm_setr_epi16((a), (b), (a), (b), (a), (b), (a), (b))
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Idct_Pass(__m128i *pRows, INT32 nBias, INT32 nShift)              *
+ * Description:  Eight 1-D IDCTs at once, the same arithmetic as one pass of Jpeg_Idct().    *
+ ********************************************************************************************/
+
+VOID Jpeg_Idct_Pass(__m128i *pRows, INT32 nBias, INT32 nShift)
+{
+    __m128i t0_l, t0_h, t1_l, t1_h, t2_l, t2_h, t3_l, t3_h;
+    __m128i x0_l, x0_h, x1_l, x1_h, x2_l, x2_h, x3_l, x3_h;
+    __m128i y0_l, y0_h, y1_l, y1_h, o0_l, o0_h, o1_l, o1_h, o2_l, o2_h, o3_l, o3_h;
+    __m128i bias_l = _mm_set1_epi32(nBias), bias_h = bias_l;
+    __m128i shift = _mm_cvtsi32_si128(nShift);
+
+    /* Even part */
+
+    JPEG_ROTATE(t2, t3, pRows[2], pRows[6], JPEG_CONST(JPEG_FIX_EVEN_A, JPEG_FIX_EVEN_B), JPEG_CONST(JPEG_FIX_EVEN_C, JPEG_FIX_EVEN_A));
+    JPEG_WIDEN(t0, _mm_add_epi16(pRows[0], pRows[4]));
+    JPEG_WIDEN(t1, _mm_sub_epi16(pRows[0], pRows[4]));
+
+    JPEG_SUM(t0, t0, bias, _mm_add_epi32);
+    JPEG_SUM(x0, t0, t3, _mm_add_epi32);
+    JPEG_SUM(x3, t0, t3, _mm_sub_epi32);
+    JPEG_SUM(t1, t1, bias, _mm_add_epi32);
+    JPEG_SUM(x1, t1, t2, _mm_add_epi32);
+    JPEG_SUM(x2, t1, t2, _mm_sub_epi32);
+
+    /* Odd part */
+
+    JPEG_ROTATE(y0, y1, _mm_add_epi16(pRows[7], pRows[3]), _mm_add_epi16(pRows[5], pRows[1]), JPEG_CONST(JPEG_FIX_ODD_P3, JPEG_FIX_ODD_P5), JPEG_CONST(JPEG_FIX_ODD_P5, JPEG_FIX_ODD_P4));
+    JPEG_ROTATE(o0, o3, pRows[7], pRows[1], JPEG_CONST(JPEG_FIX_ODD_T0, JPEG_FIX_ODD_P1), JPEG_CONST(JPEG_FIX_ODD_P1, JPEG_FIX_ODD_T3));
+    JPEG_ROTATE(o1, o2, pRows[5], pRows[3], JPEG_CONST(JPEG_FIX_ODD_T1, JPEG_FIX_ODD_P2), JPEG_CONST(JPEG_FIX_ODD_P2, JPEG_FIX_ODD_T2));
+
+    JPEG_SUM(o0, o0, y0, _mm_add_epi32);
+    JPEG_SUM(o3, o3, y1, _mm_add_epi32);
+    JPEG_SUM(o1, o1, y1, _mm_add_epi32);
+    JPEG_SUM(o2, o2, y0, _mm_add_epi32);
+
+    JPEG_BUTTERFLY(pRows[0], pRows[7], x0, o3, shift);
+    JPEG_BUTTERFLY(pRows[1], pRows[6], x1, o2, shift);
+    JPEG_BUTTERFLY(pRows[2], pRows[5], x2, o1, shift);
+    JPEG_BUTTERFLY(pRows[3], pRows[4], x3, o0, shift);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Transpose(__m128i *pRows)                                         *
+ * Description:  Transposes an 8x8 block of 16 bit values held in eight vectors.             *
+ ********************************************************************************************/
+
+VOID Jpeg_Transpose(__m128i *pRows)
+{
+    __m128i a0 = _mm_unpacklo_epi16(pRows[0], pRows[1]), a1 = _mm_unpackhi_epi16(pRows[0], pRows[1]);
+    __m128i a2 = _mm_unpacklo_epi16(pRows[2], pRows[3]), a3 = _mm_unpackhi_epi16(pRows[2], pRows[3]);
+    __m128i a4 = _mm_unpacklo_epi16(pRows[4], pRows[5]), a5 = _mm_unpackhi_epi16(pRows[4], pRows[5]);
+    __m128i a6 = _mm_unpacklo_epi16(pRows[6], pRows[7]), a7 = _mm_unpackhi_epi16(pRows[6], pRows[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+
+    pRows[0] = _mm_unpacklo_epi64(b0, b4);
+    pRows[1] = _mm_unpackhi_epi64(b0, b4);
+    pRows[2] = _mm_unpacklo_epi64(b1, b5);
+    pRows[3] = _mm_unpackhi_epi64(b1, b5);
+    pRows[4] = _mm_unpacklo_epi64(b2, b6);
+    pRows[5] = _mm_unpackhi_epi64(b2, b6);
+    pRows[6] = _mm_unpacklo_epi64(b3, b7);
+    pRows[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Idct(const INT16 *pCoef, UCHAR *pOut, UINT32 uStride)             *
+ * Description:  SSE2 version: the columns are transformed as eight vectors, the block is    *
+ *               transposed, the rows are transformed the same way and it is transposed back *
+ *               and saturated to 8 bits.                                                    *
+ ********************************************************************************************/
+
+VOID Jpeg_Idct(const INT16 *pCoef, UCHAR *pOut, UINT32 uStride)
+{
+    __m128i rows[8];
+    __m128i packed;
+    UINT32 i = 0;
+
+    for(i = 0; i < 8; i++)
+    {
+        rows[i] = _mm_loadu_si128((const __m128i *)(pCoef + 8*i));
+    }
+
+    Jpeg_Idct_Pass(rows, JPEG_PASS1_BIAS, JPEG_PASS1_SHIFT);
+    Jpeg_Transpose(rows);
+    Jpeg_Idct_Pass(rows, JPEG_PASS2_BIAS, JPEG_PASS2_SHIFT);
+    Jpeg_Transpose(rows);
+
+    for(i = 0; i < 8; i += 2)
+    {
+        packed = _mm_packus_epi16(rows[i], rows[i + 1]);
+
+        _mm_storel_epi64((__m128i *)(pOut + i*uStride), packed);
+        _mm_storel_epi64((__m128i *)(pOut + (i + 1)*uStride), _mm_srli_si128(packed, 8));
+    }
+}
+
+#else
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Idct(const INT16 *pCoef, UCHAR *pOut, UINT32 uStride)             *
+ * Description:  Integer 8x8 IDCT (the LLM algorithm of libjpeg's islow IDCT): the columns   *
+ *               are transformed into a workspace kept with 2 more bits of precision, then  *
+ *               the rows are transformed, level shifted and saturated into pOut.            *
+ ********************************************************************************************/
+
+VOID Jpeg_Idct(const INT16 *pCoef, UCHAR *pOut, UINT32 uStride)
+{
+    INT32 workspace[JPEG_BLOCK_SIZE];
+    INT32 s[8];
+    INT32 t0 = 0, t1 = 0, t2 = 0, t3 = 0, x0 = 0, x1 = 0, x2 = 0, x3 = 0, y0 = 0, y1 = 0;
+    INT32 o0 = 0, o1 = 0, o2 = 0, o3 = 0, nValue = 0;
+    UINT32 uPass = 0, i = 0, j = 0;
+
+    for(uPass = 0; uPass < 2; uPass++)
+    {
+        for(i = 0; i < 8; i++)
+        {
+            /* Pass 0 reads column i of the coefficients, pass 1 row i of the workspace */
+
+            for(j = 0; j < 8; j++)
+            {
+                s[j] = (uPass == 0) ? pCoef[8*j + i] : workspace[8*i + j];
+            }
+
+            t2 = s[2]*JPEG_FIX_EVEN_A + s[6]*JPEG_FIX_EVEN_B;
+            t3 = s[2]*JPEG_FIX_EVEN_C + s[6]*JPEG_FIX_EVEN_A;
+            t0 = ((s[0] + s[4]) * 4096) + ((uPass == 0) ? JPEG_PASS1_BIAS : JPEG_PASS2_BIAS);
+            t1 = ((s[0] - s[4]) * 4096) + ((uPass == 0) ? JPEG_PASS1_BIAS : JPEG_PASS2_BIAS);
+
+            x0 = t0 + t3;
+            x3 = t0 - t3;
+            x1 = t1 + t2;
+            x2 = t1 - t2;
+
+            y0 = (s[7] + s[3])*JPEG_FIX_ODD_P3 + (s[5] + s[1])*JPEG_FIX_ODD_P5;
+            y1 = (s[7] + s[3])*JPEG_FIX_ODD_P5 + (s[5] + s[1])*JPEG_FIX_ODD_P4;
+            o0 = s[7]*JPEG_FIX_ODD_T0 + s[1]*JPEG_FIX_ODD_P1 + y0;
+            o3 = s[7]*JPEG_FIX_ODD_P1 + s[1]*JPEG_FIX_ODD_T3 + y1;
+            o1 = s[5]*JPEG_FIX_ODD_T1 + s[3]*JPEG_FIX_ODD_P2 + y1;
+            o2 = s[5]*JPEG_FIX_ODD_P2 + s[3]*JPEG_FIX_ODD_T2 + y0;
+
+            /* The workspace is saturated to 16 bits like the packed vectors of the SSE2 code. With 16 bit
+             * coefficients no sum of either pass can then leave 32 bits, whatever the data. */
+
+            if(uPass == 0)
+            {
+                workspace[8*0 + i] = JPEG_SATURATE_16((x0 + o3) >> JPEG_PASS1_SHIFT);
+                workspace[8*7 + i] = JPEG_SATURATE_16((x0 - o3) >> JPEG_PASS1_SHIFT);
+                workspace[8*1 + i] = JPEG_SATURATE_16((x1 + o2) >> JPEG_PASS1_SHIFT);
+                workspace[8*6 + i] = JPEG_SATURATE_16((x1 - o2) >> JPEG_PASS1_SHIFT);
+                workspace[8*2 + i] = JPEG_SATURATE_16((x2 + o1) >> JPEG_PASS1_SHIFT);
+                workspace[8*5 + i] = JPEG_SATURATE_16((x2 - o1) >> JPEG_PASS1_SHIFT);
+                workspace[8*3 + i] = JPEG_SATURATE_16((x3 + o0) >> JPEG_PASS1_SHIFT);
+                workspace[8*4 + i] = JPEG_SATURATE_16((x3 - o0) >> JPEG_PASS1_SHIFT);
+            }
+            else
+            {
+                s[0] = (x0 + o3) >> JPEG_PASS2_SHIFT;
+                s[7] = (x0 - o3) >> JPEG_PASS2_SHIFT;
+                s[1] = (x1 + o2) >> JPEG_PASS2_SHIFT;
+                s[6] = (x1 - o2) >> JPEG_PASS2_SHIFT;
+                s[2] = (x2 + o1) >> JPEG_PASS2_SHIFT;
+                s[5] = (x2 - o1) >> JPEG_PASS2_SHIFT;
+                s[3] = (x3 + o0) >> JPEG_PASS2_SHIFT;
+                s[4] = (x3 - o0) >> JPEG_PASS2_SHIFT;
+
+                for(j = 0; j < 8; j++)
+                {
+                    nValue = s[j];
+                    pOut[i*uStride + j] = (UCHAR)((nValue < 0) ? 0 : ((nValue > 255) ? 255 : nValue));
+                }
+            }
+        }
+    }
+}
+
+#endif
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Color_Row(const UCHAR *pY, const UCHAR *pCb, const UCHAR *pCr,    *
+ *                                   UINT32 uChromaShift, UCHAR *pRgb, UINT32 uCount)        *
+ * Description:  Converts uCount pixels of one line from YCbCr to packed RGB. With           *
+ *               uChromaShift 1 every chroma sample covers two pixels. With SSE2 eight       *
+ *               pixels are converted at a time and the rest one by one, with the same      *
+ *               arithmetic.                                                                 *
+ ********************************************************************************************/
+
+VOID Jpeg_Color_Row(const UCHAR *pY, const UCHAR *pCb, const UCHAR *pCr, UINT32 uChromaShift, UCHAR *pRgb, UINT32 uCount)
+{
+    UINT32 x = 0;
+    INT32 y = 0, cb = 0, cr = 0, r = 0, g = 0, b = 0;
+
+    #ifdef JPEG_SSE2
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i offset = _mm_set1_epi16(128);
+    __m128i kr = _mm_set1_epi16(JPEG_CR_TO_R);
+    __m128i kb = _mm_set1_epi16(JPEG_CB_TO_B);
+    __m128i kg = _mm_setr_epi16(JPEG_CB_TO_G, JPEG_CR_TO_G, JPEG_CB_TO_G, JPEG_CR_TO_G, JPEG_CB_TO_G, JPEG_CR_TO_G, JPEG_CB_TO_G, JPEG_CR_TO_G);
+    __m128i round = _mm_set1_epi32(1 << 15);
+    __m128i vy, vcb, vcr, vr, vg, vb;
+    UINT32 uChroma = 0, i = 0;
+    UCHAR red[16], green[16], blue[16];
+
+    for(; (x + 8) <= uCount; x += 8)
+    {
+        vy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pY + x)), zero);
+
+        if(uChromaShift != 0)
+        {
+            memcpy(&uChroma, pCb + (x >> 1), 4);
+            vcb = _mm_cvtsi32_si128((int)uChroma);
+            memcpy(&uChroma, pCr + (x >> 1), 4);
+            vcr = _mm_cvtsi32_si128((int)uChroma);
+            vcb = _mm_unpacklo_epi8(vcb, vcb);
+            vcr = _mm_unpacklo_epi8(vcr, vcr);
+        }
+        else
+        {
+            vcb = _mm_loadl_epi64((const __m128i *)(pCb + x));
+            vcr = _mm_loadl_epi64((const __m128i *)(pCr + x));
+        }
+
+        vcb = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(vcb, zero), offset), 2);
+        vcr = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(vcr, zero), offset), 2);
+
+        /* The high half of each product is rounded with the top bit of the low half. Green takes both chroma
+         * samples, so it is computed as one sum with pmaddwd. */
+
+        vr = _mm_add_epi16(vy, _mm_add_epi16(_mm_mulhi_epi16(vcr, kr), _mm_srli_epi16(_mm_mullo_epi16(vcr, kr), 15)));
+        vb = _mm_add_epi16(vy, _mm_add_epi16(_mm_mulhi_epi16(vcb, kb), _mm_srli_epi16(_mm_mullo_epi16(vcb, kb), 15)));
+        vg = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(vcb, vcr), kg), round), 16),
+                             _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(vcb, vcr), kg), round), 16));
+        vg = _mm_sub_epi16(vy, vg);
+
+        _mm_storeu_si128((__m128i *)red,   _mm_packus_epi16(vr, vr));
+        _mm_storeu_si128((__m128i *)green, _mm_packus_epi16(vg, vg));
+        _mm_storeu_si128((__m128i *)blue,  _mm_packus_epi16(vb, vb));
+
+        for(i = 0; i < 8; i++)
+        {
+            pRgb[0] = red[i];
+            pRgb[1] = green[i];
+            pRgb[2] = blue[i];
+            pRgb += 3;
+        }
+    }
+
+    #endif
+
+    for(; x < uCount; x++)
+    {
+        y  = pY[x];
+        cb = ((INT32)pCb[x >> uChromaShift] - 128) * 4;
+        cr = ((INT32)pCr[x >> uChromaShift] - 128) * 4;
+
+        r = y + ((cr * JPEG_CR_TO_R + (1 << 15)) >> 16);
+        g = y - ((cb * JPEG_CB_TO_G + cr * JPEG_CR_TO_G + (1 << 15)) >> 16);
+        b = y + ((cb * JPEG_CB_TO_B + (1 << 15)) >> 16);
+
+        pRgb[0] = (UCHAR)((r < 0) ? 0 : ((r > 255) ? 255 : r));
+        pRgb[1] = (UCHAR)((g < 0) ? 0 : ((g > 255) ? 255 : g));
+        pRgb[2] = (UCHAR)((b < 0) ? 0 : ((b > 255) ? 255 : b));
+        pRgb += 3;
+    }
+}
+
+/*********************************************************************************************
+ * Function:     VOID Jpeg_Store_Mcu(pJPEG_DECODER pDecoder, UCHAR *pRgb, UINT32 uX,         *
+ *                                   UINT32 uY)                                              *
+ * Description:  Converts the MCU in the planes of the decoder into the image at pixel       *
+ *               (uX, uY). The MCUs on the right and bottom edges are clipped to the image.  *
+ ********************************************************************************************/
+
+VOID Jpeg_Store_Mcu(pJPEG_DECODER pDecoder, UCHAR *pRgb, UINT32 uX, UINT32 uY)
+{
+    UINT32 uWidth  = 8 * (UINT32)pDecoder->hmax;
+    UINT32 uHeight = 8 * (UINT32)pDecoder->vmax;
+    UINT32 uVShift = (pDecoder->vmax == 2) ? 1 : 0;
+    UINT32 uHShift = (pDecoder->hmax == 2) ? 1 : 0;
+    UINT32 y = 0, x = 0;
+    UCHAR *pLine = NULL;
+    const UCHAR *pY = NULL;
+
+    if((uX + uWidth) > pDecoder->width)
+    {
+        uWidth = pDecoder->width - uX;
+    }
+
+    if((uY + uHeight) > pDecoder->height)
+    {
+        uHeight = pDecoder->height - uY;
+    }
+
+    for(y = 0; y < uHeight; y++)
+    {
+        pLine = pRgb + (((uY + y) * (UINT32)pDecoder->width) + uX) * 3;
+        pY = &pDecoder->planes[0][y * 8 * pDecoder->hmax];
+
+        if(pDecoder->num_components == 1)
+        {
+            for(x = 0; x < uWidth; x++)
+            {
+                pLine[3*x] = pLine[3*x + 1] = pLine[3*x + 2] = pY[x];
+            }
+        }
+        else
+        {
+            Jpeg_Color_Row(pY, &pDecoder->planes[1][(y >> uVShift) * 8], &pDecoder->planes[2][(y >> uVShift) * 8], uHShift, pLine, uWidth);
+        }
+    }
+}
+
+/*********************************************************************************************
+ * Function:     STATUS Jpeg_Check_Frame(const UCHAR *pJpeg, UINT32 *pLength,                *
+ *                                       UINT32 *pSosOffset, UINT8 *pHasDht)                 *
+ * Description:  Checks a frame without decoding it: it must start with SOI, the segments up *
+ *               to SOS must be well formed and it must end with EOI. *pLength is cut back   *
+ *               to the EOI marker, since some cameras pad their frames. *pSosOffset is the  *
+ *               position of the SOS marker and *pHasDht tells whether a DHT segment was     *
+ *               found before it. Returns ERROR for a damaged or truncated frame.            *
+ ********************************************************************************************/
+
+STATUS Jpeg_Check_Frame(const UCHAR *pJpeg, UINT32 *pLength, UINT32 *pSosOffset, UINT8 *pHasDht)
+{
+    UINT32 uLength = *pLength, pos = 2, uMarker = 0;
+
+    *pHasDht = 0;
+
+    if((uLength < 4) || (pJpeg[0] != JPEG_MARKER_PREFIX) || (pJpeg[1] != JPEG_MARKER_SOI))
+    {
+        return ERROR;
+    }
+
+    while(1)
+    {
+        if(((pos + 4) > uLength) || (pJpeg[pos] != JPEG_MARKER_PREFIX))
+        {
+            return ERROR;
+        }
+
+        uMarker = pJpeg[pos + 1];
+
+        if(uMarker == JPEG_MARKER_PREFIX)
+        {
+            pos++;                              /* Fill byte */
+            continue;
+        }
+
+        if(uMarker == JPEG_MARKER_SOS)
+        {
+            break;
+        }
+
+        if((uMarker == JPEG_MARKER_SOI) || (uMarker == JPEG_MARKER_EOI))
+        {
+            return ERROR;
+        }
+
+        if(uMarker == JPEG_MARKER_DHT)
+        {
+            *pHasDht = 1;
+        }
+
+        if((uMarker == JPEG_MARKER_TEM) || ((uMarker >= JPEG_MARKER_RST0) && (uMarker <= JPEG_MARKER_RST7)))
+        {
+            pos += 2;                           /* No length follows */
+        }
+        else
+        {
+            pos += 2 + (((UINT32)pJpeg[pos + 2] << 8) | pJpeg[pos + 3]);
+        }
+    }
+
+    *pSosOffset = pos;
+
+    /* Entropy coded data cannot contain 0xFF 0xD9, so the last one in the frame is its EOI */
+
+    for(pos = uLength - 2; pos > *pSosOffset; pos--)
+    {
+        if((pJpeg[pos] == JPEG_MARKER_PREFIX) && (pJpeg[pos + 1] == JPEG_MARKER_EOI))
+        {
+            *pLength = pos + 2;
+
+            return OK;
+        }
+    }
+
+    return ERROR;
+}
+
+/*********************************************************************************************
+ * Function:     UINT32 Jpeg_Build_Dht_Segment(UCHAR *pBuffer)                               *
+ * Description:  Writes a DHT segment with the four standard tables to pBuffer, numbered as  *
+ *               Jpeg_Load_Default_Tables() numbers them, and returns its length,            *
+ *               JPEG_DHT_SEGMENT_LENGTH.                                                    *
+ ********************************************************************************************/
+
+UINT32 Jpeg_Build_Dht_Segment(UCHAR *pBuffer)
+{
+    const UCHAR *pCounts[4] = { jpeg_dc_luminance_counts, jpeg_dc_chrominance_counts, jpeg_ac_luminance_counts, jpeg_ac_chrominance_counts };
+    const UCHAR *pValues[4] = { jpeg_dc_luminance_values, jpeg_dc_chrominance_values, jpeg_ac_luminance_values, jpeg_ac_chrominance_values };
+    const UCHAR uClassId[4] = { 0x00, 0x01, 0x10, 0x11 };  /* Tc << 4 | Th */
+    UINT32 pos = 4, i = 0, j = 0, uTotal = 0;
+
+    pBuffer[0] = JPEG_MARKER_PREFIX;
+    pBuffer[1] = JPEG_MARKER_DHT;
+    pBuffer[2] = (UCHAR)((JPEG_DHT_SEGMENT_LENGTH - 2) >> 8);
+    pBuffer[3] = (UCHAR)(JPEG_DHT_SEGMENT_LENGTH - 2);
+
+    for(i = 0; i < 4; i++)
+    {
+        pBuffer[pos++] = uClassId[i];
+
+        for(j = 0, uTotal = 0; j < JPEG_MAX_CODE_LENGTH; j++)
+        {
+            pBuffer[pos++] = pCounts[i][j];
+            uTotal += pCounts[i][j];
+        }
+
+        memcpy(&pBuffer[pos], pValues[i], uTotal);
+        pos += uTotal;
+    }
+
+    return pos;
+}
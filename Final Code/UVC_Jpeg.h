@@ -0,0 +1,143 @@
+/**********************************************************************************************************
+ * Name:         UVC_Jpeg.h                                                                               *
+ * Author:       Neel Desai, University of Colorado - Boulder                                             *
+ * Date:         04/19/2014                                                                               *
+ * Description:  -> The file contains the function declarations, macros and structures used by the        *
+ *                  baseline JPEG decoder in UVC_Jpeg.c, which turns the frames of an MJPEG stream into   *
+ *                  the same packed RGB data processImage() makes from YUYV frames.                       *
+ *                                                                                                        *
+ *********************************************************************************************************/
+
+
+
+/************************************************************
+ *                                                          *
+ *                          MACROS                          *
+ *                                                          *
+ ***********************************************************/
+
+/******************** Marker related macros ****************/
+
+#define JPEG_MARKER_PREFIX                              0xFF
+#define JPEG_MARKER_SOI                                 0xD8                /* Start of image */
+#define JPEG_MARKER_EOI                                 0xD9                /* End of image */
+#define JPEG_MARKER_SOF0                                0xC0                /* Baseline DCT */
+#define JPEG_MARKER_SOF1                                0xC1                /* Extended sequential DCT, decoded like baseline with 8 bit samples */
+#define JPEG_MARKER_SOF15                               0xCF                /* Last of the SOF markers, which are 0xC0 - 0xCF without DHT, JPG and DAC */
+#define JPEG_MARKER_DHT                                 0xC4
+#define JPEG_MARKER_JPG                                 0xC8
+#define JPEG_MARKER_DAC                                 0xCC
+#define JPEG_MARKER_RST0                                0xD0                /* RST0 - RST7 end a restart interval */
+#define JPEG_MARKER_RST7                                0xD7
+#define JPEG_MARKER_SOS                                 0xDA
+#define JPEG_MARKER_DQT                                 0xDB
+#define JPEG_MARKER_DRI                                 0xDD
+#define JPEG_MARKER_TEM                                 0x01                /* Standalone, like RSTn: no length follows */
+
+/******************** Decoder related macros ***************/
+
+#define JPEG_BLOCK_SIZE                                 64                  /* Coefficients of an 8x8 block */
+#define JPEG_MAX_COMPONENTS                             3                   /* Y, Cb and Cr, or Y alone */
+#define JPEG_MAX_QUANT_TABLES                           4
+#define JPEG_MAX_HUFFMAN_TABLES                         2                   /* Of each class in a baseline stream */
+#define JPEG_MAX_SAMPLING                               2                   /* Largest sampling factor of the luma component */
+#define JPEG_MCU_PLANE_SIZE                             (JPEG_BLOCK_SIZE * JPEG_MAX_SAMPLING * JPEG_MAX_SAMPLING)
+#define JPEG_HUFFMAN_LOOKUP_BITS                        9                   /* Codes up to this length are decoded with one table lookup */
+#define JPEG_MAX_CODE_LENGTH                            16
+#define JPEG_TABLES_DEFAULT                             0x0F                /* default_tables: both DC and both AC tables are the standard ones */
+#define JPEG_DHT_SEGMENT_LENGTH                         420                 /* Marker, length and the four standard tables of Annex K.3 */
+
+/************************************************************
+ *                                                          *
+ *                          STRUCTURES                      *
+ *                                                          *
+ ***********************************************************/
+
+/* A Huffman table. lookup[] is indexed by the next JPEG_HUFFMAN_LOOKUP_BITS bits of the stream and holds
+ * (code length << 8) | symbol, or 0 if the code is longer; longer codes are found through maxcode[] and valoffset[]. */
+
+typedef struct jpeg_huffman
+{
+    UINT16                      lookup[1 << JPEG_HUFFMAN_LOOKUP_BITS];
+    INT32                       maxcode[JPEG_MAX_CODE_LENGTH + 1];      /* Largest code of each length, -1 if there is none */
+    INT32                       valoffset[JPEG_MAX_CODE_LENGTH + 1];    /* Symbol of code c of length l is values[c + valoffset[l]] */
+    UCHAR                       values[256];
+} JPEG_HUFFMAN, *pJPEG_HUFFMAN;
+
+/* One component of the frame, from the SOF and SOS segments */
+
+typedef struct jpeg_component
+{
+    UINT8                       id;
+    UINT8                       h;                              /* Horizontal sampling factor */
+    UINT8                       v;                              /* Vertical sampling factor */
+    UINT8                       tq;                             /* Quantization table */
+    UINT8                       td;                             /* DC Huffman table */
+    UINT8                       ta;                             /* AC Huffman table */
+    INT32                       dc_pred;                        /* DC value of the previous block */
+} JPEG_COMPONENT, *pJPEG_COMPONENT;
+
+/* Everything needed to decode a frame. It is about 7 kB, too large for the stack of the image task, so each camera
+ * allocates one when it streams MJPEG and keeps it, together with the Huffman tables built from it, for every frame. */
+
+typedef struct jpeg_decoder
+{
+    UINT16                      quant[JPEG_MAX_QUANT_TABLES][JPEG_BLOCK_SIZE];  /* In zigzag order, as in the DQT segment */
+    UINT8                       quant_defined;                  /* Bit n is set once table n has been read */
+    JPEG_HUFFMAN                dc_tables[JPEG_MAX_HUFFMAN_TABLES];
+    JPEG_HUFFMAN                ac_tables[JPEG_MAX_HUFFMAN_TABLES];
+    UINT8                       default_tables;                 /* Bits 0-1: DC tables, bits 2-3: AC tables still holding the standard tables */
+
+    JPEG_COMPONENT              components[JPEG_MAX_COMPONENTS];
+    UINT8                       num_components;
+    UINT8                       hmax;                           /* Largest sampling factors, which give the size of the MCU */
+    UINT8                       vmax;
+    UINT16                      width;
+    UINT16                      height;
+    UINT16                      restart_interval;               /* MCUs between RSTn markers, 0 if there are none */
+
+    const UCHAR                 *pData;                         /* Next byte of entropy coded data */
+    const UCHAR                 *pEnd;
+    UINT32                      bits;                           /* Bit buffer, the next bit is the most significant one */
+    INT32                       bit_count;                      /* Valid bits in bits */
+    UINT8                       marker_hit;                     /* A marker ended the entropy coded data; zeros are read from now on */
+
+    INT16                       coef[JPEG_BLOCK_SIZE];          /* Dequantized coefficients of the current block, in natural order */
+    UCHAR                       planes[JPEG_MAX_COMPONENTS][JPEG_MCU_PLANE_SIZE];  /* Samples of the current MCU */
+} JPEG_DECODER, *pJPEG_DECODER;
+
+/************************************************************
+ *                                                          *
+ *                          FUNCTIONS                       *
+ *                                                          *
+ ***********************************************************/
+
+/****************** Decoder related functions **************/
+
+VOID Jpeg_Decoder_Init(pJPEG_DECODER pDecoder);
+STATUS Jpeg_Decode(pJPEG_DECODER pDecoder, const UCHAR *pJpeg, UINT32 uLength, UCHAR *pRgb, UINT32 uRgbSize);
+STATUS Jpeg_Read_Headers(pJPEG_DECODER pDecoder, const UCHAR *pJpeg, UINT32 uLength, const UCHAR **ppScan);
+STATUS Jpeg_Decode_Scan(pJPEG_DECODER pDecoder, UCHAR *pRgb);
+STATUS Jpeg_Build_Huffman(pJPEG_HUFFMAN pTable, const UCHAR *pCounts, const UCHAR *pValues);
+VOID Jpeg_Load_Default_Tables(pJPEG_DECODER pDecoder);
+VOID Jpeg_Restart(pJPEG_DECODER pDecoder);
+
+/****************** Entropy decoding functions *************/
+
+VOID Jpeg_Fill_Bits(pJPEG_DECODER pDecoder);
+INT32 Jpeg_Decode_Huffman(pJPEG_DECODER pDecoder, pJPEG_HUFFMAN pTable);
+INT32 Jpeg_Receive_Extend(pJPEG_DECODER pDecoder, UINT32 uSize);
+INT16 Jpeg_Dequantize(INT32 nValue, UINT16 uQuant);
+INT32 Jpeg_Decode_Block(pJPEG_DECODER pDecoder, pJPEG_COMPONENT pComponent);
+
+/****************** Pixel related functions ****************/
+
+VOID Jpeg_Idct(const INT16 *pCoef, UCHAR *pOut, UINT32 uStride);
+VOID Jpeg_Fill_Block(INT32 dc, UCHAR *pOut, UINT32 uStride);
+VOID Jpeg_Color_Row(const UCHAR *pY, const UCHAR *pCb, const UCHAR *pCr, UINT32 uChromaShift, UCHAR *pRgb, UINT32 uCount);
+VOID Jpeg_Store_Mcu(pJPEG_DECODER pDecoder, UCHAR *pRgb, UINT32 uX, UINT32 uY);
+
+/****************** Passthrough related functions *********/
+
+STATUS Jpeg_Check_Frame(const UCHAR *pJpeg, UINT32 *pLength, UINT32 *pSosOffset, UINT8 *pHasDht);
+UINT32 Jpeg_Build_Dht_Segment(UCHAR *pBuffer);